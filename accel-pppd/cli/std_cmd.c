@@ -64,6 +64,7 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_sendv(client, "  context_count: %u\r\n", triton_stat.context_count);
 	cli_sendv(client, "  context_sleeping: %u\r\n", triton_stat.context_sleeping);
 	cli_sendv(client, "  context_pending: %u\r\n", triton_stat.context_pending);
+	cli_sendv(client, "  context_stolen: %u\r\n", triton_stat.context_stolen);
 	cli_sendv(client, "  md_handler_count: %u\r\n", triton_stat.md_handler_count);
 	cli_sendv(client, "  md_handler_pending: %u\r\n", triton_stat.md_handler_pending);
 	cli_sendv(client, "  timer_count: %u\r\n", triton_stat.timer_count);
@@ -96,6 +97,38 @@ static void exit_help(char * const *fields, int fields_cnt, void *client)
 
 //=============================
 
+static void terminate_all(triton_event_func func)
+{
+	struct ap_session *ses;
+	struct triton_ctx_call_t *calls;
+	int n = 0;
+
+	pthread_rwlock_rdlock(&ses_lock);
+	list_for_each_entry(ses, &ses_list, entry)
+		n++;
+
+	calls = n ? _malloc(n * sizeof(*calls)) : NULL;
+	if (!calls) {
+		list_for_each_entry(ses, &ses_list, entry)
+			triton_context_call(ses->ctrl->ctx, func, ses);
+		pthread_rwlock_unlock(&ses_lock);
+		return;
+	}
+
+	n = 0;
+	list_for_each_entry(ses, &ses_list, entry) {
+		calls[n].ctx = ses->ctrl->ctx;
+		calls[n].func = func;
+		calls[n].arg = ses;
+		n++;
+	}
+
+	triton_context_call_batch(calls, n);
+	pthread_rwlock_unlock(&ses_lock);
+
+	_free(calls);
+}
+
 static void __terminate_soft(struct ap_session *ses)
 {
 	ap_session_terminate(ses, TERM_NAS_REQUEST, 0);
@@ -164,34 +197,35 @@ static int terminate_exec2(int key, char * const *f, int f_cnt, void *cli)
 		ipaddr = inet_addr(f[2]);
 
 	pthread_rwlock_rdlock(&ses_lock);
-	list_for_each_entry(ses, &ses_list, entry) {
-		switch (key) {
-			case 0:
-				if (!ses->username || strcmp(ses->username, f[2]))
-					continue;
-				break;
-			case 1:
-				if (ses->ipv4 && ses->ipv4->peer_addr != ipaddr)
-					continue;
-				break;
-			case 2:
-				if (strcmp(ses->ctrl->calling_station_id, f[2]))
-					continue;
-				break;
-			case 3:
-				if (strcmp(ses->sessionid, f[2]))
-					continue;
-				break;
-			case 4:
-				if (strcmp(ses->ifname, f[2]))
-					continue;
-				break;
-		}
+	switch (key) {
+		case 0:
+			ses = ap_session_find_username(f[2], NULL);
+			break;
+		case 1:
+			ses = ap_session_find_ipv4(ipaddr);
+			break;
+		case 2:
+			list_for_each_entry(ses, &ses_list, entry) {
+				if (ses->ctrl->calling_station_id && !strcmp(ses->ctrl->calling_station_id, f[2]))
+					break;
+			}
+			if (&ses->entry == &ses_list)
+				ses = NULL;
+			break;
+		case 3:
+			ses = ap_session_find_sessionid(f[2]);
+			break;
+		case 4:
+			ses = ap_session_find_ifname(f[2]);
+			break;
+		default:
+			ses = NULL;
+	}
+	if (ses) {
 		if (hard)
 			triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_hard, ses);
 		else
 			triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_soft, ses);
-		break;
 	}
 	pthread_rwlock_unlock(&ses_lock);
 
@@ -200,7 +234,6 @@ static int terminate_exec2(int key, char * const *f, int f_cnt, void *cli)
 
 static int terminate_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
 {
-	struct ap_session *ses;
 	int hard = 0;
 
 	if (fields_cnt == 1)
@@ -229,14 +262,10 @@ static int terminate_exec(const char *cmd, char * const *fields, int fields_cnt,
 	} else if (fields_cnt != 2)
 		return CLI_CMD_SYNTAX;
 
-	pthread_rwlock_rdlock(&ses_lock);
-	list_for_each_entry(ses, &ses_list, entry) {
-		if (hard)
-			triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_hard, ses);
-		else
-			triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_soft, ses);
-	}
-	pthread_rwlock_unlock(&ses_lock);
+	if (hard)
+		terminate_all((triton_event_func)__terminate_hard);
+	else
+		terminate_all((triton_event_func)__terminate_soft);
 
 	return CLI_CMD_OK;
 }
@@ -274,16 +303,10 @@ static void __terminate_hard2(struct ap_session *ses)
 
 static void terminate_all_sessions(int hard)
 {
-	struct ap_session *ses;
-
-	pthread_rwlock_rdlock(&ses_lock);
-	list_for_each_entry(ses, &ses_list, entry) {
-		if (hard)
-			triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_hard2, ses);
-		else
-			triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_soft2, ses);
-	}
-	pthread_rwlock_unlock(&ses_lock);
+	if (hard)
+		terminate_all((triton_event_func)__terminate_hard2);
+	else
+		terminate_all((triton_event_func)__terminate_soft2);
 }
 
 static int shutdown_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
@@ -27,6 +27,21 @@
 
 #define BUF_SIZE 4096
 
+#define DHCPV4_BATCH 16
+#define DHCPV4_RAW_HDR_LEN (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+struct dhcpv4_tx {
+	int fd;
+	struct dhcpv4_packet *pack;
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_ll ll;
+	} addr;
+	socklen_t addrlen;
+	uint8_t hdr[DHCPV4_RAW_HDR_LEN];
+	struct iovec iov[2];
+};
+
 struct dhcpv4_relay_ctx {
 	struct list_head entry;
 	struct triton_context_t *ctx;
@@ -38,7 +53,6 @@ static in_addr_t conf_dns1;
 static in_addr_t conf_dns2;
 
 static mempool_t pack_pool;
-static mempool_t opt_pool;
 
 static LIST_HEAD(relay_list);
 static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -46,7 +60,13 @@ static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_key_t raw_sock_key;
 static __thread int raw_sock = -1;
 
+/* per-thread receive buffers and reply queue, tx_cnt is -1 outside of dhcpv4_read */
+static __thread struct dhcpv4_packet *rx_pack[DHCPV4_BATCH];
+static __thread struct dhcpv4_tx tx_queue[DHCPV4_BATCH];
+static __thread int tx_cnt = -1;
+
 static int dhcpv4_read(struct triton_md_handler_t *h);
+static void dhcpv4_tx_flush(void);
 int dhcpv4_packet_add_opt(struct dhcpv4_packet *pack, int type, const void *data, int len);
 
 static int open_raw_sock(void)
@@ -296,6 +316,29 @@ void dhcpv4_print_packet(struct dhcpv4_packet *pack, int relay, void (*print)(co
 	print("]\n");
 }
 
+static struct dhcpv4_option *dhcpv4_packet_reg_opt(struct dhcpv4_packet *pack, int type, uint8_t *data, int len)
+{
+	struct dhcpv4_option *opt;
+
+	if (pack->opt_cnt == DHCPV4_MAX_OPTS)
+		return NULL;
+
+	opt = &pack->opts[pack->opt_cnt++];
+	opt->type = type;
+	opt->len = len;
+	opt->data = data;
+
+	if (!pack->opt_idx[type])
+		pack->opt_idx[type] = pack->opt_cnt;
+
+	if (type == 82)
+		pack->relay_agent = opt;
+	else if (type == 62)
+		pack->client_id = opt;
+
+	return opt;
+}
+
 static int dhcpv4_parse_packet(struct dhcpv4_packet *pack, int len)
 {
 	struct dhcpv4_option *opt;
@@ -329,28 +372,20 @@ static int dhcpv4_parse_packet(struct dhcpv4_packet *pack, int len)
 			break;
 		}
 
-		opt = mempool_alloc(opt_pool);
-		if (!opt) {
-			log_emerg("out of memory\n");
+		if (ptr + 2 > endptr || ptr + 2 + ptr[1] > endptr)
 			return -1;
-		}
-		memset(opt, 0, sizeof(*opt));
-		opt->type = *ptr++;
-		opt->len = *ptr++;
-		opt->data = ptr;
-		ptr += opt->len;
 
-		if (ptr > endptr)
+		opt = dhcpv4_packet_reg_opt(pack, ptr[0], ptr + 2, ptr[1]);
+		if (!opt) {
+			if (conf_verbose)
+				log_warn("dhcpv4: too many options\n");
 			return -1;
+		}
 
-		list_add_tail(&opt->entry, &pack->options);
+		ptr += 2 + opt->len;
 
 		if (opt->type == 53)
 			pack->msg_type = opt->data[0];
-		else if (opt->type == 82)
-			pack->relay_agent = opt;
-		else if (opt->type == 62)
-			pack->client_id = opt;
 		else if (opt->type == 50)
 			pack->request_ip = *(uint32_t *)opt->data;
 		else if (opt->type == 54)
@@ -380,9 +415,7 @@ static struct dhcpv4_packet *dhcpv4_packet_alloc()
 	if (!pack)
 		return NULL;
 
-	memset(pack, 0, sizeof(*pack));
-
-	INIT_LIST_HEAD(&pack->options);
+	memset(pack, 0, offsetof(typeof(*pack), opts));
 
 	pack->hdr = (struct dhcpv4_hdr *)pack->data;
 	pack->ptr = (uint8_t *)(pack->hdr + 1);
@@ -398,31 +431,11 @@ void dhcpv4_packet_ref(struct dhcpv4_packet *pack)
 	__sync_add_and_fetch(&pack->refs, 1);
 }
 
-struct dhcpv4_option *dhcpv4_packet_find_opt(struct dhcpv4_packet *pack, int type)
-{
-	struct dhcpv4_option *opt;
-
-	list_for_each_entry(opt, &pack->options, entry) {
-		if (opt->type == type)
-			return opt;
-	}
-
-	return NULL;
-}
-
 void dhcpv4_packet_free(struct dhcpv4_packet *pack)
 {
-	struct dhcpv4_option *opt;
-
 	if (__sync_sub_and_fetch(&pack->refs, 1))
 		return;
 
-	while (!list_empty(&pack->options)) {
-		opt = list_entry(pack->options.next, typeof(*opt), entry);
-		list_del(&opt->entry);
-		mempool_free(opt);
-	}
-
 	mempool_free(pack);
 }
 
@@ -454,11 +467,19 @@ int dhcpv4_packet_insert_opt82(struct dhcpv4_packet *pack, const char *agent_cir
 {
 	int len1 = strlen(agent_circuit_id);
 	int len2 = strlen(agent_remote_id);
-	uint8_t *data = _malloc(4 + len1 + len2);
-	uint8_t *ptr = data;
-	int r;
+	uint8_t *ptr;
+
+	if (4 + len1 + len2 > 255)
+		return -1;
 
-	pack->ptr--;
+	/* overwrite the end option */
+	ptr = pack->ptr - 1;
+
+	if (!dhcpv4_packet_reg_opt(pack, 82, ptr + 2, 4 + len1 + len2))
+		return -1;
+
+	*ptr++ = 82;
+	*ptr++ = 4 + len1 + len2;
 
 	*ptr++ = 1;
 	*ptr++ = len1;
@@ -468,56 +489,87 @@ int dhcpv4_packet_insert_opt82(struct dhcpv4_packet *pack, const char *agent_cir
 	*ptr++ = len2;
 	memcpy(ptr, agent_remote_id, len2); ptr += len2;
 
-	r = dhcpv4_packet_add_opt(pack, 82, data, 4 + len1 + len2);
-	_free(data);
+	*ptr++ = 255;
 
-	*pack->ptr++ = 255;
+	pack->ptr = ptr;
 
-	return r;
+	return 0;
 }
 
 static int dhcpv4_read(struct triton_md_handler_t *h)
 {
 	struct dhcpv4_packet *pack;
 	struct dhcpv4_serv *serv = container_of(h, typeof(*serv), hnd);
-	struct sockaddr_in addr;
-	socklen_t len;
-	int n;
+	struct sockaddr_in addr[DHCPV4_BATCH];
+	struct iovec iov[DHCPV4_BATCH];
+	struct mmsghdr mmsg[DHCPV4_BATCH];
+	int i, n, cnt;
+
+	/* replies generated while handling this batch are sent by dhcpv4_tx_flush */
+	tx_cnt = 0;
 
 	while (1) {
-		pack = dhcpv4_packet_alloc();
-		if (!pack) {
+		for (cnt = 0; cnt < DHCPV4_BATCH; cnt++) {
+			if (!rx_pack[cnt]) {
+				rx_pack[cnt] = dhcpv4_packet_alloc();
+				if (!rx_pack[cnt])
+					break;
+			}
+
+			iov[cnt].iov_base = rx_pack[cnt]->data;
+			iov[cnt].iov_len = BUF_SIZE;
+
+			memset(&mmsg[cnt].msg_hdr, 0, sizeof(mmsg[cnt].msg_hdr));
+			mmsg[cnt].msg_hdr.msg_name = &addr[cnt];
+			mmsg[cnt].msg_hdr.msg_namelen = sizeof(addr[cnt]);
+			mmsg[cnt].msg_hdr.msg_iov = &iov[cnt];
+			mmsg[cnt].msg_hdr.msg_iovlen = 1;
+		}
+
+		if (!cnt) {
 			log_emerg("out of memory\n");
+			dhcpv4_tx_flush();
+			tx_cnt = -1;
 			return 1;
 		}
 
-		len = sizeof(addr);
-		n = recvfrom(h->fd, pack->data, BUF_SIZE, 0, &addr, &len);
+		n = recvmmsg(h->fd, mmsg, cnt, 0, NULL);
 		if (n == -1) {
-			mempool_free(pack);
 			if (errno == EAGAIN)
-				return 0;
+				break;
 			log_error("dhcpv4: recv: %s\n", strerror(errno));
 			continue;
 		}
 
-		if (dhcpv4_parse_packet(pack, n)) {
-			dhcpv4_packet_free(pack);
-			continue;
-		}
+		for (i = 0; i < n; i++) {
+			pack = rx_pack[i];
+			rx_pack[i] = NULL;
+
+			if (dhcpv4_parse_packet(pack, mmsg[i].msg_len)) {
+				dhcpv4_packet_free(pack);
+				continue;
+			}
+
+			if (pack->hdr->op != DHCP_OP_REQUEST) {
+				dhcpv4_packet_free(pack);
+				continue;
+			}
+
+			pack->src_addr = addr[i].sin_addr.s_addr;
+
+			if (serv->recv)
+				serv->recv(serv, pack);
 
-		if (pack->hdr->op != DHCP_OP_REQUEST) {
 			dhcpv4_packet_free(pack);
-			continue;
 		}
 
-		pack->src_addr = addr.sin_addr.s_addr;
+		dhcpv4_tx_flush();
+	}
 
-		if (serv->recv)
-			serv->recv(serv, pack);
+	dhcpv4_tx_flush();
+	tx_cnt = -1;
 
-		dhcpv4_packet_free(pack);
-	}
+	return 0;
 }
 
 static int dhcpv4_relay_read(struct triton_md_handler_t *h)
@@ -565,50 +617,117 @@ static int dhcpv4_relay_read(struct triton_md_handler_t *h)
 }
 
 
-uint16_t ip_csum(uint16_t *buf, int len)
+/*
+ * the header has no options, so sum it as five 32-bit words and fold,
+ * it follows the 14 byte ethernet header, words are loaded via memcpy
+ */
+static inline uint16_t ip_hdr_csum(const struct iphdr *ip)
 {
-	uint32_t sum=0;
-	int i;
+	uint32_t w[5];
+	uint64_t sum;
 
-	for (i=0; i < len; i += 2)
-		sum += *buf++;
+	memcpy(w, ip, sizeof(w));
+	sum = (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4];
 
-	// take only 16 bits out of the 32 bit sum and add up the carries
 	while (sum >> 16)
-	  sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
 
-	// one's complement the result
-	sum = ~sum;
+	return ~sum & 0xffff;
+}
 
-	return sum & 0xffff;
+static int dhcpv4_xmit(int fd, struct dhcpv4_packet *pack, const void *addr, socklen_t addrlen, const void *hdr, int hdr_len)
+{
+	struct dhcpv4_tx tx_buf, *tx;
+	struct msghdr msg;
+	int len = pack->ptr - pack->data;
+
+	if (tx_cnt == DHCPV4_BATCH)
+		dhcpv4_tx_flush();
+
+	tx = tx_cnt == -1 ? &tx_buf : &tx_queue[tx_cnt];
+
+	tx->fd = fd;
+	memcpy(&tx->addr, addr, addrlen);
+	tx->addrlen = addrlen;
+	if (hdr_len)
+		memcpy(tx->hdr, hdr, hdr_len);
+	tx->iov[0].iov_base = tx->hdr;
+	tx->iov[0].iov_len = hdr_len;
+	tx->iov[1].iov_base = pack->data;
+	tx->iov[1].iov_len = len;
+
+	if (tx != &tx_buf) {
+		dhcpv4_packet_ref(pack);
+		tx->pack = pack;
+		tx_cnt++;
+		return 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &tx->addr;
+	msg.msg_namelen = tx->addrlen;
+	msg.msg_iov = tx->iov;
+	msg.msg_iovlen = 2;
+
+	if (sendmsg(fd, &msg, 0) != hdr_len + len) {
+		log_error("dhcpv4: sendmsg: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
 }
 
+static void dhcpv4_tx_flush(void)
+{
+	struct mmsghdr mmsg[DHCPV4_BATCH];
+	int i, j, n, cnt;
+
+	for (i = 0; i < tx_cnt; i++) {
+		memset(&mmsg[i], 0, sizeof(mmsg[i]));
+		mmsg[i].msg_hdr.msg_name = &tx_queue[i].addr;
+		mmsg[i].msg_hdr.msg_namelen = tx_queue[i].addrlen;
+		mmsg[i].msg_hdr.msg_iov = tx_queue[i].iov;
+		mmsg[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	/* one sendmmsg per run of replies going out through the same socket */
+	for (i = 0; i < tx_cnt; i = j) {
+		for (j = i + 1; j < tx_cnt && tx_queue[j].fd == tx_queue[i].fd; j++);
+
+		for (cnt = i; cnt < j; cnt += n) {
+			n = sendmmsg(tx_queue[i].fd, mmsg + cnt, j - cnt, 0);
+			if (n <= 0) {
+				log_error("dhcpv4: sendmmsg: %s\n", strerror(errno));
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < tx_cnt; i++)
+		dhcpv4_packet_free(tx_queue[i].pack);
+
+	tx_cnt = 0;
+}
 
 static int dhcpv4_send_raw(struct dhcpv4_serv *serv, struct dhcpv4_packet *pack, in_addr_t saddr, in_addr_t daddr)
 {
-	uint8_t hdr[sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udphdr)];
+	uint8_t hdr[DHCPV4_RAW_HDR_LEN];
 	struct ether_header *eth = (struct ether_header *)hdr;
 	struct iphdr *ip = (struct iphdr *)(eth + 1);
 	struct udphdr *udp = (struct udphdr *)(ip + 1);
 	int len = pack->ptr - pack->data;
-	struct iovec iov[2];
 	static uint8_t bc_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	struct sockaddr_ll ll_addr;
-	struct msghdr msg;
 	int sock = open_raw_sock();
 
+	if (sock < 0)
+		return -1;
+
 	memset(&ll_addr, 0, sizeof(ll_addr));
 	ll_addr.sll_family = AF_PACKET;
 	ll_addr.sll_ifindex = serv->ifindex;
 	ll_addr.sll_protocol = ntohs(ETH_P_IP);
 
-	msg.msg_name = &ll_addr;
-	msg.msg_namelen = sizeof(ll_addr);
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 2;
-	msg.msg_controllen = 0;
-	msg.msg_flags = 0;
-
 	memcpy(eth->ether_dhost, (pack->hdr->flags & DHCP_F_BROADCAST) ? bc_addr : pack->hdr->chaddr, ETH_ALEN);
 	memcpy(eth->ether_shost, serv->hwaddr, ETH_ALEN);
 	eth->ether_type = htons(ETH_P_IP);
@@ -624,71 +743,39 @@ static int dhcpv4_send_raw(struct dhcpv4_serv *serv, struct dhcpv4_packet *pack,
 	ip->check = 0;
 	ip->saddr = saddr;
 	ip->daddr = (pack->hdr->flags & DHCP_F_BROADCAST) ? INADDR_BROADCAST : daddr;
-	ip->check = ip_csum((uint16_t *)ip, 20);
+	ip->check = ip_hdr_csum(ip);
 
+	/* udp checksum is optional for ipv4 */
 	udp->source = ntohs(DHCP_SERV_PORT);
 	udp->dest = ntohs(DHCP_CLIENT_PORT);
 	udp->len = htons(sizeof(*udp) + len);
 	udp->check = 0;
 
-	iov[0].iov_base = hdr;
-	iov[0].iov_len = sizeof(hdr);
-	iov[1].iov_base = pack->data;
-	iov[1].iov_len = len;
-
-	len = sendmsg(sock, &msg, 0);
-
-	if (len < 0) {
-		perror("sendmsg");
-		printf("%i %i\n", errno, serv->ifindex);
-		return -1;
-	}
-
-	return 0;
+	return dhcpv4_xmit(sock, pack, &ll_addr, sizeof(ll_addr), hdr, sizeof(hdr));
 }
 
 static int dhcpv4_send_udp(struct dhcpv4_serv *serv, struct dhcpv4_packet *pack, in_addr_t ip, int port)
 {
 	struct sockaddr_in addr;
-	int n;
-	int len = pack->ptr - pack->data;
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = ip;
 
-	n = sendto(serv->hnd.fd, pack->data, len, 0, (struct sockaddr *)&addr, sizeof(addr));
-	if (n != len)
-		return -1;
-
-	return 0;
+	return dhcpv4_xmit(serv->hnd.fd, pack, &addr, sizeof(addr), NULL, 0);
 }
 
 int dhcpv4_packet_add_opt(struct dhcpv4_packet *pack, int type, const void *data, int len)
 {
-	struct dhcpv4_option *opt = mempool_alloc(opt_pool);
-
-	if (!opt) {
-		log_emerg("out of memory\n");
+	if (!dhcpv4_packet_reg_opt(pack, type, pack->ptr + 2, len))
 		return -1;
-	}
 
 	*pack->ptr++ = type;
 	*pack->ptr++ = len;
-
-	opt->type = type;
-	opt->len = len;
-	opt->data = pack->ptr;
+	memcpy(pack->ptr, data, len);
 	pack->ptr += len;
 
-	memcpy(opt->data, data, len);
-
-	list_add_tail(&opt->entry, &pack->options);
-
-	if (type == 82)
-		pack->relay_agent = opt;
-
 	return 0;
 }
 
@@ -703,10 +790,10 @@ static inline int dhcpv4_packet_add_opt_u32(struct dhcpv4_packet *pack, int type
 	return dhcpv4_packet_add_opt(pack, type, &val, 4);
 }
 
-int dhcpv4_send_reply(int msg_type, struct dhcpv4_serv *serv, struct dhcpv4_packet *req, uint32_t yiaddr, uint32_t siaddr, uint32_t router, uint32_t mask, int lease_time, int renew_time, struct dhcpv4_packet *relay)
+struct dhcpv4_packet *dhcpv4_build_reply(int msg_type, struct dhcpv4_packet *req, uint32_t yiaddr, uint32_t siaddr, uint32_t router, uint32_t mask, int lease_time, int renew_time, struct dhcpv4_packet *relay)
 {
 	struct dhcpv4_packet *pack;
-	int val, r;
+	int i, val;
 	struct dns {
 		in_addr_t dns1;
 		in_addr_t dns2;
@@ -717,7 +804,7 @@ int dhcpv4_send_reply(int msg_type, struct dhcpv4_serv *serv, struct dhcpv4_pack
 	pack = dhcpv4_packet_alloc();
 	if (!pack) {
 		log_emerg("out of memory\n");
-		return -1;
+		return NULL;
 	}
 
 	memcpy(pack->hdr, req->hdr, sizeof(*req->hdr));
@@ -753,7 +840,8 @@ int dhcpv4_send_reply(int msg_type, struct dhcpv4_serv *serv, struct dhcpv4_pack
 		goto out_err;
 
 	if (relay) {
-		list_for_each_entry(opt, &relay->options, entry) {
+		for (i = 0; i < relay->opt_cnt; i++) {
+			opt = &relay->opts[i];
 			if (opt->type == 53 || opt->type == 54 || opt->type == 51 || opt->type == 58 || opt->type == 1 || (opt->type == 3 && router))
 				continue;
 			if (opt->type == 6)
@@ -777,26 +865,82 @@ int dhcpv4_send_reply(int msg_type, struct dhcpv4_serv *serv, struct dhcpv4_pack
 
 	*pack->ptr++ = 255;
 
+	pack->msg_type = msg_type;
+	pack->server_id = siaddr;
+
+	return pack;
+
+out_err:
+	dhcpv4_packet_free(pack);
+	return NULL;
+}
+
+static int __dhcpv4_send_packet(struct dhcpv4_serv *serv, struct dhcpv4_packet *req, struct dhcpv4_packet *pack)
+{
+	if (req->hdr->giaddr)
+		return dhcpv4_send_udp(serv, pack, req->hdr->giaddr, DHCP_SERV_PORT);
+	else if (req->hdr->ciaddr && !(pack->hdr->flags & DHCP_F_BROADCAST))
+		return dhcpv4_send_udp(serv, pack, req->hdr->ciaddr, DHCP_CLIENT_PORT);
+	else
+		return dhcpv4_send_raw(serv, pack, pack->server_id, pack->hdr->yiaddr);
+}
+
+int dhcpv4_send_packet(struct dhcpv4_serv *serv, struct dhcpv4_packet *req, struct dhcpv4_packet *pack)
+{
 	if (conf_verbose) {
-		pack->msg_type = msg_type;
 		log_ppp_info2("send ");
 		dhcpv4_print_packet(pack, 0, log_ppp_info2);
 	}
 
-	if (req->hdr->giaddr)
-		r = dhcpv4_send_udp(serv, pack, req->hdr->giaddr, DHCP_SERV_PORT);
-	else if (req->hdr->ciaddr && !(pack->hdr->flags & DHCP_F_BROADCAST))
-		r = dhcpv4_send_udp(serv, pack, req->hdr->ciaddr, DHCP_CLIENT_PORT);
-	else
-		r = dhcpv4_send_raw(serv, pack, siaddr, yiaddr);
+	return __dhcpv4_send_packet(serv, req, pack);
+}
+
+int dhcpv4_send_reply(int msg_type, struct dhcpv4_serv *serv, struct dhcpv4_packet *req, uint32_t yiaddr, uint32_t siaddr, uint32_t router, uint32_t mask, int lease_time, int renew_time, struct dhcpv4_packet *relay)
+{
+	struct dhcpv4_packet *pack;
+	int r;
+
+	pack = dhcpv4_build_reply(msg_type, req, yiaddr, siaddr, router, mask, lease_time, renew_time, relay);
+	if (!pack)
+		return -1;
+
+	r = dhcpv4_send_packet(serv, req, pack);
 
 	dhcpv4_packet_free(pack);
 
 	return r;
+}
+
+/* send a copy of a previously built reply, patched for the new request */
+int dhcpv4_send_reply_tpl(struct dhcpv4_serv *serv, struct dhcpv4_packet *req, struct dhcpv4_packet *tpl)
+{
+	struct dhcpv4_packet *pack;
+	int len = tpl->ptr - tpl->data;
+	int r;
+
+	pack = dhcpv4_packet_alloc();
+	if (!pack) {
+		log_emerg("out of memory\n");
+		return -1;
+	}
+
+	memcpy(pack->data, tpl->data, len);
+	pack->ptr = pack->data + len;
+	pack->msg_type = tpl->msg_type;
+	pack->server_id = tpl->server_id;
+
+	pack->hdr->xid = req->hdr->xid;
+	pack->hdr->sec = req->hdr->sec;
+	pack->hdr->flags = req->hdr->flags;
+	pack->hdr->hops = req->hdr->hops;
+	pack->hdr->ciaddr = req->hdr->ciaddr;
+	pack->hdr->giaddr = req->hdr->giaddr;
+
+	r = __dhcpv4_send_packet(serv, req, pack);
 
-out_err:
 	dhcpv4_packet_free(pack);
-	return -1;
+
+	return r;
 }
 
 int dhcpv4_send_nak(struct dhcpv4_serv *serv, struct dhcpv4_packet *req)
@@ -1146,7 +1290,6 @@ static void load_config()
 static void init()
 {
 	pack_pool = mempool_create(BUF_SIZE + sizeof(struct dhcpv4_packet));
-	opt_pool = mempool_create(sizeof(struct dhcpv4_option));
 
 	pthread_key_create(&raw_sock_key, close_raw_sock);
 
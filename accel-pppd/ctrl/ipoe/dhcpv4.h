@@ -50,8 +50,9 @@ struct dhcpv4_hdr {
 	uint8_t magic[4];
 } __packed;
 
+#define DHCPV4_MAX_OPTS 64
+
 struct dhcpv4_option {
-	struct list_head entry;
 	uint8_t type;
 	uint8_t len;
 	uint8_t *data;
@@ -59,7 +60,6 @@ struct dhcpv4_option {
 
 struct dhcpv4_packet {
 	struct dhcpv4_hdr *hdr;
-	struct list_head options;
 	struct dhcpv4_option *client_id;
 	struct dhcpv4_option *relay_agent;
 	uint32_t request_ip;
@@ -67,6 +67,9 @@ struct dhcpv4_packet {
 	int msg_type;
 	in_addr_t src_addr;
 	int volatile refs;
+	int opt_cnt;
+	uint8_t opt_idx[256]; /* type -> 1-based index of first occurrence in opts */
+	struct dhcpv4_option opts[DHCPV4_MAX_OPTS];
 	uint8_t *ptr;
 	uint8_t data[0];
 };
@@ -113,11 +116,21 @@ int dhcpv4_relay_send_release(struct dhcpv4_relay *relay, uint8_t *chaddr, uint3
 	struct dhcpv4_option *client_id, struct dhcpv4_option *relay_agent,
 	const char *agent_circuit_id, const char *agent_remote_id);
 
+struct dhcpv4_packet *dhcpv4_build_reply(int msg_type, struct dhcpv4_packet *req, uint32_t yiaddr, uint32_t siaddr, uint32_t router, uint32_t mask, int lease_time, int renew_time, struct dhcpv4_packet *relay_reply);
+int dhcpv4_send_packet(struct dhcpv4_serv *serv, struct dhcpv4_packet *req, struct dhcpv4_packet *pack);
 int dhcpv4_send_reply(int msg_type, struct dhcpv4_serv *serv, struct dhcpv4_packet *req, uint32_t yiaddr, uint32_t siaddr, uint32_t router, uint32_t mask, int lease_time, int renew_time, struct dhcpv4_packet *relay_reply);
+int dhcpv4_send_reply_tpl(struct dhcpv4_serv *serv, struct dhcpv4_packet *req, struct dhcpv4_packet *tpl);
 int dhcpv4_send_nak(struct dhcpv4_serv *serv, struct dhcpv4_packet *req);
 
 void dhcpv4_packet_ref(struct dhcpv4_packet *pack);
-struct dhcpv4_option *dhcpv4_packet_find_opt(struct dhcpv4_packet *pack, int type);
+
+static inline struct dhcpv4_option *dhcpv4_packet_find_opt(struct dhcpv4_packet *pack, int type)
+{
+	int i = pack->opt_idx[type & 0xff];
+
+	return i ? &pack->opts[i - 1] : NULL;
+}
+
 int dhcpv4_packet_insert_opt82(struct dhcpv4_packet *pack, const char *agent_circuit_id, const char *agent_remote_id);
 void dhcpv4_packet_free(struct dhcpv4_packet *pack);
 
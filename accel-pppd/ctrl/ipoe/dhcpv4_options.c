@@ -68,8 +68,10 @@ int dhcpv4_check_options(struct dhcpv4_packet *pack)
 {
 	struct dhcpv4_option *opt;
 	struct known_option *kopt;
+	int i;
 
-	list_for_each_entry(opt, &pack->options, entry) {
+	for (i = 0; i < pack->opt_cnt; i++) {
+		opt = &pack->opts[i];
 		for (kopt = options; kopt->type; kopt++) {
 			if (kopt->type != opt->type)
 				continue;
@@ -90,9 +92,10 @@ void dhcpv4_print_options(struct dhcpv4_packet *pack, void (*print)(const char *
 {
 	struct dhcpv4_option *opt;
 	struct known_option *kopt;
-	int n = 0;
+	int i, n = 0;
 
-	list_for_each_entry(opt, &pack->options, entry) {
+	for (i = 0; i < pack->opt_cnt; i++) {
+		opt = &pack->opts[i];
 		if (n)
 			print(" <");
 		else
@@ -72,6 +72,7 @@ struct gw_addr {
 
 struct disc_item {
 	struct list_head entry;
+	struct list_head hash_entry;
 	struct dhcpv4_packet *pack;
 	struct timespec ts;
 };
@@ -84,6 +85,7 @@ struct delay {
 
 struct request_item {
 	struct list_head entry;
+	struct list_head hash_entry;
 	uint32_t xid;
 	time_t expire;
 	int cnt;
@@ -175,6 +177,14 @@ static int radius_loaded;
 static LIST_HEAD(serv_list);
 static pthread_mutex_t serv_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* sessions of all interfaces indexed by (serv, hwaddr) and (serv, opt82) */
+#define SES_HASH_SIZE 16384
+/* per interface xid indexes of delayed offers and requests */
+#define XID_HASH_SIZE 256
+static struct list_head hwaddr_hash[SES_HASH_SIZE];
+static struct list_head opt82_hash[SES_HASH_SIZE];
+static pthread_mutex_t ses_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static pthread_mutex_t uc_lock = PTHREAD_MUTEX_INITIALIZER;
 static LIST_HEAD(uc_list);
 static int uc_size;
@@ -194,6 +204,8 @@ static void __ipoe_session_activate(struct ipoe_session *ses);
 static void ipoe_ses_recv_dhcpv4(struct dhcpv4_serv *dhcpv4, struct dhcpv4_packet *pack);
 static void __ipoe_recv_dhcpv4(struct dhcpv4_serv *dhcpv4, struct dhcpv4_packet *pack, int force);
 static void ipoe_session_keepalive(struct dhcpv4_packet *pack);
+static void ipoe_session_set_ack(struct ipoe_session *ses, struct dhcpv4_packet *ack);
+static void ipoe_session_send_ack(struct ipoe_session *ses);
 static void add_interface(const char *ifname, int ifindex, const char *opt, int parent_ifindex, int vid, int vlan_mon);
 static int get_offer_delay();
 static void __ipoe_session_start(struct ipoe_session *ses);
@@ -208,13 +220,71 @@ static void ipoe_ctx_switch(struct triton_context_t *ctx, void *arg)
 	log_switch(ctx, arg);
 }
 
+static unsigned int hash_buf(unsigned int h, const uint8_t *buf, int len)
+{
+	while (len--) {
+		h ^= *buf++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static unsigned int hwaddr_key(struct ipoe_serv *serv, const uint8_t *hwaddr)
+{
+	unsigned int h = hash_buf(2166136261u, (uint8_t *)&serv, sizeof(serv));
+
+	return hash_buf(h, hwaddr, ETH_ALEN) & (SES_HASH_SIZE - 1);
+}
+
+/* circuit-id and remote-id are length prefixed, NULL hashes as a marker */
+static unsigned int opt82_key(struct ipoe_serv *serv, const uint8_t *circuit_id, const uint8_t *remote_id)
+{
+	unsigned int h = hash_buf(2166136261u, (uint8_t *)&serv, sizeof(serv));
+	uint8_t none = 0xff;
+
+	h = circuit_id ? hash_buf(h, circuit_id, *circuit_id + 1) : hash_buf(h, &none, 1);
+	h = remote_id ? hash_buf(h, remote_id, *remote_id + 1) : hash_buf(h, &none, 1);
+
+	return h & (SES_HASH_SIZE - 1);
+}
+
+static int opt82_id_eq(const uint8_t *id1, const uint8_t *id2)
+{
+	if (!id1 || !id2)
+		return id1 == id2;
+
+	return *id1 == *id2 && !memcmp(id1 + 1, id2 + 1, *id1);
+}
+
+static void ipoe_serv_add_session(struct ipoe_serv *serv, struct ipoe_session *ses)
+{
+	list_add_tail(&ses->entry, &serv->sessions);
+
+	pthread_mutex_lock(&ses_hash_lock);
+	list_add_tail(&ses->hwaddr_entry, &hwaddr_hash[hwaddr_key(serv, ses->hwaddr)]);
+	if (ses->agent_circuit_id || ses->agent_remote_id)
+		list_add_tail(&ses->opt82_entry, &opt82_hash[opt82_key(serv, ses->agent_circuit_id, ses->agent_remote_id)]);
+	pthread_mutex_unlock(&ses_hash_lock);
+}
+
+static void ipoe_serv_del_session(struct ipoe_session *ses)
+{
+	list_del(&ses->entry);
+
+	pthread_mutex_lock(&ses_hash_lock);
+	list_del(&ses->hwaddr_entry);
+	if (ses->opt82_entry.next)
+		list_del(&ses->opt82_entry);
+	pthread_mutex_unlock(&ses_hash_lock);
+}
+
 static struct ipoe_session *ipoe_session_lookup(struct ipoe_serv *serv, struct dhcpv4_packet *pack, struct ipoe_session **opt82_ses)
 {
 	struct ipoe_session *ses, *res = NULL;
 
 	uint8_t *agent_circuit_id = NULL;
 	uint8_t *agent_remote_id = NULL;
-	int opt82_match;
 
 	if (opt82_ses)
 		*opt82_ses = NULL;
@@ -233,109 +303,52 @@ static struct ipoe_session *ipoe_session_lookup(struct ipoe_serv *serv, struct d
 		agent_remote_id = NULL;
 	}
 
-	list_for_each_entry(ses, &serv->sessions, entry) {
-		opt82_match = conf_check_mac_change && pack->relay_agent != NULL;
-
-		if (agent_circuit_id && !ses->agent_circuit_id)
-			opt82_match = 0;
-
-		if (opt82_match && agent_remote_id && !ses->agent_remote_id)
-			opt82_match = 0;
-
-		if (opt82_match && !agent_circuit_id && ses->agent_circuit_id)
-			opt82_match = 0;
-
-		if (opt82_match && !agent_remote_id && ses->agent_remote_id)
-			opt82_match = 0;
-
-		if (opt82_match && agent_circuit_id) {
-			if (*agent_circuit_id != *ses->agent_circuit_id)
-				opt82_match = 0;
-
-			if (memcmp(agent_circuit_id + 1, ses->agent_circuit_id + 1, *agent_circuit_id))
-				opt82_match = 0;
-		}
-
-		if (opt82_match && agent_remote_id) {
-			if (*agent_remote_id != *ses->agent_remote_id)
-				opt82_match = 0;
-
-			if (memcmp(agent_remote_id + 1, ses->agent_remote_id + 1, *agent_remote_id))
-				opt82_match = 0;
-		}
-
-		if (opt82_match && opt82_ses)
-			*opt82_ses = ses;
-
-		if (memcmp(pack->hdr->chaddr, ses->hwaddr, ETH_ALEN))
-			continue;
-
-		res = ses;
-		break;
-
-		/*if (pack->client_id && !ses->client_id)
-			continue;
-
-		if (!pack->client_id && ses->client_id)
-			continue;
+	pthread_mutex_lock(&ses_hash_lock);
 
-		if (pack->client_id) {
-			if (pack->client_id->len != ses->client_id->len)
-				continue;
-			if (memcmp(pack->client_id->data, ses->client_id->data, pack->client_id->len))
-				continue;
+	list_for_each_entry(ses, &hwaddr_hash[hwaddr_key(serv, pack->hdr->chaddr)], hwaddr_entry) {
+		if (ses->serv == serv && !memcmp(pack->hdr->chaddr, ses->hwaddr, ETH_ALEN)) {
+			res = ses;
+			break;
 		}
-
-		ses1 = ses;
-
-		if (pack->hdr->xid != ses->xid)
-			continue;
-
-		return ses;*/
 	}
 
-	if (!res || !pack->relay_agent || !opt82_ses || *opt82_ses)
-		return res;
-
-	list_for_each_entry(ses, &serv->sessions, entry) {
-		if (agent_circuit_id && !ses->agent_circuit_id)
-			continue;
-
-		if (opt82_match && agent_remote_id && !ses->agent_remote_id)
-			continue;
-
-		if (opt82_match && !agent_circuit_id && ses->agent_circuit_id)
-			continue;
-
-		if (opt82_match && !agent_remote_id && ses->agent_remote_id)
-			continue;
-
-		if (opt82_match && agent_circuit_id) {
-			if (*agent_circuit_id != *ses->agent_circuit_id)
-				continue;
-
-			if (memcmp(agent_circuit_id + 1, ses->agent_circuit_id + 1, *agent_circuit_id))
-				continue;
-		}
-
-		if (opt82_match && agent_remote_id) {
-			if (*agent_remote_id != *ses->agent_remote_id)
-				continue;
-
-			if (memcmp(agent_remote_id + 1, ses->agent_remote_id + 1, *agent_remote_id))
-				continue;
+	/* session owning the same circuit-id/remote-id, if any */
+	if (opt82_ses && conf_check_mac_change && pack->relay_agent) {
+		if (res && opt82_id_eq(agent_circuit_id, res->agent_circuit_id) && opt82_id_eq(agent_remote_id, res->agent_remote_id))
+			*opt82_ses = res;
+		else if (agent_circuit_id || agent_remote_id) {
+			list_for_each_entry(ses, &opt82_hash[opt82_key(serv, agent_circuit_id, agent_remote_id)], opt82_entry) {
+				if (ses->serv == serv && opt82_id_eq(agent_circuit_id, ses->agent_circuit_id) && opt82_id_eq(agent_remote_id, ses->agent_remote_id)) {
+					*opt82_ses = ses;
+					break;
+				}
+			}
+		} else {
+			list_for_each_entry(ses, &serv->sessions, entry) {
+				if (!ses->agent_circuit_id && !ses->agent_remote_id) {
+					*opt82_ses = ses;
+					break;
+				}
+			}
 		}
-
-		*opt82_ses = ses;
-		break;
 	}
 
+	pthread_mutex_unlock(&ses_hash_lock);
+
 	return res;
 }
 
 static void ipoe_session_timeout(struct triton_timer_t *t)
 {
 	struct ipoe_session *ses = container_of(t, typeof(*ses), timer);
+	time_t ts = ses->keepalive_ts;
+
+	/* renewed by ipoe_session_renew while the timer was running */
+	if (ses->ses.state == AP_STATE_ACTIVE && ts && ts + ses->lease_time > _time()) {
+		t->expire_tv.tv_sec = ts + ses->lease_time - _time();
+		triton_timer_mod(t, 0);
+		return;
+	}
 
 	triton_timer_del(t);
 
@@ -929,7 +942,7 @@ static void __ipoe_session_activate(struct ipoe_session *ses)
 
 	if (ses->dhcpv4_request) {
 		if (ses->ses.state == AP_STATE_ACTIVE)
-			dhcpv4_send_reply(DHCPACK, ses->dhcpv4 ?: ses->serv->dhcpv4, ses->dhcpv4_request, ses->yiaddr, ses->siaddr, ses->router, ses->mask, ses->lease_time, ses->renew_time, ses->dhcpv4_relay_reply);
+			ipoe_session_send_ack(ses);
 		else
 			dhcpv4_send_nak(ses->serv->dhcpv4, ses->dhcpv4_request);
 
@@ -973,8 +986,10 @@ static void ipoe_session_keepalive(struct dhcpv4_packet *pack)
 
 	ses->dhcpv4_request = pack;
 
-	if (ses->timer.tpd)
+	if (ses->timer.tpd) {
+		ses->timer.expire_tv.tv_sec = ses->lease_time;
 		triton_timer_mod(&ses->timer, 0);
+	}
 
 	ses->xid = ses->dhcpv4_request->hdr->xid;
 
@@ -983,15 +998,87 @@ static void ipoe_session_keepalive(struct dhcpv4_packet *pack)
 		return;
 	}
 
-	if (ses->ses.state == AP_STATE_ACTIVE) {
-		dhcpv4_send_reply(DHCPACK, ses->dhcpv4 ?: ses->serv->dhcpv4, ses->dhcpv4_request, ses->yiaddr, ses->siaddr, ses->router, ses->mask, ses->lease_time, ses->renew_time, ses->dhcpv4_relay_reply);
-	} else
+	if (ses->ses.state == AP_STATE_ACTIVE)
+		ipoe_session_send_ack(ses);
+	else {
+		ipoe_session_set_ack(ses, NULL);
 		dhcpv4_send_nak(ses->dhcpv4 ?: ses->serv->dhcpv4, ses->dhcpv4_request);
+	}
 
 	dhcpv4_packet_free(ses->dhcpv4_request);
 	ses->dhcpv4_request = NULL;
 }
 
+/* replace the ACK template used by ipoe_session_renew */
+static void ipoe_session_set_ack(struct ipoe_session *ses, struct dhcpv4_packet *ack)
+{
+	struct dhcpv4_packet *old;
+
+	pthread_mutex_lock(&ses->serv->lock);
+	old = ses->dhcpv4_ack;
+	ses->dhcpv4_ack = ack;
+	ses->dhcpv4_ack_ts = _time();
+	pthread_mutex_unlock(&ses->serv->lock);
+
+	if (old)
+		dhcpv4_packet_free(old);
+}
+
+static void ipoe_session_send_ack(struct ipoe_session *ses)
+{
+	struct dhcpv4_packet *ack;
+
+	ack = dhcpv4_build_reply(DHCPACK, ses->dhcpv4_request, ses->yiaddr, ses->siaddr, ses->router, ses->mask, ses->lease_time, ses->renew_time, ses->dhcpv4_relay_reply);
+	if (!ack)
+		return;
+
+	dhcpv4_send_packet(ses->dhcpv4 ?: ses->serv->dhcpv4, ses->dhcpv4_request, ack);
+
+	/* only replies built without relay data and sent through the interface server are reusable */
+	if (ses->dhcpv4 || ses->serv->dhcpv4_relay || ses->dhcpv4_relay_reply) {
+		dhcpv4_packet_free(ack);
+		return;
+	}
+
+	ipoe_session_set_ack(ses, ack);
+}
+
+/*
+ * Called from the interface context with serv->lock held.
+ * Answers a renew of an active session from its ACK template without
+ * switching to the session context, returns 0 if the full path is needed.
+ */
+static int ipoe_session_renew(struct ipoe_session *ses, struct dhcpv4_serv *dhcpv4, struct dhcpv4_packet *pack)
+{
+	struct dhcpv4_packet *ack = ses->dhcpv4_ack;
+	time_t ts = _time();
+
+	if (!ack || conf_verbose || ses->dhcpv4 || dhcpv4 != ses->serv->dhcpv4)
+		return 0;
+
+	if (ses->ses.state != AP_STATE_ACTIVE)
+		return 0;
+
+	/* RENEWING or REBINDING state, the client already owns the address */
+	if (pack->server_id || pack->request_ip || pack->hdr->ciaddr != ses->yiaddr)
+		return 0;
+
+	if (pack->hdr->giaddr != ack->hdr->giaddr)
+		return 0;
+
+	/* rebuild the template at least once per lease */
+	if (ts - ses->dhcpv4_ack_ts >= ses->lease_time)
+		return 0;
+
+	if (dhcpv4_send_reply_tpl(dhcpv4, pack, ack))
+		return 0;
+
+	ses->xid = pack->hdr->xid;
+	ses->keepalive_ts = ts;
+
+	return 1;
+}
+
 static void ipoe_session_decline(struct dhcpv4_packet *pack)
 {
 	struct ipoe_session *ses = container_of(triton_context_self(), typeof(*ses), ctx);
@@ -1050,6 +1137,9 @@ static void ipoe_session_free(struct ipoe_session *ses)
 	if (ses->dhcpv4_relay_reply)
 		dhcpv4_packet_free(ses->dhcpv4_relay_reply);
 
+	if (ses->dhcpv4_ack)
+		dhcpv4_packet_free(ses->dhcpv4_ack);
+
 	if (ses->arph)
 		_free(ses->arph);
 
@@ -1132,7 +1222,7 @@ static void ipoe_session_finished(struct ap_session *s)
 	}
 
 	pthread_mutex_lock(&ses->serv->lock);
-	list_del(&ses->entry);
+	ipoe_serv_del_session(ses);
 	if  ((ses->serv->vlan_mon || ses->serv->need_close) && list_empty(&ses->serv->sessions))
 		triton_context_call(&ses->serv->ctx, (triton_event_func)ipoe_serv_release, ses->serv);
 	pthread_mutex_unlock(&ses->serv->lock);
@@ -1268,7 +1358,7 @@ static struct ipoe_session *ipoe_session_create_dhcpv4(struct ipoe_serv *serv, s
 	triton_context_wakeup(&ses->ctx);
 
 	//pthread_mutex_lock(&serv->lock);
-	list_add_tail(&ses->entry, &serv->sessions);
+	ipoe_serv_add_session(serv, ses);
 	//pthread_mutex_unlock(&serv->lock);
 
 	if (serv->timer.tpd)
@@ -1430,20 +1520,51 @@ static void ipoe_ses_recv_dhcpv4_request(struct dhcpv4_packet *pack)
 		dhcpv4_packet_free(pack);
 }
 
+/* both lists are kept in expiration order, entries are found by xid through the hashes */
+static unsigned int disc_key(uint32_t xid, const uint8_t *chaddr)
+{
+	return hash_buf(2166136261u ^ xid, chaddr, ETH_ALEN) & (XID_HASH_SIZE - 1);
+}
+
+static struct list_head *xid_hash_alloc(void)
+{
+	struct list_head *h = _malloc(XID_HASH_SIZE * sizeof(*h));
+	int i;
+
+	if (!h) {
+		log_emerg("ipoe: out of memory\n");
+		return NULL;
+	}
+
+	for (i = 0; i < XID_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&h[i]);
+
+	return h;
+}
+
+static void disc_item_free(struct disc_item *d)
+{
+	list_del(&d->entry);
+	list_del(&d->hash_entry);
+	dhcpv4_packet_free(d->pack);
+	mempool_free(d);
+
+	__sync_sub_and_fetch(&stat_delayed_offer, 1);
+}
+
 static void ipoe_serv_disc_timer(struct triton_timer_t *t)
 {
 	struct ipoe_serv *serv = container_of(t, typeof(*serv), disc_timer);
 	struct disc_item *d;
 	struct timespec ts;
-	int delay, offer_delay;
+	int delay, offer_delay = get_offer_delay();
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
 	while (!list_empty(&serv->disc_list)) {
-	  d = list_entry(serv->disc_list.next, typeof(*d), entry);
+		d = list_entry(serv->disc_list.next, typeof(*d), entry);
 
 		delay = (ts.tv_sec - d->ts.tv_sec) * 1000 + (ts.tv_nsec - d->ts.tv_nsec) / 1000000;
-		offer_delay = get_offer_delay();
 
 		if (delay < offer_delay - 1) {
 			delay = offer_delay - delay;
@@ -1455,11 +1576,7 @@ static void ipoe_serv_disc_timer(struct triton_timer_t *t)
 
 		__ipoe_recv_dhcpv4(serv->dhcpv4, d->pack, 1);
 
-		list_del(&d->entry);
-		dhcpv4_packet_free(d->pack);
-		mempool_free(d);
-
-		__sync_sub_and_fetch(&stat_delayed_offer, 1);
+		disc_item_free(d);
 	}
 
 	triton_timer_del(t);
@@ -1467,8 +1584,15 @@ static void ipoe_serv_disc_timer(struct triton_timer_t *t)
 
 static void ipoe_serv_add_disc(struct ipoe_serv *serv, struct dhcpv4_packet *pack, int offer_delay)
 {
-	struct disc_item *d = mempool_alloc(disc_item_pool);
+	struct disc_item *d;
 
+	if (!serv->disc_hash) {
+		serv->disc_hash = xid_hash_alloc();
+		if (!serv->disc_hash)
+			return;
+	}
+
+	d = mempool_alloc(disc_item_pool);
 	if (!d)
 		return;
 
@@ -1478,6 +1602,7 @@ static void ipoe_serv_add_disc(struct ipoe_serv *serv, struct dhcpv4_packet *pac
 	d->pack = pack;
 	clock_gettime(CLOCK_MONOTONIC, &d->ts);
 	list_add_tail(&d->entry, &serv->disc_list);
+	list_add_tail(&d->hash_entry, &serv->disc_hash[disc_key(pack->hdr->xid, pack->hdr->chaddr)]);
 
 	if (!serv->disc_timer.tpd) {
 		serv->disc_timer.expire_tv.tv_sec = offer_delay / 1000;
@@ -1490,55 +1615,70 @@ static void ipoe_serv_check_disc(struct ipoe_serv *serv, struct dhcpv4_packet *p
 {
 	struct disc_item *d;
 
-	list_for_each_entry(d, &serv->disc_list, entry) {
+	if (!serv->disc_hash)
+		return;
+
+	list_for_each_entry(d, &serv->disc_hash[disc_key(pack->hdr->xid, pack->hdr->chaddr)], hash_entry) {
 		if (d->pack->hdr->xid != pack->hdr->xid)
 			continue;
 
 		if (memcmp(d->pack->hdr->chaddr, pack->hdr->chaddr, ETH_ALEN))
 			continue;
 
-		list_del(&d->entry);
-		dhcpv4_packet_free(d->pack);
-		mempool_free(d);
-
-		__sync_sub_and_fetch(&stat_delayed_offer, 1);
+		disc_item_free(d);
 
 		break;
 	}
 }
 
+static void request_item_free(struct request_item *r)
+{
+	list_del(&r->entry);
+	list_del(&r->hash_entry);
+	mempool_free(r);
+}
+
 static int ipoe_serv_request_check(struct ipoe_serv *serv, uint32_t xid)
 {
 	struct request_item *r;
-	struct list_head *pos, *n;
 	struct timespec ts;
 
+	if (!serv->req_hash) {
+		serv->req_hash = xid_hash_alloc();
+		if (!serv->req_hash)
+			return 0;
+	}
+
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	list_for_each_safe(pos, n, &serv->req_list) {
-		r = list_entry(pos, typeof(*r), entry);
+	while (!list_empty(&serv->req_list)) {
+		r = list_first_entry(&serv->req_list, typeof(*r), entry);
+		if (ts.tv_sec <= r->expire)
+			break;
+		request_item_free(r);
+	}
+
+	list_for_each_entry(r, &serv->req_hash[xid & (XID_HASH_SIZE - 1)], hash_entry) {
 		if (r->xid == xid) {
 			if (++r->cnt == conf_max_request) {
-				list_del(&r->entry);
-				mempool_free(r);
+				request_item_free(r);
 				return 1;
 			}
 
 			r->expire = ts.tv_sec + 30;
+			list_move_tail(&r->entry, &serv->req_list);
 			return 0;
 		}
-
-		if (ts.tv_sec > r->expire) {
-			list_del(&r->entry);
-			mempool_free(r);
-		}
 	}
 
 	r = mempool_alloc(req_item_pool);
+	if (!r)
+		return 0;
 	r->xid = xid;
 	r->expire = ts.tv_sec + 30;
 	r->cnt = 0;
 	list_add_tail(&r->entry, &serv->req_list);
+	list_add_tail(&r->hash_entry, &serv->req_hash[xid & (XID_HASH_SIZE - 1)]);
 
 	return 0;
 }
@@ -1668,6 +1808,9 @@ static void __ipoe_recv_dhcpv4(struct dhcpv4_serv *dhcpv4, struct dhcpv4_packet
 			if (serv->opt_shared == 0)
 				ipoe_drop_sessions(serv, ses);
 
+			if (ipoe_session_renew(ses, dhcpv4, pack))
+				goto out;
+
 			dhcpv4_packet_ref(pack);
 			triton_context_call(&ses->ctx, (triton_event_func)ipoe_ses_recv_dhcpv4_request, pack);
 		}
@@ -1845,7 +1988,7 @@ static struct ipoe_session *ipoe_session_create_up(struct ipoe_serv *serv, struc
 
 	triton_context_register(&ses->ctx, &ses->ses);
 
-	list_add_tail(&ses->entry, &serv->sessions);
+	ipoe_serv_add_session(serv, ses);
 
 	if (serv->timer.tpd)
 		triton_timer_del(&serv->timer);
@@ -1889,7 +2032,7 @@ static void ipoe_session_create_auto(struct ipoe_serv *serv)
 
 	triton_context_register(&ses->ctx, &ses->ses);
 
-	list_add_tail(&ses->entry, &serv->sessions);
+	ipoe_serv_add_session(serv, ses);
 
 	triton_context_call(&ses->ctx, (triton_event_func)ipoe_session_start, ses);
 
@@ -2090,6 +2233,9 @@ static void ev_radius_coa(struct ev_radius_t *ev)
 		ses->renew_time = ses->lease_time / 2;
 	}
 
+	if (lease_time_set || renew_time_set)
+		ipoe_session_set_ack(ses, NULL);
+
 	if (l4_redirect >= 0 && ev->ses->state == AP_STATE_ACTIVE) {
 		if (ses->l4_redirect && l4_redirect && ipset) {
 			ipoe_change_l4_redirect(ses, 1);
@@ -2178,19 +2324,17 @@ static void ipoe_serv_release(struct ipoe_serv *serv)
 	if (serv->arp)
 		arpd_stop(serv->arp);
 
-	while (!list_empty(&serv->disc_list)) {
-		struct disc_item *d = list_entry(serv->disc_list.next, typeof(*d), entry);
-		list_del(&d->entry);
-		dhcpv4_packet_free(d->pack);
-		mempool_free(d);
-		__sync_sub_and_fetch(&stat_delayed_offer, 1);
-	}
+	while (!list_empty(&serv->disc_list))
+		disc_item_free(list_first_entry(&serv->disc_list, struct disc_item, entry));
 
-	while (!list_empty(&serv->req_list)) {
-		struct request_item *r = list_first_entry(&serv->req_list, typeof(*r), entry);
-		list_del(&r->entry);
-		mempool_free(r);
-	}
+	while (!list_empty(&serv->req_list))
+		request_item_free(list_first_entry(&serv->req_list, struct request_item, entry));
+
+	if (serv->disc_hash)
+		_free(serv->disc_hash);
+
+	if (serv->req_hash)
+		_free(serv->req_hash);
 
 	if (serv->disc_timer.tpd)
 		triton_timer_del(&serv->disc_timer);
@@ -3593,6 +3737,13 @@ static struct triton_timer_t l4_redirect_timer = {
 
 static void ipoe_init(void)
 {
+	int i;
+
+	for (i = 0; i < SES_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&hwaddr_hash[i]);
+		INIT_LIST_HEAD(&opt82_hash[i]);
+	}
+
 	ses_pool = mempool_create(sizeof(struct ipoe_session));
 	disc_item_pool = mempool_create(sizeof(struct disc_item));
 	req_item_pool = mempool_create(sizeof(struct request_item));
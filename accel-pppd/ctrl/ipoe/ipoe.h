@@ -42,6 +42,8 @@ struct ipoe_serv {
 	void *arp;
 	struct list_head disc_list;
 	struct list_head req_list;
+	struct list_head *disc_hash;
+	struct list_head *req_hash;
 	struct triton_timer_t disc_timer;
 	struct triton_timer_t timer;
 	pthread_mutex_t lock;
@@ -69,6 +71,8 @@ struct ipoe_serv {
 
 struct ipoe_session {
 	struct list_head entry;
+	struct list_head hwaddr_entry;
+	struct list_head opt82_entry;
 	struct triton_context_t ctx;
 	struct triton_timer_t timer;
 	struct triton_timer_t l4_redirect_timer;
@@ -95,6 +99,9 @@ struct ipoe_session {
 	uint8_t *data;
 	struct dhcpv4_packet *dhcpv4_request;
 	struct dhcpv4_packet *dhcpv4_relay_reply;
+	struct dhcpv4_packet *dhcpv4_ack;
+	time_t dhcpv4_ack_ts;
+	time_t keepalive_ts;
 	struct _arphdr *arph;
 	int relay_retransmit;
 	int ifindex;
@@ -111,11 +111,10 @@ static int packet4_option(lua_State *L)
 	struct dhcpv4_option *opt;
 
 	if (ses && ses->dhcpv4_request) {
-		list_for_each_entry(opt, &ses->dhcpv4_request->options, entry) {
-			if (opt->type == type) {
-				lua_pushlstring(L, (char *)opt->data, opt->len);
-				return 1;
-			}
+		opt = dhcpv4_packet_find_opt(ses->dhcpv4_request, type);
+		if (opt) {
+			lua_pushlstring(L, (char *)opt->data, opt->len);
+			return 1;
 		}
 	}
 
@@ -127,17 +126,16 @@ static int packet4_option(lua_State *L)
 static int packet4_options(lua_State *L)
 {
 	struct ipoe_session *ses = luaL_checkudata(L, 1, IPOE_PACKET4);
-	struct dhcpv4_option *opt;
-	int i = 1;
+	int i;
 
 	if (!ses || !ses->dhcpv4_request)
 		return 0;
 
 	lua_newtable(L);
 
-	list_for_each_entry(opt, &ses->dhcpv4_request->options, entry) {
-		lua_pushinteger(L, opt->type);
-		lua_rawseti(L, -2, i++);
+	for (i = 0; i < ses->dhcpv4_request->opt_cnt; i++) {
+		lua_pushinteger(L, ses->dhcpv4_request->opts[i].type);
+		lua_rawseti(L, -2, i + 1);
 	}
 
 	return 1;
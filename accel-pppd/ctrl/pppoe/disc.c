@@ -7,9 +7,11 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <net/ethernet.h>
 #include <netpacket/packet.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 
 #include "triton.h"
 #include "log.h"
@@ -22,6 +24,11 @@
 
 #define MAX_NET 2
 #define HASH_BITS 0xff
+#define BATCH_SIZE 32
+
+/* above these the kernel filter does not check interfaces/addresses */
+#define FILTER_MAX_IF 128
+#define FILTER_MAX_MAC 256
 
 struct tree {
 	pthread_mutex_t lock;
@@ -33,9 +40,20 @@ struct disc_net {
 	struct triton_md_handler_t hnd;
 	const struct ap_net *net;
 	int refs;
+	struct pppoe_pkt *pkt[BATCH_SIZE];
+	struct sockaddr_ll src[BATCH_SIZE];
+	struct mmsghdr mmsg[BATCH_SIZE];
+	struct iovec iov[BATCH_SIZE];
 	struct tree tree[0];
 };
 
+/* frames of a batch received on the same interface */
+struct disc_batch {
+	int ifindex;
+	struct pppoe_pkt *head;
+	struct pppoe_pkt **tail;
+};
+
 static uint8_t bc_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 static mempool_t pkt_pool;
@@ -43,10 +61,147 @@ static mempool_t pkt_pool;
 static struct disc_net *nets[MAX_NET];
 static int net_cnt;
 static pthread_mutex_t nets_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void disc_close(struct triton_context_t *ctx);
 static int disc_read(struct triton_md_handler_t *h);
 
+#define STMT(c, v) (struct sock_filter)BPF_STMT(c, v)
+#define JUMP(c, v, t, f) (struct sock_filter)BPF_JUMP(c, v, t, f)
+
+static int filter_ifindex(struct disc_net *net, int *ifindex)
+{
+	struct pppoe_serv_t *s;
+	struct rb_node *n;
+	int i, cnt = 0;
+
+	for (i = 0; i <= HASH_BITS; i++) {
+		struct tree *t = &net->tree[i];
+
+		pthread_mutex_lock(&t->lock);
+		for (n = rb_first(&t->root); n; n = rb_next(n)) {
+			s = rb_entry(n, typeof(*s), node);
+			if (cnt < FILTER_MAX_IF)
+				ifindex[cnt] = s->ifindex;
+			cnt++;
+		}
+		pthread_mutex_unlock(&t->lock);
+	}
+
+	return cnt;
+}
+
+/* must be called with filter_lock held */
+static void disc_set_filter(struct disc_net *net)
+{
+	struct sock_fprog fprog;
+	struct sock_filter *f;
+	int ifindex[FILTER_MAX_IF];
+	uint8_t mac[FILTER_MAX_MAC * ETH_ALEN];
+	int if_cnt, mac_cnt, type, i, len = 0, pos;
+
+	if (net->hnd.fd == -1)
+		return;
+
+	if_cnt = filter_ifindex(net, ifindex);
+	if (if_cnt > FILTER_MAX_IF)
+		if_cnt = 0;
+
+	mac_cnt = mac_filter_get(&type, mac, FILTER_MAX_MAC);
+	if (mac_cnt < 0 || type == -1)
+		mac_cnt = 0;
+
+	f = _malloc((32 + if_cnt * 2 + mac_cnt * 5) * sizeof(*f));
+	if (!f) {
+		log_emerg("pppoe: disc: out of memory\n");
+		return;
+	}
+
+	/* length covers ethernet and pppoe headers */
+	f[len++] = STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+	f[len++] = JUMP(BPF_JMP | BPF_JGE | BPF_K, ETH_HLEN + sizeof(struct pppoe_hdr), 1, 0);
+	f[len++] = STMT(BPF_RET | BPF_K, 0);
+
+	/* source is unicast */
+	f[len++] = STMT(BPF_LD | BPF_B | BPF_ABS, ETH_ALEN);
+	f[len++] = JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, 0, 1);
+	f[len++] = STMT(BPF_RET | BPF_K, 0);
+
+	/* version 1 */
+	f[len++] = STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN);
+	f[len++] = STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0);
+	f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x10, 1, 0);
+	f[len++] = STMT(BPF_RET | BPF_K, 0);
+
+	/* codes handled by pppoe_serv_read */
+	f[len++] = STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 1);
+	f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, CODE_PADI, 2, 0);
+	f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, CODE_PADR, 1, 0);
+	f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, CODE_PADT, 0, 1);
+	f[len++] = JUMP(BPF_JMP | BPF_JA, 1, 0, 0);
+	f[len++] = STMT(BPF_RET | BPF_K, 0);
+
+	/* payload fits */
+	f[len++] = STMT(BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 4);
+	f[len++] = STMT(BPF_ALU | BPF_ADD | BPF_K, ETH_HLEN + sizeof(struct pppoe_hdr));
+	f[len++] = STMT(BPF_MISC | BPF_TAX, 0);
+	f[len++] = STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+	f[len++] = JUMP(BPF_JMP | BPF_JGE | BPF_X, 0, 1, 0);
+	f[len++] = STMT(BPF_RET | BPF_K, 0);
+
+	/* received on a served interface */
+	if (if_cnt) {
+		pos = len + 1 + if_cnt * 2 + 1;
+		f[len++] = STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_IFINDEX);
+		for (i = 0; i < if_cnt; i++) {
+			f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, ifindex[i], 0, 1);
+			f[len] = JUMP(BPF_JMP | BPF_JA, pos - len - 1, 0, 0);
+			len++;
+		}
+		f[len++] = STMT(BPF_RET | BPF_K, 0);
+	}
+
+	/* mac-filter, source compared as 4 + 2 bytes */
+	if (mac_cnt) {
+		pos = len + 1 + mac_cnt * 5 + 1;
+		f[len++] = STMT(BPF_LD | BPF_W | BPF_ABS, ETH_ALEN);
+		for (i = 0; i < mac_cnt; i++) {
+			uint8_t *a = mac + i * ETH_ALEN;
+
+			f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, ((uint32_t)a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3], 0, 4);
+			f[len++] = STMT(BPF_LD | BPF_H | BPF_ABS, ETH_ALEN + 4);
+			f[len++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, (a[4] << 8) | a[5], 0, 1);
+			f[len] = JUMP(BPF_JMP | BPF_JA, pos - len - 1, 0, 0);
+			len++;
+			f[len++] = STMT(BPF_LD | BPF_W | BPF_ABS, ETH_ALEN);
+		}
+		/* not listed, then listed */
+		f[len++] = STMT(BPF_RET | BPF_K, type ? 0 : 0xffff);
+		f[len++] = STMT(BPF_RET | BPF_K, type ? 0xffff : 0);
+	} else
+		f[len++] = STMT(BPF_RET | BPF_K, 0xffff);
+
+	fprog.len = len;
+	fprog.filter = f;
+
+	if (net->net->setsockopt(net->hnd.fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)))
+		log_warn("pppoe: disc: failed to attach filter: %s\n", strerror(errno));
+
+	_free(f);
+}
+
+void pppoe_disc_update_filter(void)
+{
+	int i;
+
+	pthread_mutex_lock(&filter_lock);
+	pthread_mutex_lock(&nets_lock);
+	for (i = 0; i < net_cnt; i++)
+		disc_set_filter(nets[i]);
+	pthread_mutex_unlock(&nets_lock);
+	pthread_mutex_unlock(&filter_lock);
+}
+
 static struct disc_net *init_net(const struct ap_net *net)
 {
 	struct sockaddr_ll addr;
@@ -77,7 +232,8 @@ static struct disc_net *init_net(const struct ap_net *net)
 	fcntl(sock, F_SETFD, FD_CLOEXEC);
 	net->set_nonblocking(sock, 1);
 
-	n = _malloc(sizeof(*net) + (HASH_BITS + 1) * sizeof(struct tree));
+	n = _malloc(sizeof(*n) + (HASH_BITS + 1) * sizeof(struct tree));
+	memset(n, 0, sizeof(*n));
 	tree = n->tree;
 
 	for (i = 0; i <= HASH_BITS; i++) {
@@ -110,13 +266,18 @@ static void free_net(struct disc_net *net)
 	pthread_mutex_lock(&nets_lock);
 	for (i = 0; i < MAX_NET; i++) {
 		if (nets[i] == net) {
-			memcpy(nets + i, nets + i + 1, net_cnt - i - 1);
+			memmove(nets + i, nets + i + 1, (net_cnt - i - 1) * sizeof(*nets));
 			net_cnt--;
 			break;
 		}
 	}
 	pthread_mutex_unlock(&nets_lock);
 
+	for (i = 0; i < BATCH_SIZE; i++) {
+		if (net->pkt[i])
+			mempool_free(net->pkt[i]);
+	}
+
 	_free(net);
 }
 
@@ -186,6 +347,10 @@ int pppoe_disc_start(struct pppoe_serv_t *serv)
 
 	pthread_mutex_unlock(&t->lock);
 
+	pthread_mutex_lock(&filter_lock);
+	disc_set_filter(net);
+	pthread_mutex_unlock(&filter_lock);
+
 	return net->hnd.fd;
 }
 
@@ -198,17 +363,24 @@ void pppoe_disc_stop(struct pppoe_serv_t *serv)
 	rb_erase(&serv->node, &t->root);
 	pthread_mutex_unlock(&t->lock);
 
+	/* our reference keeps the net alive while the filter is rebuilt */
+	pthread_mutex_lock(&filter_lock);
+	disc_set_filter(n);
+	pthread_mutex_unlock(&filter_lock);
+
 	if (__sync_sub_and_fetch(&n->refs, 1) == 0)
 		free_net(n);
 }
 
-static int forward(struct disc_net *net, int ifindex, void *pkt, int len)
+static void forward(struct disc_net *net, struct disc_batch *b)
 {
 	struct pppoe_serv_t *n;
-	struct tree *t = &net->tree[ifindex & HASH_BITS];
+	struct tree *t = &net->tree[b->ifindex & HASH_BITS];
 	struct rb_node **p = &t->root.rb_node, *parent = NULL;
-	int r = 0;
-	struct ethhdr *ethhdr = (struct ethhdr *)(pkt + 4);
+	struct pppoe_pkt *pkt, *next, *head = NULL, **tail = &head;
+	struct ethhdr *ethhdr;
+
+	*b->tail = NULL;
 
 	pthread_mutex_lock(&t->lock);
 
@@ -216,15 +388,25 @@ static int forward(struct disc_net *net, int ifindex, void *pkt, int len)
 		parent = *p;
 		n = rb_entry(parent, typeof(*n), node);
 
-		if (ifindex < n->ifindex)
+		if (b->ifindex < n->ifindex)
 			p = &(*p)->rb_left;
-		else if (ifindex > n->ifindex)
+		else if (b->ifindex > n->ifindex)
 			p = &(*p)->rb_right;
 		else {
-			if (!memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) || !memcmp(ethhdr->h_dest, n->hwaddr, ETH_ALEN)) {
-				*(int *)pkt = len;
-				triton_context_call(&n->ctx, (triton_event_func)pppoe_serv_read, pkt);
-				r = 1;
+			for (pkt = b->head; pkt; pkt = next) {
+				next = pkt->next;
+				ethhdr = (struct ethhdr *)pkt->data;
+				if (!memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) || !memcmp(ethhdr->h_dest, n->hwaddr, ETH_ALEN)) {
+					*tail = pkt;
+					tail = &pkt->next;
+				} else
+					mempool_free(pkt);
+			}
+			b->head = NULL;
+
+			if (head) {
+				*tail = NULL;
+				triton_context_call(&n->ctx, (triton_event_func)pppoe_serv_read, head);
 			}
 			break;
 		}
@@ -232,7 +414,10 @@ static int forward(struct disc_net *net, int ifindex, void *pkt, int len)
 
 	pthread_mutex_unlock(&t->lock);
 
-	return r;
+	for (pkt = b->head; pkt; pkt = next) {
+		next = pkt->next;
+		mempool_free(pkt);
+	}
 }
 
 static void notify_down(struct disc_net *net, int ifindex)
@@ -285,21 +470,103 @@ static void disc_stop(struct disc_net *net)
 }
 
 
+static int disc_check(struct pppoe_pkt *pkt)
+{
+	struct ethhdr *ethhdr = (struct ethhdr *)pkt->data;
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pkt->data + ETH_HLEN);
+	int n = pkt->len;
+
+	if (n < ETH_HLEN + sizeof(*hdr)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received (%i)\n", n);
+		return -1;
+	}
+
+	if (mac_filter_check(ethhdr->h_source)) {
+		__sync_add_and_fetch(&stat_filtered, 1);
+		return -1;
+	}
+
+	//if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
+	//	return -1;
+
+	if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is broadcast)\n");
+		return -1;
+	}
+
+	if ((ethhdr->h_source[0] & 1) != 0) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is not unicast)\n");
+		return -1;
+	}
+
+	if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received\n");
+		return -1;
+	}
+
+	if (hdr->ver != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
+		return -1;
+	}
+
+	if (hdr->type != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
+	}
+
+	return 0;
+}
+
+static int disc_recv(struct disc_net *net)
+{
+	socklen_t slen = sizeof(net->src[0]);
+	int i, n;
+
+	if (!net->net->recvmmsg) {
+		n = net->net->recvfrom(net->hnd.fd, net->pkt[0]->data, ETHER_MAX_LEN, MSG_DONTWAIT, (struct sockaddr *)&net->src[0], &slen);
+		if (n < 0)
+			return -1;
+		net->pkt[0]->len = n;
+		return 1;
+	}
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		net->iov[i].iov_base = net->pkt[i]->data;
+		net->iov[i].iov_len = ETHER_MAX_LEN;
+		memset(&net->mmsg[i].msg_hdr, 0, sizeof(net->mmsg[i].msg_hdr));
+		net->mmsg[i].msg_hdr.msg_name = &net->src[i];
+		net->mmsg[i].msg_hdr.msg_namelen = sizeof(net->src[i]);
+		net->mmsg[i].msg_hdr.msg_iov = &net->iov[i];
+		net->mmsg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = net->net->recvmmsg(net->hnd.fd, net->mmsg, BATCH_SIZE, MSG_DONTWAIT);
+
+	for (i = 0; i < n; i++)
+		net->pkt[i]->len = net->mmsg[i].msg_len;
+
+	return n;
+}
+
 static int disc_read(struct triton_md_handler_t *h)
 {
 	struct disc_net *net = container_of(h, typeof(*net), hnd);
-	uint8_t *pack = NULL;
-	struct ethhdr *ethhdr;
-	struct pppoe_hdr *hdr;
-	int n;
-	struct sockaddr_ll src;
-	socklen_t slen = sizeof(src);
+	struct disc_batch batch[BATCH_SIZE];
+	struct pppoe_pkt *pkt;
+	int i, j, n, batch_cnt;
 
 	while (1) {
-		if (!pack)
-			pack = mempool_alloc(pkt_pool);
+		for (i = 0; i < BATCH_SIZE; i++) {
+			if (!net->pkt[i])
+				net->pkt[i] = mempool_alloc(pkt_pool);
+		}
 
-		n = net->net->recvfrom(h->fd, pack + 4, ETHER_MAX_LEN, MSG_DONTWAIT, (struct sockaddr *)&src, &slen);
+		n = disc_recv(net);
 
 		if (n < 0) {
 			if (errno == EAGAIN)
@@ -308,7 +575,7 @@ static int disc_read(struct triton_md_handler_t *h)
 			log_error("pppoe: disc: read: %s\n", strerror(errno));
 
 			if (errno == ENETDOWN) {
-				notify_down(net, src.sll_ifindex);
+				notify_down(net, net->src[0].sll_ifindex);
 				continue;
 			}
 
@@ -319,58 +586,34 @@ static int disc_read(struct triton_md_handler_t *h)
 			continue;
 		}
 
-		ethhdr = (struct ethhdr *)(pack + 4);
-		hdr = (struct pppoe_hdr *)(pack + 4 + ETH_HLEN);
-
-		if (n < ETH_HLEN + sizeof(*hdr)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received (%i)\n", n);
-			continue;
-		}
-
-		if (mac_filter_check(ethhdr->h_source)) {
-			__sync_add_and_fetch(&stat_filtered, 1);
-			continue;
-		}
-
-		//if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
-		//	continue;
+		batch_cnt = 0;
 
-		if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is broadcast)\n");
-			continue;
-		}
+		for (i = 0; i < n; i++) {
+			pkt = net->pkt[i];
 
-		if ((ethhdr->h_source[0] & 1) != 0) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is not unicast)\n");
-			continue;
-		}
+			if (disc_check(pkt))
+				continue;
 
-		if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received\n");
-			continue;
-		}
+			for (j = 0; j < batch_cnt; j++) {
+				if (batch[j].ifindex == net->src[i].sll_ifindex)
+					break;
+			}
 
-		if (hdr->ver != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
-			continue;
-		}
+			if (j == batch_cnt) {
+				batch[j].ifindex = net->src[i].sll_ifindex;
+				batch[j].tail = &batch[j].head;
+				batch_cnt++;
+			}
 
-		if (hdr->type != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
+			*batch[j].tail = pkt;
+			batch[j].tail = &pkt->next;
+			net->pkt[i] = NULL;
 		}
 
-		if (forward(net, src.sll_ifindex, pack, n))
-			pack = NULL;
+		for (j = 0; j < batch_cnt; j++)
+			forward(net, &batch[j]);
 	}
 
-	mempool_free(pack);
-
 	return 0;
 }
 
@@ -384,7 +627,7 @@ static void disc_close(struct triton_context_t *ctx)
 
 static void init()
 {
-	pkt_pool = mempool_create(ETHER_MAX_LEN + 4);
+	pkt_pool = mempool_create(sizeof(struct pppoe_pkt));
 }
 
 DEFINE_INIT(1, init);
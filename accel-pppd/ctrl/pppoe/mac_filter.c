@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <net/ethernet.h>
@@ -14,46 +16,209 @@
 
 #include "pppoe.h"
 
-struct mac_t
+/* open addressing set of addresses, never modified after publishing,
+ * writers build a new copy and swap the pointer */
+struct mac_set
 {
-	struct list_head entry;
-	uint8_t addr[ETH_ALEN];
+	unsigned int size;
+	unsigned int cnt;
+	uint64_t slot[0];
 };
 
-static LIST_HEAD(mac_list);
+#define MAC_USED (1ull << 48)
+
+static struct mac_set *mac_set;
 static int type; // -1 - disabled, 1 - allow, 0 - denied
-static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *conf_mac_filter;
 
+/* readers in flight per generation, see mac_set_publish */
+static unsigned int gen;
+static unsigned int readers[2];
+
+static uint64_t mac_key(const uint8_t *addr)
+{
+	uint64_t k = MAC_USED;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		k |= (uint64_t)addr[i] << (40 - i * 8);
+
+	return k;
+}
+
+static unsigned int mac_hash(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdull;
+	k ^= k >> 33;
+
+	return k;
+}
+
+static int mac_set_find(const struct mac_set *set, uint64_t k)
+{
+	unsigned int i, mask = set->size - 1;
+
+	for (i = mac_hash(k) & mask; set->slot[i]; i = (i + 1) & mask) {
+		if (set->slot[i] == k)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct mac_set *mac_set_alloc(unsigned int cnt)
+{
+	struct mac_set *set;
+	unsigned int size = 16;
+
+	while (size < cnt * 2)
+		size <<= 1;
+
+	set = _malloc(sizeof(*set) + size * sizeof(uint64_t));
+	if (!set) {
+		log_emerg("pppoe: mac-filter: out of memory\n");
+		return NULL;
+	}
+
+	set->size = size;
+	set->cnt = 0;
+	memset(set->slot, 0, size * sizeof(uint64_t));
+
+	return set;
+}
+
+static void mac_set_insert(struct mac_set *set, uint64_t k)
+{
+	unsigned int i, mask = set->size - 1;
+
+	for (i = mac_hash(k) & mask; set->slot[i]; i = (i + 1) & mask) {
+		if (set->slot[i] == k)
+			return;
+	}
+
+	set->slot[i] = k;
+	set->cnt++;
+}
+
+/* copy of 'set' with room for 'extra' more addresses, without 'skip' */
+static struct mac_set *mac_set_copy(const struct mac_set *set, unsigned int extra, uint64_t skip)
+{
+	struct mac_set *n = mac_set_alloc((set ? set->cnt : 0) + extra);
+	unsigned int i;
+
+	if (!n || !set)
+		return n;
+
+	for (i = 0; i < set->size; i++) {
+		if (set->slot[i] && set->slot[i] != skip)
+			mac_set_insert(n, set->slot[i]);
+	}
+
+	return n;
+}
+
+/* must be called with lock held */
+static void mac_set_publish(struct mac_set *set)
+{
+	struct mac_set *old = mac_set;
+	unsigned int idx;
+
+	__atomic_store_n(&mac_set, set, __ATOMIC_RELEASE);
+
+	/* readers which may still see old set counted themselves in readers[idx] */
+	idx = __sync_fetch_and_add(&gen, 1) & 1;
+	while (__atomic_load_n(&readers[idx], __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	if (old)
+		_free(old);
+}
+
 int mac_filter_check(const uint8_t *addr)
 {
-	struct mac_t *mac;
+	struct mac_set *set;
+	unsigned int g, idx;
 	int res = type;
 
 	if (type == -1)
 		return 0;
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(mac->addr, addr, ETH_ALEN))
-			continue;
-		res = !type;
-		break;
+	/* if gen moved before we were counted, the writer may not wait for us */
+	while (1) {
+		g = __atomic_load_n(&gen, __ATOMIC_SEQ_CST);
+		idx = g & 1;
+		__sync_add_and_fetch(&readers[idx], 1);
+		if (__atomic_load_n(&gen, __ATOMIC_SEQ_CST) == g)
+			break;
+		__sync_sub_and_fetch(&readers[idx], 1);
 	}
-	pthread_rwlock_unlock(&lock);
+
+	set = __atomic_load_n(&mac_set, __ATOMIC_ACQUIRE);
+	if (set && mac_set_find(set, mac_key(addr)))
+		res = !type;
+
+	__sync_sub_and_fetch(&readers[idx], 1);
 
 	return res;
 }
 
+/* copies the list for the kernel prefilter, -1 if it has more than 'max' entries */
+int mac_filter_get(int *t, uint8_t *addr, int max)
+{
+	unsigned int i;
+	int j, cnt = 0;
+	uint64_t k;
+
+	pthread_mutex_lock(&lock);
+
+	*t = type;
+
+	if (mac_set && mac_set->cnt > max)
+		cnt = -1;
+
+	for (i = 0; cnt >= 0 && mac_set && i < mac_set->size; i++) {
+		k = mac_set->slot[i];
+		if (!k)
+			continue;
+		for (j = 0; j < ETH_ALEN; j++)
+			addr[cnt * ETH_ALEN + j] = k >> (40 - j * 8);
+		cnt++;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return cnt;
+}
+
+static int parse_mac(const char *str, uint8_t *addr)
+{
+	int n[ETH_ALEN];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x",
+		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6)
+		return -1;
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (n[i] > 255)
+			return -1;
+		addr[i] = n[i];
+	}
+
+	return 0;
+}
+
 static int mac_filter_load(const char *opt)
 {
-	struct mac_t *mac;
+	struct mac_set *set, *n;
 	FILE *f;
 	char *c;
 	char *name = _strdup(opt);
 	char *buf = _malloc(1024);
-	int n[ETH_ALEN];
-	int i, line = 0;
+	uint8_t addr[ETH_ALEN];
+	int line = 0;
 
 	c = strstr(name, ",");
 	if (!c)
@@ -76,37 +241,37 @@ static int mac_filter_load(const char *opt)
 
 	conf_mac_filter = opt;
 
-	pthread_rwlock_wrlock(&lock);
-	while (!list_empty(&mac_list)) {
-		mac = list_entry(mac_list.next, typeof(*mac), entry);
-		list_del(&mac->entry);
-		_free(mac);
-	}
+	set = mac_set_alloc(0);
 
-	while (fgets(buf, 1024, f)) {
+	while (set && fgets(buf, 1024, f)) {
 		line++;
 		if (buf[0] == '#' || buf[0] == ';' || buf[0] == '\n')
 			continue;
-		if (sscanf(buf, "%x:%x:%x:%x:%x:%x",
-			n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+		if (parse_mac(buf, addr)) {
 			log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
 			continue;
 		}
-		mac = _malloc(sizeof(*mac));
-		for (i = 0; i < ETH_ALEN; i++) {
-			if (n[i] > 255) {
-				log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
-				_free(mac);
-				continue;
-			}
-			mac->addr[i] = n[i];
+		if (set->cnt * 2 >= set->size) {
+			n = mac_set_copy(set, set->cnt, 0);
+			_free(set);
+			set = n;
+			if (!set)
+				break;
 		}
-		list_add_tail(&mac->entry, &mac_list);
+		mac_set_insert(set, mac_key(addr));
 	}
-	pthread_rwlock_unlock(&lock);
 
 	fclose(f);
 
+	if (!set)
+		goto err;
+
+	pthread_mutex_lock(&lock);
+	mac_set_publish(set);
+	pthread_mutex_unlock(&lock);
+
+	pppoe_disc_update_filter();
+
 	_free(name);
 	_free(buf);
 
@@ -120,74 +285,61 @@ err:
 	return -1;
 }
 
-static void mac_filter_add(const char *addr, void *client)
+static void mac_filter_add(const char *str, void *client)
 {
-	int n[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
+	struct mac_set *set;
+	uint8_t addr[ETH_ALEN];
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(str, addr)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	mac = _malloc(sizeof(*mac));
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			_free(mac);
-			cli_send(client, "invalid format\r\n");
-			return;
-		}
-		mac->addr[i] = n[i];
+	pthread_mutex_lock(&lock);
+	set = mac_set_copy(mac_set, 1, 0);
+	if (set) {
+		mac_set_insert(set, mac_key(addr));
+		mac_set_publish(set);
 	}
+	pthread_mutex_unlock(&lock);
 
-	pthread_rwlock_wrlock(&lock);
-	list_add_tail(&mac->entry, &mac_list);
-	pthread_rwlock_unlock(&lock);
+	pppoe_disc_update_filter();
 }
 
-static void mac_filter_del(const char *addr, void *client)
+static void mac_filter_del(const char *str, void *client)
 {
-	int n[ETH_ALEN];
-	uint8_t a[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
+	struct mac_set *set;
+	uint8_t addr[ETH_ALEN];
+	uint64_t k;
 	int found = 0;
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(str, addr)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			cli_send(client, "invalid format\r\n");
-			return;
-		}
-		a[i] = n[i];
-	}
+	k = mac_key(addr);
 
-	pthread_rwlock_wrlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(a, mac->addr, ETH_ALEN))
-			continue;
-		list_del(&mac->entry);
-		_free(mac);
+	pthread_mutex_lock(&lock);
+	if (mac_set && mac_set_find(mac_set, k)) {
+		set = mac_set_copy(mac_set, 0, k);
+		if (set)
+			mac_set_publish(set);
 		found = 1;
-		break;
 	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
 
 	if (!found)
 		cli_send(client, "not found\r\n");
+	else
+		pppoe_disc_update_filter();
 }
 
 static void mac_filter_show(void *client)
 {
-	struct mac_t *mac;
 	const char *filter_type;
+	uint64_t k;
+	unsigned int i;
 
 	if (type == 0)
 		filter_type = "deny";
@@ -198,13 +350,16 @@ static void mac_filter_show(void *client)
 
 	cli_sendv(client, "filter type: %s\r\n", filter_type);
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
+	pthread_mutex_lock(&lock);
+	for (i = 0; mac_set && i < mac_set->size; i++) {
+		if (!mac_set->slot[i])
+			continue;
+		k = mac_set->slot[i];
 		cli_sendv(client, "%02x:%02x:%02x:%02x:%02x:%02x\r\n",
-			mac->addr[0], mac->addr[1], mac->addr[2],
-			mac->addr[3],	mac->addr[4], mac->addr[5]);
+			(int)(k >> 40) & 0xff, (int)(k >> 32) & 0xff, (int)(k >> 24) & 0xff,
+			(int)(k >> 16) & 0xff, (int)(k >> 8) & 0xff, (int)k & 0xff);
 	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
 }
 
 static void cmd_help(char * const *fields, int fields_cnt, void *client);
@@ -27,7 +27,9 @@
 #endif
 
 #include "iputils.h"
+#include "utils.h"
 #include "connlimit.h"
+#include "keylimit.h"
 #include "vlan_mon.h"
 
 #include "pppoe.h"
@@ -42,6 +44,8 @@
 
 struct pppoe_conn_t {
 	struct list_head entry;
+	struct list_head sid_entry;
+	struct list_head cookie_entry;
 	struct triton_context_t ctx;
 	struct pppoe_serv_t *serv;
 	uint16_t sid;
@@ -73,13 +77,6 @@ struct delayed_pado_t
 	uint16_t ppp_max_payload;
 };
 
-struct padi_t
-{
-	struct list_head entry;
-	struct timespec ts;
-	uint8_t addr[ETH_ALEN];
-};
-
 struct iplink_arg {
 	pcre *re;
 	const char *opt;
@@ -100,13 +97,13 @@ static const char *conf_ip_pool;
 enum {CSID_MAC, CSID_IFNAME, CSID_IFNAME_MAC};
 static int conf_called_sid;
 static int conf_cookie_timeout;
+static int conf_cookie_des;
 static const char *conf_vlan_name;
 static int conf_vlan_timeout;
 static int conf_proxyarp = 0;
 
 static mempool_t conn_pool;
 static mempool_t pado_pool;
-static mempool_t padi_pool;
 
 unsigned int stat_starting;
 unsigned int stat_active;
@@ -129,6 +126,22 @@ static unsigned long *sid_map;
 static unsigned long *sid_ptr;
 static int sid_idx;
 
+/* connections of all servers indexed by sid and cookie,
+ * modified under both serv->lock and conn_hash_lock */
+#define CONN_HASH_SIZE 4096
+static pthread_mutex_t conn_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head sid_hash[CONN_HASH_SIZE];
+static struct list_head cookie_hash[CONN_HASH_SIZE];
+
+static inline unsigned int cookie_hash_key(const uint8_t *cookie)
+{
+	uint32_t k;
+
+	memcpy(&k, cookie, sizeof(k));
+
+	return k & (CONN_HASH_SIZE - 1);
+}
+
 static uint8_t bc_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 static void pppoe_send_PADT(struct pppoe_conn_t *conn);
@@ -179,6 +192,10 @@ static void disconnect(struct pppoe_conn_t *conn)
 
 	pthread_mutex_lock(&serv->lock);
 	list_del(&conn->entry);
+	pthread_mutex_lock(&conn_hash_lock);
+	list_del(&conn->sid_entry);
+	list_del(&conn->cookie_entry);
+	pthread_mutex_unlock(&conn_hash_lock);
 	serv->conn_cnt--;
 	if (serv->conn_cnt == 0) {
 		if (serv->stopping) {
@@ -412,6 +429,10 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 
 	pthread_mutex_lock(&serv->lock);
 	list_add_tail(&conn->entry, &serv->conn_list);
+	pthread_mutex_lock(&conn_hash_lock);
+	list_add_tail(&conn->sid_entry, &sid_hash[conn->sid & (CONN_HASH_SIZE - 1)]);
+	list_add_tail(&conn->cookie_entry, &cookie_hash[cookie_hash_key(conn->cookie)]);
+	pthread_mutex_unlock(&conn_hash_lock);
 	if (serv->timer.tpd)
 		triton_timer_del(&serv->timer);
 	serv->conn_cnt++;
@@ -478,10 +499,14 @@ static struct pppoe_conn_t *find_channel(struct pppoe_serv_t *serv, const uint8_
 {
 	struct pppoe_conn_t *conn;
 
-	list_for_each_entry(conn, &serv->conn_list, entry) {
-		if (!memcmp(conn->cookie, cookie, COOKIE_LENGTH - 4))
+	pthread_mutex_lock(&conn_hash_lock);
+	list_for_each_entry(conn, &cookie_hash[cookie_hash_key(cookie)], cookie_entry) {
+		if (conn->serv == serv && !memcmp(conn->cookie, cookie, COOKIE_LENGTH - 4)) {
+			pthread_mutex_unlock(&conn_hash_lock);
 			return conn;
+		}
 	}
+	pthread_mutex_unlock(&conn_hash_lock);
 
 	return NULL;
 }
@@ -611,7 +636,7 @@ static void print_packet(const char *ifname, const char *op, uint8_t *pack)
 	log_info2("]\n");
 }
 
-static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid)
+static void generate_cookie_des(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid)
 {
 	MD5_CTX ctx;
 	DES_cblock key;
@@ -660,7 +685,7 @@ static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8
 	memcpy(cookie, u1.raw, 24);
 }
 
-static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie, const struct pppoe_tag *relay_sid)
+static int check_cookie_des(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie, const struct pppoe_tag *relay_sid)
 {
 	MD5_CTX ctx;
 	DES_cblock key;
@@ -701,6 +726,80 @@ static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uin
 	return memcmp(u1.raw, u2.raw, 16);
 }
 
+/* hwaddr, src, 16 last bytes of cookie and relay-sid */
+static uint64_t cookie_mac(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie, const struct pppoe_tag *relay_sid)
+{
+	uint8_t buf[2 * ETH_ALEN + 16 + ETHER_MAX_LEN];
+	int len = 2 * ETH_ALEN + 16;
+
+	memcpy(buf, serv->hwaddr, ETH_ALEN);
+	memcpy(buf + ETH_ALEN, src, ETH_ALEN);
+	memcpy(buf + 2 * ETH_ALEN, cookie + 8, 16);
+
+	if (relay_sid && ntohs(relay_sid->tag_len) <= ETHER_MAX_LEN) {
+		memcpy(buf + len, relay_sid->tag_data, ntohs(relay_sid->tag_len));
+		len += ntohs(relay_sid->tag_len);
+	}
+
+	return u_siphash(serv->secret, buf, len);
+}
+
+/* mac (8) | host-uniq hash (4) | reserved (8) | expire (4) */
+static void generate_cookie_sip(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid)
+{
+	struct timespec ts;
+	uint64_t h = 0;
+	uint32_t v;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	memset(cookie, 0, COOKIE_LENGTH);
+
+	if (host_uniq)
+		h = u_siphash(serv->secret, host_uniq->tag_data, ntohs(host_uniq->tag_len));
+	v = h ^ (h >> 32);
+	memcpy(cookie + 8, &v, 4);
+
+	v = ts.tv_sec + conf_cookie_timeout;
+	memcpy(cookie + 20, &v, 4);
+
+	h = cookie_mac(serv, src, cookie, relay_sid);
+	memcpy(cookie, &h, 8);
+}
+
+static int check_cookie_sip(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie, const struct pppoe_tag *relay_sid)
+{
+	struct timespec ts;
+	uint64_t h;
+	uint32_t v;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	memcpy(&v, cookie + 20, 4);
+	if (v < ts.tv_sec)
+		return 1;
+
+	h = cookie_mac(serv, src, cookie, relay_sid);
+
+	return memcmp(cookie, &h, 8);
+}
+
+static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid)
+{
+	if (conf_cookie_des)
+		generate_cookie_des(serv, src, cookie, host_uniq, relay_sid);
+	else
+		generate_cookie_sip(serv, src, cookie, host_uniq, relay_sid);
+}
+
+static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie, const struct pppoe_tag *relay_sid)
+{
+	if (conf_cookie_des)
+		return check_cookie_des(serv, src, cookie, relay_sid);
+
+	return check_cookie_sip(serv, src, cookie, relay_sid);
+}
+
 static void setup_header(uint8_t *pack, const uint8_t *src, const uint8_t *dst, int code, uint16_t sid)
 {
 	struct ethhdr *ethhdr = (struct ethhdr *)pack;
@@ -883,49 +982,48 @@ static void pado_timer(struct triton_timer_t *t)
 	free_delayed_pado(pado);
 }
 
+#define PADI_HASH_SIZE 256
+
 static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
 {
-	struct padi_t *padi;
-	struct timespec ts;
+	int cnt, r;
 
 	if (serv->padi_limit == 0)
 		goto connlimit_check;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (!serv->padi_kl) {
+		serv->padi_kl = keylimit_create(1, PADI_HASH_SIZE);
+		if (!serv->padi_kl)
+			return -1;
+		/* one PADI per MAC per second */
+		keylimit_set(serv->padi_kl, 1, 1000, 1000);
+	}
 
-	while (!list_empty(&serv->padi_list)) {
-		padi = list_entry(serv->padi_list.next, typeof(*padi), entry);
-		if ((ts.tv_sec - padi->ts.tv_sec) * 1000 + (ts.tv_nsec - padi->ts.tv_nsec) / 1000000 > 1000) {
-			list_del(&padi->entry);
-			mempool_free(padi);
-			serv->padi_cnt--;
-			__sync_sub_and_fetch(&total_padi_cnt, 1);
-		} else
-			break;
+	keylimit_expire(serv->padi_kl);
+
+	cnt = keylimit_count(serv->padi_kl);
+	if (cnt != serv->padi_cnt) {
+		__sync_add_and_fetch(&total_padi_cnt, cnt - serv->padi_cnt);
+		serv->padi_cnt = cnt;
 	}
 
-	if (serv->padi_cnt == serv->padi_limit)
+	if (serv->padi_cnt >= serv->padi_limit)
 		return -1;
 
 	if (conf_padi_limit && total_padi_cnt >= conf_padi_limit)
 		return -1;
 
-	list_for_each_entry(padi, &serv->padi_list, entry) {
-		if (memcmp(padi->addr, addr, ETH_ALEN) == 0)
-			return -1;
+	r = keylimit_check(serv->padi_kl, cl_key_from_mac(addr));
+
+	cnt = keylimit_count(serv->padi_kl);
+	if (cnt != serv->padi_cnt) {
+		__sync_add_and_fetch(&total_padi_cnt, cnt - serv->padi_cnt);
+		serv->padi_cnt = cnt;
 	}
 
-	padi = mempool_alloc(padi_pool);
-	if (!padi)
+	if (r)
 		return -1;
 
-	padi->ts = ts;
-	memcpy(padi->addr, addr, ETH_ALEN);
-	list_add_tail(&padi->entry, &serv->padi_list);
-	serv->padi_cnt++;
-
-	__sync_add_and_fetch(&total_padi_cnt, 1);
-
 connlimit_check:
 	if (connlimit_loaded && connlimit_check(cl_key_from_mac(addr)))
 		return -1;
@@ -1207,36 +1305,42 @@ static void pppoe_recv_PADT(struct pppoe_serv_t *serv, uint8_t *pack)
 		print_packet(serv->ifname, "recv", pack);
 
 	pthread_mutex_lock(&serv->lock);
-	list_for_each_entry(conn, &serv->conn_list, entry) {
-		if (conn->sid == sid) {
+	pthread_mutex_lock(&conn_hash_lock);
+	list_for_each_entry(conn, &sid_hash[sid & (CONN_HASH_SIZE - 1)], sid_entry) {
+		if (conn->sid == sid && conn->serv == serv) {
 			if (!memcmp(conn->addr, ethhdr->h_source, ETH_ALEN))
 				triton_context_call(&conn->ctx, (void (*)(void *))disconnect, conn);
 			break;
 		}
 	}
+	pthread_mutex_unlock(&conn_hash_lock);
 	pthread_mutex_unlock(&serv->lock);
 }
 
-void pppoe_serv_read(uint8_t *data)
+void pppoe_serv_read(struct pppoe_pkt *pkt)
 {
 	struct pppoe_serv_t *serv = container_of(triton_context_self(), typeof(*serv), ctx);
-	uint8_t *pack = data + 4;
-	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
-	int n = *(int *)data;
+	struct pppoe_hdr *hdr;
+	struct pppoe_pkt *next;
 
-	switch (hdr->code) {
-		case CODE_PADI:
-			pppoe_recv_PADI(serv, pack, n);
-			break;
-		case CODE_PADR:
-			pppoe_recv_PADR(serv, pack, n);
-			break;
-		case CODE_PADT:
-			pppoe_recv_PADT(serv, pack);
-			break;
-	}
+	for (; pkt; pkt = next) {
+		next = pkt->next;
+		hdr = (struct pppoe_hdr *)(pkt->data + ETH_HLEN);
 
-	mempool_free(data);
+		switch (hdr->code) {
+			case CODE_PADI:
+				pppoe_recv_PADI(serv, pkt->data, pkt->len);
+				break;
+			case CODE_PADR:
+				pppoe_recv_PADR(serv, pkt->data, pkt->len);
+				break;
+			case CODE_PADT:
+				pppoe_recv_PADT(serv, pkt->data);
+				break;
+		}
+
+		mempool_free(pkt);
+	}
 }
 
 static void pppoe_serv_close(struct triton_context_t *ctx)
@@ -1484,7 +1588,6 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli,
 
 	INIT_LIST_HEAD(&serv->conn_list);
 	INIT_LIST_HEAD(&serv->pado_list);
-	INIT_LIST_HEAD(&serv->padi_list);
 	serv->padi_limit = padi_limit;
 
 	triton_context_register(&serv->ctx, serv);
@@ -1555,6 +1658,11 @@ void pppoe_server_free(struct pppoe_serv_t *serv)
 	if (serv->timer.tpd)
 		triton_timer_del(&serv->timer);
 
+	if (serv->padi_kl) {
+		__sync_sub_and_fetch(&total_padi_cnt, serv->padi_cnt);
+		keylimit_free(serv->padi_kl);
+	}
+
 	if (serv->vlan_mon) {
 		log_info2("pppoe: remove vlan %s\n", serv->ifname);
 		iplink_vlan_del(serv->ifindex);
@@ -1966,6 +2074,15 @@ static void load_config(void)
 	else
 		conf_cookie_timeout = 5;
 
+	opt = conf_get_opt("pppoe", "cookie");
+	if (opt && !strcmp(opt, "des"))
+		conf_cookie_des = 1;
+	else {
+		if (opt && strcmp(opt, "siphash"))
+			log_error("pppoe: unknown cookie type '%s'\n", opt);
+		conf_cookie_des = 0;
+	}
+
 
 	conf_mppe = MPPE_UNSET;
 	opt = conf_get_opt("pppoe", "mppe");
@@ -2029,9 +2146,14 @@ static void load_interfaces()
 
 static void pppoe_init(void)
 {
-	int fd;
+	int fd, i;
 	uint8_t *ptr;
 
+	for (i = 0; i < CONN_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&sid_hash[i]);
+		INIT_LIST_HEAD(&cookie_hash[i]);
+	}
+
 	ptr = malloc(SID_MAX/8);
 	memset(ptr, 0xff, SID_MAX/8);
 	ptr[0] = 0xfe;
@@ -2046,7 +2168,6 @@ static void pppoe_init(void)
 
 	conn_pool = mempool_create(sizeof(struct pppoe_conn_t));
 	pado_pool = mempool_create(sizeof(struct delayed_pado_t));
-	padi_pool = mempool_create(sizeof(struct padi_t));
 
 	if (!conf_get_section("pppoe")) {
 		log_error("pppoe: no configuration, disabled...\n");
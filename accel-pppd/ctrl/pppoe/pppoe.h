@@ -64,6 +64,14 @@ struct pppoe_packet_t
 	struct list_head tags;
 };
 
+/* discovery frame queued to server context, chained per batch */
+struct pppoe_pkt
+{
+	struct pppoe_pkt *next;
+	int len;
+	uint8_t data[ETHER_MAX_LEN];
+};
+
 struct pppoe_serv_t
 {
 	struct list_head entry;
@@ -92,7 +100,7 @@ struct pppoe_serv_t
 
 	struct list_head pado_list;
 
-	struct list_head padi_list;
+	struct keylimit *padi_kl;
 	int padi_cnt;
 	int padi_limit;
 	time_t last_padi_limit_warn;
@@ -121,13 +129,15 @@ extern pthread_rwlock_t serv_lock;
 extern struct list_head serv_list;
 
 int mac_filter_check(const uint8_t *addr);
+int mac_filter_get(int *type, uint8_t *addr, int max);
 void pppoe_server_start(const char *intf, void *client);
 void pppoe_server_stop(const char *intf);
-void pppoe_serv_read(uint8_t *data);
+void pppoe_serv_read(struct pppoe_pkt *pkt);
 void _server_stop(struct pppoe_serv_t *s);
 
 int pppoe_disc_start(struct pppoe_serv_t *serv);
 void pppoe_disc_stop(struct pppoe_serv_t *serv);
+void pppoe_disc_update_filter(void);
 
 extern int pado_delay;
 void dpado_check_next(int conn_cnt);
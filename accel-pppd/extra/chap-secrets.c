@@ -3,6 +3,8 @@
 #include <errno.h>
 #include <string.h>
 #include <byteswap.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -25,6 +27,7 @@ static char *conf_chap_secrets;
 static int conf_encrypted;
 static in_addr_t conf_gw_ip_address = 0;
 static int conf_netmask;
+static int conf_reload_interval = 5;
 
 static void *pd_key;
 static struct ipdb_t ipdb;
@@ -45,6 +48,34 @@ struct cs_pd_t
 	char *rate;
 };
 
+struct cs_entry
+{
+	struct cs_entry *next;
+	char *passwd;
+	char *rate;
+	in_addr_t peer_addr;
+	char username[0];
+};
+
+/* parsed chap-secrets file, replaced as a whole on reload */
+struct cs_db
+{
+	int refs;
+	unsigned int mask;
+	struct cs_entry **hash;
+};
+
+static struct cs_db *cs_db;
+static pthread_mutex_t cs_db_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stat cs_db_stat;
+
+static void cs_ctx_close(struct triton_context_t *ctx);
+static struct triton_context_t cs_ctx = {
+	.close = cs_ctx_close,
+	.before_switch = log_switch,
+};
+static struct triton_timer_t cs_timer;
+
 #ifdef CRYPTO_OPENSSL
 static LIST_HEAD(hash_chain);
 #endif
@@ -117,19 +148,276 @@ static int split(char *buf, char **ptr)
 }
 
 
-static struct cs_pd_t *create_pd(struct ap_session *ses, const char *username)
+static unsigned int hash_str(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static struct cs_entry *db_lookup(struct cs_db *db, const char *username)
+{
+	struct cs_entry *e;
+
+	for (e = db->hash[hash_str(username) & db->mask]; e; e = e->next) {
+		if (!strcmp(e->username, username))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void db_free(struct cs_db *db)
+{
+	struct cs_entry *e;
+	unsigned int i;
+
+	for (i = 0; i <= db->mask; i++) {
+		while (db->hash[i]) {
+			e = db->hash[i];
+			db->hash[i] = e->next;
+			_free(e);
+		}
+	}
+
+	_free(db->hash);
+	_free(db);
+}
+
+static struct cs_db *db_get(void)
+{
+	struct cs_db *db;
+
+	pthread_mutex_lock(&cs_db_lock);
+	db = cs_db;
+	if (db)
+		db->refs++;
+	pthread_mutex_unlock(&cs_db_lock);
+
+	return db;
+}
+
+static void db_put(struct cs_db *db)
+{
+	int refs;
+
+	pthread_mutex_lock(&cs_db_lock);
+	refs = --db->refs;
+	pthread_mutex_unlock(&cs_db_lock);
+
+	if (!refs)
+		db_free(db);
+}
+
+static void db_set(struct cs_db *db)
+{
+	struct cs_db *old;
+
+	pthread_mutex_lock(&cs_db_lock);
+	old = cs_db;
+	cs_db = db;
+	pthread_mutex_unlock(&cs_db_lock);
+
+	if (old)
+		db_put(old);
+}
+
+static struct cs_entry *parse_line(char *buf)
+{
+	char *ptr[5];
+	char *username = buf;
+	struct cs_entry *e;
+	int n, len, passwd_len, rate_len;
+
+	if (buf[0] == '#')
+		return NULL;
+
+	n = split(buf, ptr);
+	if (n < 3)
+		return NULL;
+
+	if (*username == '\'' || *username == '"')
+		username++;
+
+	len = strlen(username);
+	passwd_len = strlen(ptr[1]);
+	rate_len = n >= 4 ? strlen(ptr[3]) : -1;
+
+	e = _malloc(sizeof(*e) + len + 1 + passwd_len + 1 + rate_len + 1);
+	if (!e)
+		return NULL;
+
+	e->next = NULL;
+	memcpy(e->username, username, len + 1);
+	e->passwd = e->username + len + 1;
+	memcpy(e->passwd, ptr[1], passwd_len + 1);
+
+	if (n >= 4) {
+		e->rate = e->passwd + passwd_len + 1;
+		memcpy(e->rate, ptr[3], rate_len + 1);
+	} else
+		e->rate = NULL;
+
+	if (ptr[2][0] != '*')
+		e->peer_addr = inet_addr(ptr[2]);
+	else
+		e->peer_addr = 0;
+
+	return e;
+}
+
+static struct cs_db *db_load(const char *fname)
 {
 	FILE *f;
 	char *buf;
-	char *ptr[5];
-	int n, i;
-	struct cs_pd_t *pd;
+	struct cs_db *db;
+	struct cs_entry *e, *list = NULL, **tail = &list;
+	unsigned int h, n = 0, size = 64;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		log_error("chap-secrets: open '%s': %s\n", fname, strerror(errno));
+		return NULL;
+	}
+
+	buf = _malloc(4096);
+	if (!buf) {
+		log_emerg("chap-secrets: out of memory\n");
+		fclose(f);
+		return NULL;
+	}
+
+	while (fgets(buf, 4096, f)) {
+		e = parse_line(buf);
+		if (!e)
+			continue;
+		*tail = e;
+		tail = &e->next;
+		n++;
+	}
+
+	fclose(f);
+	_free(buf);
+
+	while (size < n)
+		size <<= 1;
+
+	db = _malloc(sizeof(*db));
+	if (db)
+		db->hash = _malloc(size * sizeof(*db->hash));
+
+	if (!db || !db->hash) {
+		log_emerg("chap-secrets: out of memory\n");
+		if (db)
+			_free(db);
+		while (list) {
+			e = list;
+			list = e->next;
+			_free(e);
+		}
+		return NULL;
+	}
+
+	db->refs = 1;
+	db->mask = size - 1;
+	memset(db->hash, 0, size * sizeof(*db->hash));
+
+	/* first line wins for duplicate usernames */
+	while (list) {
+		e = list;
+		list = e->next;
+
+		if (db_lookup(db, e->username)) {
+			_free(e);
+			continue;
+		}
+
+		h = hash_str(e->username) & db->mask;
+		e->next = db->hash[h];
+		db->hash[h] = e;
+	}
+
+	return db;
+}
+
+/* in-place edits within the same second keep st_mtime, so compare nanoseconds and ctime too */
+static int db_changed(const struct stat *st)
+{
+	return st->st_ino != cs_db_stat.st_ino ||
+		st->st_size != cs_db_stat.st_size ||
+		st->st_mtim.tv_sec != cs_db_stat.st_mtim.tv_sec ||
+		st->st_mtim.tv_nsec != cs_db_stat.st_mtim.tv_nsec ||
+		st->st_ctim.tv_sec != cs_db_stat.st_ctim.tv_sec ||
+		st->st_ctim.tv_nsec != cs_db_stat.st_ctim.tv_nsec;
+}
+
+static void db_reload(int force)
+{
+	struct stat st;
+	struct cs_db *db;
+
+	if (!conf_chap_secrets)
+		return;
+
+	if (stat(conf_chap_secrets, &st))
+		memset(&st, 0, sizeof(st));
+
+	if (!force && !db_changed(&st))
+		return;
+
+	cs_db_stat = st;
+
+	db = db_load(conf_chap_secrets);
+
+	db_set(db);
+}
+
+static void cs_timer_func(struct triton_timer_t *t)
+{
+	db_reload(0);
+}
+
+static void cs_reload(void *arg)
+{
+	db_reload(0);
+
+	if (conf_reload_interval) {
+		cs_timer.period = conf_reload_interval * 1000;
+		if (cs_timer.tpd)
+			triton_timer_mod(&cs_timer, 0);
+		else
+			triton_timer_add(&cs_ctx, &cs_timer, 0);
+	} else if (cs_timer.tpd)
+		triton_timer_del(&cs_timer);
+}
+
+static void cs_ctx_close(struct triton_context_t *ctx)
+{
+	if (cs_timer.tpd)
+		triton_timer_del(&cs_timer);
+
+	db_set(NULL);
+
+	triton_context_unregister(ctx);
+}
+
+static struct cs_pd_t *create_pd(struct ap_session *ses, const char *username)
+{
+	struct cs_db *db;
+	struct cs_entry *e;
+	struct cs_pd_t *pd = NULL;
 #ifdef CRYPTO_OPENSSL
 	char username_hash[EVP_MAX_MD_SIZE * 2 + 1];
 	uint8_t hash[EVP_MAX_MD_SIZE];
 	struct hash_chain *hc;
 	EVP_MD_CTX *md_ctx = NULL;
-	char c;
+	char c[3] = {0};
+	int i, n;
 #endif
 
 	if (!conf_chap_secrets)
@@ -155,42 +443,16 @@ static struct cs_pd_t *create_pd(struct ap_session *ses, const char *username)
 	}
 #endif
 
-	f = fopen(conf_chap_secrets, "r");
-	if (!f) {
-		log_error("chap-secrets: open '%s': %s\n", conf_chap_secrets, strerror(errno));
-		return NULL;
-	}
-
-	buf = _malloc(4096);
-	if (!buf) {
-		log_emerg("chap-secrets: out of memory\n");
-		fclose(f);
+	db = db_get();
+	if (!db)
 		return NULL;
-	}
-
-	while (fgets(buf, 4096, f)) {
-		if (buf[0] == '#')
-			continue;
-		n = split(buf, ptr);
-		if (n < 3)
-			continue;
-		if (*buf == '\'' || *buf == '"') {
-			if (!strcmp(buf + 1, username))
-				goto found;
-		} else {
-			if (!strcmp(buf, username))
-				goto found;
-		}
-	}
 
-out:
-	fclose(f);
-	_free(buf);
-	return NULL;
+	e = db_lookup(db, username);
+	if (!e)
+		goto out;
 
-found:
 #ifdef CRYPTO_OPENSSL
-	if (conf_encrypted && strlen(ptr[1]) != 32)
+	if (conf_encrypted && strlen(e->passwd) != 32)
 		goto out;
 #endif
 
@@ -208,39 +470,40 @@ found:
 		if (!pd->passwd) {
 			log_emerg("chap-secrets: out of memory\n");
 			_free(pd);
+			pd = NULL;
 			goto out;
 		}
 
+		/* entry is shared with other threads, don't modify it */
 		for (i = 0; i < 16; i++) {
-			c = ptr[1][i*2 + 2];
-			ptr[1][i*2 + 2] = 0;
-			pd->passwd[i] = strtol(ptr[1] + i*2, NULL, 16);
-			ptr[1][i*2 + 2] = c;
+			c[0] = e->passwd[i*2];
+			c[1] = e->passwd[i*2 + 1];
+			pd->passwd[i] = strtol(c, NULL, 16);
 		}
 	} else
 #endif
 	{
-		pd->passwd = _strdup(ptr[1]);
+		pd->passwd = _strdup(e->passwd);
 		if (!pd->passwd) {
 			log_emerg("chap-secrets: out of memory\n");
 			_free(pd);
+			pd = NULL;
 			goto out;
 		}
 	}
 
 	pd->ip.addr = conf_gw_ip_address;
-	if (n >= 3 && ptr[2][0] != '*')
-		pd->ip.peer_addr = inet_addr(ptr[2]);
+	pd->ip.peer_addr = e->peer_addr;
 	pd->ip.mask = conf_netmask;
 	pd->ip.owner = &ipdb;
 
-	if (n >= 4)
-		pd->rate = _strdup(ptr[3]);
+	if (e->rate)
+		pd->rate = _strdup(e->rate);
 
 	list_add_tail(&pd->pd.entry, &ses->pd_list);
 
-	fclose(f);
-	_free(buf);
+out:
+	db_put(db);
 
 	return pd;
 }
@@ -765,12 +1028,29 @@ static void load_config(void)
 	if (opt)
 		parse_hash_chain(opt);
 #endif
+
+	opt = conf_get_opt("chap-secrets", "reload-interval");
+	if (opt)
+		conf_reload_interval = atoi(opt);
+	else
+		conf_reload_interval = 5;
+
+	if (cs_ctx.tpd)
+		triton_context_call(&cs_ctx, cs_reload, NULL);
 }
 
 static void init(void)
 {
 	load_config();
 
+	db_reload(1);
+
+	cs_timer.expire = cs_timer_func;
+
+	triton_context_register(&cs_ctx, NULL);
+	triton_context_call(&cs_ctx, cs_reload, NULL);
+	triton_context_wakeup(&cs_ctx);
+
 	pwdb_register(&pwdb);
 	ipdb_register(&ipdb);
 
@@ -9,6 +9,7 @@
 #include "log.h"
 #include "list.h"
 #include "spinlock.h"
+#include "mempool.h"
 #include "backup.h"
 #include "ap_session_backup.h"
 
@@ -20,30 +21,51 @@
 
 #include "memdebug.h"
 
-struct ippool_t
+#define ITEM_CACHE_SIZE 16
+#define STICKY_HASH_SIZE 16384
+
+#define STICKY_USERNAME 1
+#define STICKY_CSID 2
+
+struct ippool_range
 {
 	struct list_head entry;
-	char *name;
-	struct list_head gw_list;
-	struct list_head tunnel_list;
-	struct list_head items;
 	uint32_t startip;
 	uint32_t endip;
-	void (*generate)(struct ippool_t *);
-	spinlock_t lock;
+	int len;
+	int pos;
+	int free_cnt;
+	unsigned long *free;
 };
 
-struct ippool_item_t
+struct ippool_t
 {
 	struct list_head entry;
-	struct ippool_t *pool;
-	struct ipv4db_item_t it;
+	char *name;
+	struct list_head ranges;
+	unsigned int gw_cnt;
+	unsigned int avail;
+	int step;
+	int offset;
+	void (*generate)(struct ippool_t *);
+	spinlock_t lock;
 };
 
-struct ipaddr_t
+/* last address of a user, most recently used first in sticky_lru */
+struct sticky_t
 {
 	struct list_head entry;
+	struct list_head lru_entry;
 	in_addr_t addr;
+	char key[0];
+};
+
+struct ippool_item_t
+{
+	struct ippool_range *range;
+	struct ippool_t *pool;
+	int slot;
+	struct ipv4db_item_t it;
 };
 
 static struct ipdb_t ipdb;
@@ -54,11 +76,22 @@ static int conf_vendor = 0;
 static int conf_attr = 88; // Framed-Pool
 #endif
 static int conf_shuffle;
+static int conf_sticky;
+static int conf_sticky_limit;
 
-static int cnt;
 static LIST_HEAD(pool_list);
 static struct ippool_t *def_pool;
 
+static mempool_t item_pool;
+static __thread struct ippool_item_t *item_cache[ITEM_CACHE_SIZE];
+static __thread int item_cache_cnt;
+static __thread uint32_t rnd_state;
+
+static struct list_head sticky_hash[STICKY_HASH_SIZE];
+static LIST_HEAD(sticky_lru);
+static int sticky_cnt;
+static spinlock_t sticky_lock;
+
 struct ippool_t *create_pool(const char *name)
 {
 	struct ippool_t *p = malloc(sizeof(*p));
@@ -67,9 +100,7 @@ struct ippool_t *create_pool(const char *name)
 	if (name)
 		p->name = strdup(name);
 
-	INIT_LIST_HEAD(&p->gw_list);
-	INIT_LIST_HEAD(&p->tunnel_list);
-	INIT_LIST_HEAD(&p->items);
+	INIT_LIST_HEAD(&p->ranges);
 	spinlock_init(&p->lock);
 
 	if (name)
@@ -171,10 +202,10 @@ static int parse2(const char *str, uint32_t *begin, uint32_t *end)
 	return 0;
 }
 
-static void add_range(struct ippool_t *p, struct list_head *list, const char *name, void (*generate)(struct ippool_t *))
+static void add_range(struct ippool_t *p, int gw, const char *name, void (*generate)(struct ippool_t *))
 {
-	uint32_t i,startip, endip;
-	struct ipaddr_t *ip;
+	uint32_t startip, endip;
+	struct ippool_range *r;
 
 	if (parse1(name, &startip, &endip)) {
 		if (parse2(name, &startip, &endip)) {
@@ -183,164 +214,343 @@ static void add_range(struct ippool_t *p, struct list_head *list, const char *na
 		}
 	}
 
-	for (i = startip; i <= endip; i++) {
-		ip = malloc(sizeof(*ip));
-		ip->addr = htonl(i);
-		list_add_tail(&ip->entry, list);
-		cnt++;
+	p->generate = generate;
+
+	if (gw) {
+		p->gw_cnt += endip - startip + 1;
+		return;
 	}
 
-	p->startip = startip;
-	p->endip = endip;
-	p->generate = generate;
+	r = malloc(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	r->startip = startip;
+	r->endip = endip;
+	list_add_tail(&r->entry, &p->ranges);
 }
 
-static uint8_t get_random()
+/* xorshift seeded from urandom, per thread */
+static uint32_t get_random()
 {
-	static uint8_t buf[128];
-	static int pos = 0;
-	int r;
+	uint32_t x = rnd_state;
 
-	if (pos == 0)
-		read(urandom_fd, buf, 128);
+	while (!x) {
+		if (read(urandom_fd, &x, sizeof(x)) != sizeof(x))
+			x = (uintptr_t)&x ^ getpid();
+	}
 
-	r = buf[pos++];
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
 
-	if (pos == 128)
-		pos = 0;
+	rnd_state = x;
 
-	return r;
+	return x;
 }
 
-static void generate_pool_p2p(struct ippool_t *p)
+/* one bit per slot, slot n maps to startip + n * step + offset */
+static void generate_bitmap(struct ippool_t *p, int step, int offset)
 {
-	struct ippool_item_t *it;
-	struct ipaddr_t *addr = NULL;
-	struct ipaddr_t *peer_addr;
-	struct list_head *pos, *pos1 = p->tunnel_list.next, *pos2 = p->tunnel_list.prev;
-	uint8_t r, t = 0;
+	struct ippool_range *r;
+	int n, bits = 8 * sizeof(long);
+	unsigned int total = 0;
 
-	while (1) {
-		if (list_empty(&p->tunnel_list))
-			break;
-		else {
-			if (conf_shuffle) {
-				if (pos1 == &p->tunnel_list)
-					pos1 = pos1->next;
+	p->step = step;
+	p->offset = offset;
 
-				if (pos2 == &p->tunnel_list)
-					pos2 = pos2->prev;
+	list_for_each_entry(r, &p->ranges, entry) {
+		if (r->endip - r->startip < offset)
+			r->len = 0;
+		else
+			r->len = (r->endip - r->startip - offset) / step + 1;
 
-				if (t++ < 10)
-					r = get_random();
-				else
-					r = get_random()%64;
+		n = (r->len + bits - 1) / bits;
+		r->free = malloc(n * sizeof(long));
+		if (!r->free) {
+			log_emerg("ippool: out of memory\n");
+			r->len = 0;
+			continue;
+		}
 
-				if (r < 32)
-					pos = pos1;
-				else if (r < 64)
-					pos = pos2;
+		memset(r->free, 0xff, n * sizeof(long));
+		if (r->len % bits)
+			r->free[n - 1] = (1ul << (r->len % bits)) - 1;
 
-				pos1 = pos1->next;
-				pos2 = pos2->prev;
+		r->free_cnt = r->len;
+		total += r->len;
+	}
 
-				if (r >= 64)
-					continue;
+	p->avail = total;
+}
 
-				peer_addr = list_entry(pos, typeof(*peer_addr), entry);
-				if (pos == pos1)
-					pos1 = pos1->next;
+static void generate_pool_p2p(struct ippool_t *p)
+{
+	generate_bitmap(p, 1, 0);
 
-				if (pos == pos2)
-					pos2 = pos2->prev;
+	/* each peer address is paired with gateway address */
+	if (!conf_gw_ip_address && p->avail > p->gw_cnt)
+		p->avail = p->gw_cnt;
+}
 
-				list_del(&peer_addr->entry);
-				t = 0;
-			} else {
-				peer_addr = list_entry(p->tunnel_list.next, typeof(*peer_addr), entry);
-				list_del(&peer_addr->entry);
-			}
-		}
+static void generate_pool_net30(struct ippool_t *p)
+{
+	generate_bitmap(p, 4, 2);
+}
 
-		if (!conf_gw_ip_address) {
-			if (list_empty(&p->gw_list))
-				break;
-			else {
-				addr = list_entry(p->gw_list.next, typeof(*addr), entry);
-				list_del(&addr->entry);
-			}
-		}
+static int range_alloc(struct ippool_range *r)
+{
+	int bits = 8 * sizeof(long);
+	int n = (r->len + bits - 1) / bits;
+	int i, j, k, start;
+	unsigned long w;
 
-		it = malloc(sizeof(*it));
-		if (!it) {
-			fprintf(stderr, "ippool: out of memory\n");
-			break;
-		}
+	if (!r->free_cnt)
+		return -1;
 
-		it->pool = p;
-		it->it.owner = &ipdb;
-		if (conf_gw_ip_address)
-			it->it.addr = conf_gw_ip_address;
-		else
-			it->it.addr = addr->addr;
+	start = conf_shuffle ? get_random() % n : r->pos;
+
+	for (j = 0; j < n; j++) {
+		i = (start + j) % n;
+		w = r->free[i];
+		if (!w)
+			continue;
+
+		if (conf_shuffle) {
+			/* pick random free bit of the word */
+			k = get_random() % __builtin_popcountl(w);
+			while (k--)
+				w &= w - 1;
+		}
 
-		it->it.peer_addr = peer_addr->addr;
+		k = __builtin_ctzl(w);
+		r->free[i] &= ~(1ul << k);
+		r->free_cnt--;
+		r->pos = i;
 
-		list_add_tail(&it->entry, &p->items);
+		return i * bits + k;
 	}
+
+	return -1;
 }
 
-static void generate_pool_net30(struct ippool_t *p)
+static void range_free(struct ippool_range *r, int slot)
 {
+	int bits = 8 * sizeof(long);
+
+	r->free[slot / bits] |= 1ul << (slot % bits);
+	r->free_cnt++;
+}
+
+static struct ippool_item_t *item_alloc(void)
+{
+	if (item_cache_cnt)
+		return item_cache[--item_cache_cnt];
+
+	return mempool_alloc(item_pool);
+}
+
+static void item_free(struct ippool_item_t *it)
+{
+	if (item_cache_cnt < ITEM_CACHE_SIZE)
+		item_cache[item_cache_cnt++] = it;
+	else
+		mempool_free(it);
+}
+
+static struct ippool_item_t *pool_alloc(struct ippool_t *p)
+{
+	struct ippool_range *r;
 	struct ippool_item_t *it;
-	struct ipaddr_t *addr[4];
-	int i;
+	int slot = -1;
 
-	while (1) {
-		memset(addr, 0, sizeof(addr));
+	it = item_alloc();
+	if (!it) {
+		log_emerg("ippool: out of memory\n");
+		return NULL;
+	}
 
-		for (i = 0; i < 4; i++) {
-			if (list_empty(&p->tunnel_list))
+	spin_lock(&p->lock);
+	if (p->avail) {
+		list_for_each_entry(r, &p->ranges, entry) {
+			slot = range_alloc(r);
+			if (slot >= 0)
 				break;
-
-			addr[i] = list_entry(p->tunnel_list.next, typeof(*addr[i]), entry);
-			list_del(&addr[i]->entry);
 		}
+		if (slot >= 0)
+			p->avail--;
+	}
+	spin_unlock(&p->lock);
 
-		if (!addr[2])
-			break;
+	if (slot < 0) {
+		item_free(it);
+		return NULL;
+	}
 
+	memset(it, 0, sizeof(*it));
+	it->range = r;
+	it->pool = p;
+	it->slot = slot;
+	it->it.owner = &ipdb;
+	it->it.peer_addr = htonl(r->startip + slot * p->step + p->offset);
 
-		it = malloc(sizeof(*it));
-		if (!it) {
-			log_emerg("ippool: out of memory\n");
+	return it;
+}
+
+/* takes given address out of the pool */
+static struct ippool_item_t *pool_claim(struct ippool_t *p, in_addr_t peer_addr)
+{
+	struct ippool_range *r;
+	struct ippool_item_t *it;
+	uint32_t a = ntohl(peer_addr);
+	int bits = 8 * sizeof(long);
+	int slot = -1;
+
+	it = item_alloc();
+	if (!it) {
+		log_emerg("ippool: out of memory\n");
+		return NULL;
+	}
+
+	spin_lock(&p->lock);
+	list_for_each_entry(r, &p->ranges, entry) {
+		if (a < r->startip + p->offset || a > r->endip)
+			continue;
+		if ((a - r->startip - p->offset) % p->step)
+			continue;
+		slot = (a - r->startip - p->offset) / p->step;
+		if (slot < r->len && p->avail && (r->free[slot / bits] & (1ul << (slot % bits)))) {
+			r->free[slot / bits] &= ~(1ul << (slot % bits));
+			r->free_cnt--;
+			p->avail--;
 			break;
 		}
+		slot = -1;
+	}
+	spin_unlock(&p->lock);
+
+	if (slot < 0) {
+		item_free(it);
+		return NULL;
+	}
 
-		it->pool = p;
-		it->it.owner = &ipdb;
-		it->it.addr = addr[1]->addr;
-		it->it.peer_addr = addr[2]->addr;
+	memset(it, 0, sizeof(*it));
+	it->range = r;
+	it->pool = p;
+	it->slot = slot;
+	it->it.owner = &ipdb;
+	it->it.peer_addr = peer_addr;
 
-		list_add_tail(&it->entry, &p->items);
+	return it;
+}
 
-		for (i = 0; i < 4; i++) {
-			if (addr[i])
-				free(addr[i]);
-		}
+static unsigned int hash_str(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	while (*str) {
+		h ^= (uint8_t)*str++;
+		h *= 16777619u;
 	}
 
-	for (i = 0; i < 4; i++) {
-		if (addr[i])
-			free(addr[i]);
+	return h;
+}
+
+static const char *sticky_key(struct ap_session *ses)
+{
+	if (!ses)
+		return NULL;
+
+	if (conf_sticky == STICKY_USERNAME)
+		return ses->username;
+
+	if (conf_sticky == STICKY_CSID)
+		return ses->ctrl->calling_station_id;
+
+	return NULL;
+}
+
+static struct sticky_t *sticky_lookup(struct list_head *head, const char *key)
+{
+	struct sticky_t *st;
+
+	list_for_each_entry(st, head, entry) {
+		if (!strcmp(st->key, key))
+			return st;
 	}
+
+	return NULL;
 }
 
+static in_addr_t sticky_find(const char *key)
+{
+	struct sticky_t *st;
+	in_addr_t addr = 0;
+
+	spin_lock(&sticky_lock);
+	st = sticky_lookup(&sticky_hash[hash_str(key) & (STICKY_HASH_SIZE - 1)], key);
+	if (st)
+		addr = st->addr;
+	spin_unlock(&sticky_lock);
+
+	return addr;
+}
+
+static void sticky_set(const char *key, in_addr_t addr)
+{
+	struct sticky_t *st, *n;
+	struct list_head *head = &sticky_hash[hash_str(key) & (STICKY_HASH_SIZE - 1)];
+	int len = strlen(key);
+
+	spin_lock(&sticky_lock);
+	st = sticky_lookup(head, key);
+	if (st) {
+		st->addr = addr;
+		list_move(&st->lru_entry, &sticky_lru);
+	}
+	spin_unlock(&sticky_lock);
+
+	if (st || !conf_sticky_limit)
+		return;
+
+	n = _malloc(sizeof(*n) + len + 1);
+	if (!n) {
+		log_emerg("ippool: out of memory\n");
+		return;
+	}
+
+	memcpy(n->key, key, len + 1);
+	n->addr = addr;
+
+	spin_lock(&sticky_lock);
+	st = sticky_lookup(head, key);
+	if (st) {
+		st->addr = addr;
+		list_move(&st->lru_entry, &sticky_lru);
+	} else {
+		while (sticky_cnt && sticky_cnt >= conf_sticky_limit) {
+			st = list_entry(sticky_lru.prev, typeof(*st), lru_entry);
+			list_del(&st->entry);
+			list_del(&st->lru_entry);
+			sticky_cnt--;
+			_free(st);
+		}
+
+		list_add(&n->entry, head);
+		list_add(&n->lru_entry, &sticky_lru);
+		sticky_cnt++;
+		n = NULL;
+	}
+	spin_unlock(&sticky_lock);
+
+	if (n)
+		_free(n);
+}
 
 static struct ipv4db_item_t *get_ip(struct ap_session *ses)
 {
-	struct ippool_item_t *it;
+	struct ippool_item_t *it = NULL;
 	struct ippool_t *p;
+	const char *key;
+	in_addr_t addr;
 
 	if (ses->ipv4_pool_name)
 		p = find_pool(ses->ipv4_pool_name, 0);
@@ -350,31 +560,45 @@ static struct ipv4db_item_t *get_ip(struct ap_session *ses)
 	if (!p)
 		return NULL;
 
-	spin_lock(&p->lock);
-	if (!list_empty(&p->items)) {
-		it = list_entry(p->items.next, typeof(*it), entry);
-		list_del(&it->entry);
-	} else
-		it = NULL;
-	spin_unlock(&p->lock);
-
-	if (it) {
-		if (ses->ctrl->ppp)
-			it->it.addr = conf_gw_ip_address;
-		else
-			it->it.addr = 0;
+	key = sticky_key(ses);
+	if (key) {
+		addr = sticky_find(key);
+		if (addr)
+			it = pool_claim(p, addr);
 	}
 
-	return it ? &it->it : NULL;
+	if (!it)
+		it = pool_alloc(p);
+
+	if (!it)
+		return NULL;
+
+	if (key)
+		sticky_set(key, it->it.peer_addr);
+
+	if (ses->ctrl->ppp)
+		it->it.addr = conf_gw_ip_address;
+	else
+		it->it.addr = 0;
+
+	return &it->it;
 }
 
 static void put_ip(struct ap_session *ses, struct ipv4db_item_t *it)
 {
 	struct ippool_item_t *pit = container_of(it, typeof(*pit), it);
+	struct ippool_t *p = pit->pool;
+	const char *key = sticky_key(ses);
+
+	if (key)
+		sticky_set(key, it->peer_addr);
+
+	spin_lock(&p->lock);
+	range_free(pit->range, pit->slot);
+	p->avail++;
+	spin_unlock(&p->lock);
 
-	spin_lock(&pit->pool->lock);
-	list_add(&pit->entry, &pit->pool->items);
-	spin_unlock(&pit->pool->lock);
+	item_free(pit);
 }
 
 static struct ipdb_t ipdb = {
@@ -405,7 +629,7 @@ static int session_restore(struct ap_session *ses, struct backup_mod *m)
 	struct backup_tag *tag;
 	in_addr_t addr = 0, peer_addr;
 	struct ippool_t *p;
-	struct ippool_item_t *it, *it0 = NULL;
+	struct ippool_item_t *it0;
 
 	m = backup_find_mod(m->data, MODID_COMMON);
 
@@ -420,32 +644,19 @@ static int session_restore(struct ap_session *ses, struct backup_mod *m)
 		}
 	}
 
-	spin_lock(&def_pool->lock);
-	list_for_each_entry(it, &def_pool->items, entry) {
-		if (peer_addr == it->it.peer_addr && addr == it->it.addr) {
-			list_del(&it->entry);
-			it0 = it;
-			break;
-		}
-	}
-	spin_unlock(&def_pool->lock);
+	it0 = pool_claim(def_pool, peer_addr);
 
 	if (!it0) {
 		list_for_each_entry(p, &pool_list, entry) {
-			spin_lock(&p->lock);
-			list_for_each_entry(it, &p->items, entry) {
-				if (peer_addr == it->it.peer_addr && addr == it->it.addr) {
-					list_del(&it->entry);
-					it0 = it;
-					break;
-				}
-			}
-			spin_unlock(&p->lock);
+			it0 = pool_claim(p, peer_addr);
 			if (it0)
 				break;
 		}
 	}
 
+	if (it0)
+		it0->it.addr = addr;
+
 	if (it0)
 		ses->ipv4 = &it0->it;
 	else {
@@ -573,8 +784,32 @@ static void parse_options(const char *opt, char **pool_name, char **allocator)
 	}
 }
 
+static void load_config(void)
+{
+	const char *opt;
+
+	opt = conf_get_opt("ip-pool", "sticky");
+	if (!opt || !strcmp(opt, "0") || !strcmp(opt, "none"))
+		conf_sticky = 0;
+	else if (!strcmp(opt, "username"))
+		conf_sticky = STICKY_USERNAME;
+	else if (!strcmp(opt, "calling-sid"))
+		conf_sticky = STICKY_CSID;
+	else {
+		log_error("ippool: unknown sticky mode '%s'\n", opt);
+		conf_sticky = 0;
+	}
+
+	opt = conf_get_opt("ip-pool", "sticky-limit");
+	if (opt && atoi(opt) >= 0)
+		conf_sticky_limit = atoi(opt);
+	else
+		conf_sticky_limit = 65536;
+}
+
 static void ippool_init1(void)
 {
+	item_pool = mempool_create(sizeof(struct ippool_item_t));
 	ipdb_register(&ipdb);
 }
 
@@ -586,10 +821,17 @@ static void ippool_init2(void)
 	char *pool_name = NULL;
 	char *allocator = NULL;
 	void (*generate)(struct ippool_t *pool);
+	int i;
 
 	if (!s)
 		return;
 
+	for (i = 0; i < STICKY_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sticky_hash[i]);
+	spinlock_init(&sticky_lock);
+
+	load_config();
+
 	def_pool = create_pool(NULL);
 
 	list_for_each_entry(opt, &s->items, entry) {
@@ -610,6 +852,8 @@ static void ippool_init2(void)
 			parse_gw_ip_address(opt->val);
 		else if (!strcmp(opt->name, "shuffle"))
 			conf_shuffle = atoi(opt->val);
+		else if (!strcmp(opt->name, "sticky") || !strcmp(opt->name, "sticky-limit"))
+			continue;
 		else {
 			pool_name = NULL;
 			allocator = NULL;
@@ -630,11 +874,11 @@ static void ippool_init2(void)
 			p = pool_name ? find_pool(pool_name, 1) : def_pool;
 
 			if (!strcmp(opt->name, "gw"))
-				add_range(p, &p->gw_list, opt->val, generate);
+				add_range(p, 1, opt->val, generate);
 			else if (!strcmp(opt->name, "tunnel"))
-				add_range(p, &p->tunnel_list, opt->val, generate);
+				add_range(p, 0, opt->val, generate);
 			else if (!opt->val || strchr(opt->name, ','))
-				add_range(p, &p->tunnel_list, opt->name, generate);
+				add_range(p, 0, opt->name, generate);
 
 			if (pool_name)
 				_free(pool_name);
@@ -654,6 +898,8 @@ static void ippool_init2(void)
 	backup_register_module(&backup_mod);
 #endif
 
+	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+
 #ifdef RADIUS
 	if (triton_module_loaded("radius"))
 		triton_event_register_handler(EV_RADIUS_ACCESS_ACCEPT, (triton_event_func)ev_radius_access_accept);
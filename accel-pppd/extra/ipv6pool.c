@@ -28,8 +28,21 @@ struct dppool_item_t
 	struct ipv6db_prefix_t it;
 };
 
+/* prefixes are handed out from ranges first, items are created on demand
+ * and kept in ippool/dppool after release */
+struct ippool_range
+{
+	struct list_head entry;
+	struct in6_addr addr;
+	int prefix_len;
+	uint64_t cnt;
+	uint64_t next;
+};
+
 static LIST_HEAD(ippool);
 static LIST_HEAD(dppool);
+static LIST_HEAD(ip_ranges);
+static LIST_HEAD(dp_ranges);
 static spinlock_t pool_lock;
 static struct ipdb_t ipdb;
 
@@ -44,93 +57,69 @@ static void in6_addr_add(struct in6_addr *res, const struct in6_addr *arg)
 	}
 }
 
-static int in6_addr_cmp(const struct in6_addr *n1, const struct in6_addr *n2)
+static void add_range(struct list_head *ranges, struct in6_addr *addr, int mask, int prefix_len)
 {
-	int i;
+	struct ippool_range *r = malloc(sizeof(*r));
 
-	for (i = 0; i < 16; i++) {
-		if (n1->s6_addr[i] < n2->s6_addr[i])
-			return -1;
-		if (n1->s6_addr[i] > n2->s6_addr[i])
-			return 1;
-	}
+	memcpy(&r->addr, addr, sizeof(*addr));
+	r->prefix_len = prefix_len;
+	r->next = 0;
+
+	if (prefix_len - mask >= 64)
+		r->cnt = UINT64_MAX;
+	else
+		r->cnt = 1llu << (prefix_len - mask);
 
-	return 0;
+	list_add_tail(&r->entry, ranges);
 }
 
-static void generate_ippool(struct in6_addr *addr, int mask, int prefix_len)
+/* must be called with pool_lock held */
+static int range_alloc(struct list_head *ranges, struct in6_addr *addr, int *prefix_len)
 {
-	struct ippool_item_t *it;
-	struct ipv6db_addr_t *a;
-	struct in6_addr ip, end, step;
-
-	memcpy(&ip, addr, sizeof(ip));
-
-	memcpy(&end, addr, sizeof(end));
-	if (mask > 64)
-		*(uint64_t *)(end.s6_addr + 8) = htobe64(be64toh(*(uint64_t *)(end.s6_addr + 8)) | ((1llu << (128 - mask)) - 1));
-	else {
-		memset(end.s6_addr + 8, 0xff, 8);
-		*(uint64_t *)end.s6_addr = htobe64(be64toh(*(uint64_t *)end.s6_addr) | ((1llu << (64 - mask)) - 1));
+	struct ippool_range *r;
+	struct in6_addr step;
+	int shift;
+	uint64_t n;
+
+	list_for_each_entry(r, ranges, entry) {
+		if (r->next == r->cnt)
+			continue;
+
+		n = r->next++;
+		shift = 128 - r->prefix_len;
+
+		memset(&step, 0, sizeof(step));
+		if (shift >= 64)
+			*(uint64_t *)step.s6_addr = htobe64(n << (shift - 64));
+		else {
+			*(uint64_t *)(step.s6_addr + 8) = htobe64(n << shift);
+			if (shift)
+				*(uint64_t *)step.s6_addr = htobe64(n >> (64 - shift));
+		}
+
+		memcpy(addr, &r->addr, sizeof(*addr));
+		in6_addr_add(addr, &step);
+		*prefix_len = r->prefix_len;
+
+		return 0;
 	}
 
-	memset(&step, 0, sizeof(step));
-	if (prefix_len > 64)
-		*(uint64_t *)(step.s6_addr + 8) = htobe64(1llu << (128 - prefix_len));
-	else
-		*(uint64_t *)step.s6_addr = htobe64(1llu << (64 - prefix_len));
-
-	while (in6_addr_cmp(&ip, &end) <= 0) {
-		it = malloc(sizeof(*it));
-		it->it.owner = &ipdb;
-		INIT_LIST_HEAD(&it->it.addr_list);
-		a = malloc(sizeof(*a));
-		memset(a, 0, sizeof(*a));
-		memcpy(&a->addr, &ip, sizeof(ip));
-		a->prefix_len = prefix_len;
-		list_add_tail(&a->entry, &it->it.addr_list);
-		list_add_tail(&it->entry, &ippool);
-		in6_addr_add(&ip, &step);
-	}
+	return -1;
 }
 
-static void generate_dppool(struct in6_addr *addr, int mask, int prefix_len)
+/* allocated before a prefix is taken from the range, so that failure doesn't lose it */
+static struct ipv6db_addr_t *alloc_addr(void)
 {
-	struct dppool_item_t *it;
-	struct in6_addr ip, end, step;
-	struct ipv6db_addr_t *a;
+	struct ipv6db_addr_t *a = malloc(sizeof(*a));
 
-	memcpy(&ip, addr, sizeof(ip));
+	if (!a)
+		return NULL;
 
-	memcpy(&end, addr, sizeof(end));
-	if (mask > 64)
-		*(uint64_t *)(end.s6_addr + 8) = htobe64(be64toh(*(uint64_t *)(end.s6_addr + 8)) | ((1llu << (128 - mask)) - 1));
-	else {
-		memset(end.s6_addr + 8, 0xff, 8);
-		*(uint64_t *)end.s6_addr = htobe64(be64toh(*(uint64_t *)end.s6_addr) | ((1llu << (64 - mask)) - 1));
-	}
+	memset(a, 0, sizeof(*a));
 
-	memset(&step, 0, sizeof(step));
-	if (prefix_len > 64)
-		*(uint64_t *)(step.s6_addr + 8) = htobe64(1llu << (128 - prefix_len));
-	else
-		*(uint64_t *)step.s6_addr = htobe64(1llu << (64 - prefix_len));
-
-	while (in6_addr_cmp(&ip, &end) <= 0) {
-		it = malloc(sizeof(*it));
-		it->it.owner = &ipdb;
-		INIT_LIST_HEAD(&it->it.prefix_list);
-		a = malloc(sizeof(*a));
-		memset(a, 0, sizeof(*a));
-		memcpy(&a->addr, &ip, sizeof(ip));
-		a->prefix_len = prefix_len;
-		list_add_tail(&a->entry, &it->it.prefix_list);
-		list_add_tail(&it->entry, &dppool);
-		in6_addr_add(&ip, &step);
-	}
+	return a;
 }
 
-
 static void add_prefix(int type, const char *_val)
 {
 	char *val = _strdup(_val);
@@ -166,10 +155,7 @@ static void add_prefix(int type, const char *_val)
 	if (prefix_len > 128  || prefix_len < mask)
 		goto err;
 
-	if (type)
-		generate_dppool(&addr, mask, prefix_len);
-	else
-		generate_ippool(&addr, mask, prefix_len);
+	add_range(type ? &dp_ranges : &ip_ranges, &addr, mask, prefix_len);
 
 	_free(val);
 	return;
@@ -181,19 +167,45 @@ err:
 
 static struct ipv6db_item_t *get_ip(struct ap_session *ses)
 {
-	struct ippool_item_t *it;
+	struct ippool_item_t *it, *it1 = NULL;
+	struct ipv6db_addr_t *a;
+
+	it = malloc(sizeof(*it));
+	a = alloc_addr();
+	if (!it || !a) {
+		log_emerg("ipv6_pool: out of memory\n");
+		free(it);
+		free(a);
+		return NULL;
+	}
 
 	spin_lock(&pool_lock);
-	if (!list_empty(&ippool)) {
-		it = list_entry(ippool.next, typeof(*it), entry);
-		list_del(&it->entry);
-		it->it.intf_id = 0;
-		it->it.peer_intf_id = 0;
-	} else
-		it = NULL;
-	spin_unlock(&pool_lock);
+	if (range_alloc(&ip_ranges, &a->addr, &a->prefix_len)) {
+		if (!list_empty(&ippool)) {
+			it1 = list_entry(ippool.next, typeof(*it1), entry);
+			list_del(&it1->entry);
+		}
+		spin_unlock(&pool_lock);
+
+		free(it);
+		free(a);
+
+		if (!it1)
+			return NULL;
+
+		it = it1;
+	} else {
+		spin_unlock(&pool_lock);
+
+		it->it.owner = &ipdb;
+		INIT_LIST_HEAD(&it->it.addr_list);
+		list_add_tail(&a->entry, &it->it.addr_list);
+	}
 
-	return it ? &it->it : NULL;
+	it->it.intf_id = 0;
+	it->it.peer_intf_id = 0;
+
+	return &it->it;
 }
 
 static void put_ip(struct ap_session *ses, struct ipv6db_item_t *it)
@@ -207,17 +219,42 @@ static void put_ip(struct ap_session *ses, struct ipv6db_item_t *it)
 
 static struct ipv6db_prefix_t *get_dp(struct ap_session *ses)
 {
-	struct dppool_item_t *it;
+	struct dppool_item_t *it, *it1 = NULL;
+	struct ipv6db_addr_t *a;
+
+	it = malloc(sizeof(*it));
+	a = alloc_addr();
+	if (!it || !a) {
+		log_emerg("ipv6_pool: out of memory\n");
+		free(it);
+		free(a);
+		return NULL;
+	}
 
 	spin_lock(&pool_lock);
-	if (!list_empty(&dppool)) {
-		it = list_entry(dppool.next, typeof(*it), entry);
-		list_del(&it->entry);
-	} else
-		it = NULL;
-	spin_unlock(&pool_lock);
+	if (range_alloc(&dp_ranges, &a->addr, &a->prefix_len)) {
+		if (!list_empty(&dppool)) {
+			it1 = list_entry(dppool.next, typeof(*it1), entry);
+			list_del(&it1->entry);
+		}
+		spin_unlock(&pool_lock);
+
+		free(it);
+		free(a);
+
+		if (!it1)
+			return NULL;
+
+		it = it1;
+	} else {
+		spin_unlock(&pool_lock);
+
+		it->it.owner = &ipdb;
+		INIT_LIST_HEAD(&it->it.prefix_list);
+		list_add_tail(&a->entry, &it->it.prefix_list);
+	}
 
-	return it ? &it->it : NULL;
+	return &it->it;
 }
 
 static void put_dp(struct ap_session *ses, struct ipv6db_prefix_t *it)
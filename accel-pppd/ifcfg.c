@@ -114,6 +114,9 @@ void ap_session_ifup(struct ap_session *ses)
 		ses->ifname_rename = NULL;
 	}
 
+	/* addresses are assigned by now */
+	ap_session_rehash(ses);
+
 	triton_event_fire(EV_SES_ACCT_START, ses);
 
 	if (ses->stop_time)
@@ -385,6 +388,7 @@ int __export ap_session_rename(struct ap_session *ses, const char *ifname, int l
 		log_ppp_info2("rename interface to '%s'\n", ifr.ifr_newname);
 		memcpy(ses->ifname, ifname, len);
 		ses->ifname[len] = 0;
+		ap_session_rehash(ses);
 	}
 
 	if (up) {
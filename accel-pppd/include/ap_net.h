@@ -1,6 +1,8 @@
 #ifndef __AP_NET_H
 #define __AP_NET_H
 
+struct mmsghdr;
+
 struct ap_net {
 	const char *name;
 	int (*socket)(int domain, int type, int proto);
@@ -9,6 +11,7 @@ struct ap_net {
 	int (*listen)(int sock, int backlog);
 	ssize_t (*read)(int sock, void *buf, size_t len);
 	ssize_t (*recvfrom)(int sock, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+	int (*recvmmsg)(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags); // optional
 	ssize_t (*write)(int sock, const void *buf, size_t len);
 	ssize_t (*sendto)(int sock, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 	int (*set_nonblocking)(int sock, int f);
@@ -1,6 +1,8 @@
 #ifndef __AP_SESSION_H__
 #define __AP_SESSION_H__
 
+#include <netinet/in.h>
+
 #include "ap_net.h"
 
 //#define AP_SESSIONID_LEN 16
@@ -62,9 +64,12 @@ struct ap_private
 	void *key;
 };
 
+#define AP_SES_HASH_CNT 5
+
 struct ap_session
 {
 	struct list_head entry;
+	struct list_head hash_entry[AP_SES_HASH_CNT];
 
 	int state;
 	char *chan_name;
@@ -147,6 +152,14 @@ void ap_session_accounting_started(struct ap_session *ses);
 int ap_session_set_username(struct ap_session *ses, char *username);
 int ap_check_username(const char *username);
 
+/* session registry lookups, ses_lock must be held */
+struct ap_session *ap_session_find_username(const char *username, struct ap_session *prev);
+struct ap_session *ap_session_find_sessionid(const char *sessionid);
+struct ap_session *ap_session_find_ifname(const char *ifname);
+struct ap_session *ap_session_find_ipv4(in_addr_t addr);
+struct ap_session *ap_session_find_ipv6(const struct in6_addr *addr);
+void ap_session_rehash(struct ap_session *ses);
+
 void ap_session_ifup(struct ap_session *ses);
 void ap_session_ifdown(struct ap_session *ses);
 int ap_session_rename(struct ap_session *ses, const char *ifname, int len);
@@ -0,0 +1,23 @@
+#ifndef __KEYLIMIT_H
+#define __KEYLIMIT_H
+
+#include <stdint.h>
+
+/*
+ * Per-key rate limiter: every key gets a token bucket of 'burst' tokens
+ * refilled by one token per 'interval' ms. Keys which were not accepted
+ * for 'timeout' ms are expired lazily on the next check of their shard.
+ */
+
+struct keylimit;
+
+struct keylimit *keylimit_create(int shards, int hash_size);
+void keylimit_free(struct keylimit *kl);
+void keylimit_set(struct keylimit *kl, int burst, int interval, int timeout);
+
+/* returns 0 if key is accepted, -1 if it's over limit */
+int keylimit_check(struct keylimit *kl, uint64_t key);
+void keylimit_expire(struct keylimit *kl);
+unsigned int keylimit_count(struct keylimit *kl);
+
+#endif
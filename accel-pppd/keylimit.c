@@ -0,0 +1,224 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "triton.h"
+#include "list.h"
+#include "log.h"
+#include "mempool.h"
+
+#include "keylimit.h"
+
+#include "memdebug.h"
+
+struct kl_item
+{
+	struct list_head hash_entry;
+	struct list_head age_entry;
+	uint64_t key;
+	uint64_t last;
+	uint64_t tat;
+};
+
+struct kl_shard
+{
+	pthread_mutex_t lock;
+	struct list_head age_list;
+	struct list_head *hash;
+};
+
+struct keylimit
+{
+	int shards;
+	int hash_size;
+	int burst;
+	int interval;
+	int timeout;
+	unsigned int count;
+	struct kl_shard shard[0];
+};
+
+static mempool_t item_pool;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint32_t hash_key(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+
+	return key;
+}
+
+struct keylimit __export *keylimit_create(int shards, int hash_size)
+{
+	struct keylimit *kl;
+	struct kl_shard *s;
+	int i, j;
+
+	kl = _malloc(sizeof(*kl) + shards * sizeof(struct kl_shard));
+	if (!kl)
+		return NULL;
+
+	memset(kl, 0, sizeof(*kl));
+	kl->shards = shards;
+	kl->hash_size = hash_size;
+	kl->burst = 1;
+	kl->interval = 1000;
+	kl->timeout = 1000;
+
+	for (i = 0; i < shards; i++) {
+		s = &kl->shard[i];
+		pthread_mutex_init(&s->lock, NULL);
+		INIT_LIST_HEAD(&s->age_list);
+		s->hash = _malloc(hash_size * sizeof(*s->hash));
+		if (!s->hash) {
+			while (i--)
+				_free(kl->shard[i].hash);
+			_free(kl);
+			return NULL;
+		}
+		for (j = 0; j < hash_size; j++)
+			INIT_LIST_HEAD(&s->hash[j]);
+	}
+
+	return kl;
+}
+
+void __export keylimit_free(struct keylimit *kl)
+{
+	struct kl_shard *s;
+	struct kl_item *it;
+	int i;
+
+	for (i = 0; i < kl->shards; i++) {
+		s = &kl->shard[i];
+		while (!list_empty(&s->age_list)) {
+			it = list_entry(s->age_list.next, typeof(*it), age_entry);
+			list_del(&it->age_entry);
+			mempool_free(it);
+		}
+		pthread_mutex_destroy(&s->lock);
+		_free(s->hash);
+	}
+
+	_free(kl);
+}
+
+void __export keylimit_set(struct keylimit *kl, int burst, int interval, int timeout)
+{
+	if (burst < 1)
+		burst = 1;
+
+	/* bucket must be refilled when item is expired */
+	if (timeout < burst * interval)
+		timeout = burst * interval;
+
+	kl->burst = burst;
+	kl->interval = interval;
+	kl->timeout = timeout;
+}
+
+static void __expire(struct keylimit *kl, struct kl_shard *s, uint64_t now)
+{
+	struct kl_item *it;
+
+	while (!list_empty(&s->age_list)) {
+		it = list_entry(s->age_list.next, typeof(*it), age_entry);
+		if (now - it->last < kl->timeout)
+			break;
+		list_del(&it->age_entry);
+		list_del(&it->hash_entry);
+		mempool_free(it);
+		__sync_sub_and_fetch(&kl->count, 1);
+	}
+}
+
+static struct kl_item *__find(struct keylimit *kl, struct kl_shard *s, uint64_t key, uint32_t h)
+{
+	struct kl_item *it;
+
+	list_for_each_entry(it, &s->hash[(h / kl->shards) % kl->hash_size], hash_entry) {
+		if (it->key == key)
+			return it;
+	}
+
+	return NULL;
+}
+
+int __export keylimit_check(struct keylimit *kl, uint64_t key)
+{
+	uint32_t h = hash_key(key);
+	struct kl_shard *s = &kl->shard[h % kl->shards];
+	struct kl_item *it;
+	uint64_t now = now_ms();
+	uint64_t tat;
+	int r = 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	__expire(kl, s, now);
+
+	it = __find(kl, s, key, h);
+	if (!it) {
+		it = mempool_alloc(item_pool);
+		if (!it) {
+			pthread_mutex_unlock(&s->lock);
+			log_emerg("keylimit: out of memory\n");
+			return -1;
+		}
+		it->key = key;
+		it->tat = now;
+		list_add_tail(&it->hash_entry, &s->hash[(h / kl->shards) % kl->hash_size]);
+		INIT_LIST_HEAD(&it->age_entry);
+		__sync_add_and_fetch(&kl->count, 1);
+	}
+
+	/* GCRA: accept while theoretical arrival time is within the burst */
+	tat = it->tat > now ? it->tat : now;
+	if (tat - now > (uint64_t)(kl->burst - 1) * kl->interval)
+		r = -1;
+	else {
+		it->tat = tat + kl->interval;
+		it->last = now;
+		list_move_tail(&it->age_entry, &s->age_list);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+void __export keylimit_expire(struct keylimit *kl)
+{
+	uint64_t now = now_ms();
+	int i;
+
+	for (i = 0; i < kl->shards; i++) {
+		pthread_mutex_lock(&kl->shard[i].lock);
+		__expire(kl, &kl->shard[i], now);
+		pthread_mutex_unlock(&kl->shard[i].lock);
+	}
+}
+
+unsigned int __export keylimit_count(struct keylimit *kl)
+{
+	return kl->count;
+}
+
+static void keylimit_init(void)
+{
+	item_pool = mempool_create(sizeof(struct kl_item));
+}
+
+DEFINE_INIT(0, keylimit_init);
@@ -47,6 +47,11 @@ static ssize_t def_recvfrom(int sock, void *buf, size_t len, int flags, struct s
 	return recvfrom(sock, buf, len, flags, src_addr, addrlen);
 }
 
+static int def_recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	return recvmmsg(sock, msgvec, vlen, flags, NULL);
+}
+
 static ssize_t def_write(int sock, const void *buf, size_t len)
 {
 	return write(sock, buf, len);
@@ -90,6 +95,7 @@ __export const struct ap_net def_net = {
 	.listen = def_listen,
 	.read = def_read,
 	.recvfrom = def_recvfrom,
+	.recvmmsg = def_recvmmsg,
 	.write = def_write,
 	.sendto = def_sendto,
 	.set_nonblocking = def_set_nonblocking,
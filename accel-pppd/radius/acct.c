@@ -20,21 +20,6 @@
 
 #define INTERIM_SAFE_TIME 10
 
-static int req_set_RA(struct rad_req_t *req, const char *secret)
-{
-	MD5_CTX ctx;
-
-	if (rad_packet_build(req->pack, req->RA))
-		return -1;
-
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, req->pack->buf, req->pack->len);
-	MD5_Update(&ctx, secret, strlen(secret));
-	MD5_Final(req->pack->buf + 4, &ctx);
-
-	return 0;
-}
-
 static int req_set_stat(struct rad_req_t *req, struct ap_session *ses)
 {
 	struct rtnl_link_stats stats;
@@ -48,16 +33,16 @@ static int req_set_stat(struct rad_req_t *req, struct ap_session *ses)
 		clock_gettime(CLOCK_MONOTONIC, &ts);
 
 	if (ap_session_read_stats(ses, &stats) == 0) {
-		rad_packet_change_int(req->pack, NULL, "Acct-Input-Octets", stats.rx_bytes);
-		rad_packet_change_int(req->pack, NULL, "Acct-Output-Octets", stats.tx_bytes);
-		rad_packet_change_int(req->pack, NULL, "Acct-Input-Packets", stats.rx_packets);
-		rad_packet_change_int(req->pack, NULL, "Acct-Output-Packets", stats.tx_packets);
-		rad_packet_change_int(req->pack, NULL, "Acct-Input-Gigawords", rpd->ses->acct_input_gigawords);
-		rad_packet_change_int(req->pack, NULL, "Acct-Output-Gigawords", rpd->ses->acct_output_gigawords);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_input_octets, stats.rx_bytes);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_output_octets, stats.tx_bytes);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_input_packets, stats.rx_packets);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_output_packets, stats.tx_packets);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_input_gigawords, rpd->ses->acct_input_gigawords);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_output_gigawords, rpd->ses->acct_output_gigawords);
 	} else
 		ret = -1;
 
-	rad_packet_change_int(req->pack, NULL, "Acct-Session-Time", ts.tv_sec - ses->start_time);
+	rad_packet_change_attr_int(req->pack, rad_attr.acct_session_time, ts.tv_sec - ses->start_time);
 
 	return ret;
 }
@@ -69,10 +54,12 @@ static void rad_acct_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_interim_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
+	if (req->hnd.fd != -1) {
+		if (!req->hnd.tpd)
+			triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
 
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+		triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	}
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -90,7 +77,10 @@ static void rad_acct_recv(struct rad_req_t *req)
 
 	triton_timer_del(&req->timeout);
 
-	triton_md_unregister_handler(&req->hnd, 1);
+	if (req->hnd.tpd)
+		triton_md_unregister_handler(&req->hnd, 1);
+	else
+		rad_server_sock_put(req);
 
 	rad_packet_free(req->reply);
 	req->reply = NULL;
@@ -111,7 +101,10 @@ static void rad_acct_timeout(struct triton_timer_t *t)
 
 	if (conf_acct_timeout == 0) {
 		triton_timer_del(t);
-		triton_md_unregister_handler(&req->hnd, 1);
+		if (req->hnd.tpd)
+			triton_md_unregister_handler(&req->hnd, 1);
+		else
+			rad_server_sock_put(req);
 		return;
 	}
 
@@ -167,7 +160,7 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	if (ses->ipv6_dp && !rpd->ipv6_dp_sent) {
 		struct ipv6db_addr_t *a;
 		list_for_each_entry(a, &ses->ipv6_dp->prefix_list, entry)
-			rad_packet_add_ipv6prefix(rpd->acct_req->pack, NULL, "Delegated-IPv6-Prefix", &a->addr, a->prefix_len);
+			rad_packet_add_attr_ipv6prefix(rpd->acct_req->pack, rad_attr.delegated_ipv6_prefix, &a->addr, a->prefix_len);
 		rpd->ipv6_dp_sent = 1;
 		force = 1;
 	}
@@ -185,7 +178,7 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	rpd->acct_req->pack->id++;
 
 	if (!rpd->acct_req->before_send)
-		req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret);
+		rad_req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret);
 
 	rpd->acct_req->timeout.expire_tv.tv_sec = conf_timeout;
 	rpd->acct_req->try = 0;
@@ -210,8 +203,8 @@ static int rad_acct_before_send(struct rad_req_t *req)
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	rad_packet_change_int(req->pack, NULL, "Acct-Delay-Time", ts.tv_sec - req->ts);
-	req_set_RA(req, req->serv->secret);
+	rad_packet_change_attr_int(req->pack, rad_attr.acct_delay_time, ts.tv_sec - req->ts);
+	rad_req_set_RA(req, req->serv->secret);
 
 	return 0;
 }
@@ -225,10 +218,12 @@ static void rad_acct_start_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_acct_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
+	if (req->hnd.fd != -1) {
+		if (!req->hnd.tpd)
+			triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
 
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+		triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	}
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -247,13 +242,16 @@ static void rad_acct_start_recv(struct rad_req_t *req)
 
 	triton_timer_del(&req->timeout);
 
-	triton_md_unregister_handler(&req->hnd, 1);
+	if (req->hnd.tpd)
+		triton_md_unregister_handler(&req->hnd, 1);
+	else
+		rad_server_sock_put(req);
 
 	if (rpd->acct_interim_interval) {
 		rad_packet_free(req->reply);
 		req->reply = NULL;
 
-		rad_packet_change_val(req->pack, NULL, "Acct-Status-Type", "Interim-Update");
+		rad_packet_change_attr_val(req->pack, rad_attr.acct_status_type, "Interim-Update");
 		rpd->acct_interim_timer.expire = rad_acct_interim_update;
 		rpd->acct_interim_timer.period = rpd->acct_interim_interval * 1000;
 		triton_timer_add(rpd->ses->ctrl->ctx, &rpd->acct_interim_timer, 0);
@@ -303,7 +301,7 @@ int rad_acct_start(struct radius_pd_t *rpd)
 
 	if (conf_acct_delay_time)
 		req->before_send = rad_acct_before_send;
-	else if (req_set_RA(req, req->serv->secret))
+	else if (rad_req_set_RA(req, req->serv->secret))
 		goto out_err;
 
 	req->recv = rad_acct_start_recv;
@@ -342,10 +340,12 @@ static void rad_acct_stop_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_acct_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd ? req->rpd->ses->ctrl->ctx : NULL, &req->hnd);
+	if (req->hnd.fd != -1) {
+		if (!req->hnd.tpd)
+			triton_md_register_handler(req->rpd ? req->rpd->ses->ctrl->ctx : NULL, &req->hnd);
 
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+		triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	}
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -463,36 +463,36 @@ int rad_acct_stop(struct radius_pd_t *rpd)
 
 	switch (rpd->ses->terminate_cause) {
 		case TERM_USER_REQUEST:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "User-Request");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "User-Request");
 			break;
 		case TERM_SESSION_TIMEOUT:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Session-Timeout");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "Session-Timeout");
 			break;
 		case TERM_ADMIN_RESET:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Admin-Reset");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "Admin-Reset");
 			break;
 		case TERM_USER_ERROR:
 		case TERM_AUTH_ERROR:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "User-Error");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "User-Error");
 			break;
 		case TERM_NAS_ERROR:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "NAS-Error");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "NAS-Error");
 			break;
 		case TERM_NAS_REQUEST:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "NAS-Request");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "NAS-Request");
 			break;
 		case TERM_NAS_REBOOT:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "NAS-Reboot");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "NAS-Reboot");
 			break;
 		case TERM_LOST_CARRIER:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Lost-Carrier");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "Lost-Carrier");
 			break;
 		case TERM_IDLE_TIMEOUT:
-			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Idle-Timeout");
+			rad_packet_add_attr_val(req->pack, rad_attr.acct_terminate_cause, "Idle-Timeout");
 			break;
 	}
 
-	rad_packet_change_val(req->pack, NULL, "Acct-Status-Type", "Stop");
+	rad_packet_change_attr_val(req->pack, rad_attr.acct_status_type, "Stop");
 
 	req_set_stat(req, rpd->ses);
 
@@ -501,7 +501,7 @@ int rad_acct_stop(struct radius_pd_t *rpd)
 			plugin->send_accounting_update(plugin, rpd->acct_req->pack);
 	}
 
-	req_set_RA(req, req->serv->secret);
+	rad_req_set_RA(req, req->serv->secret);
 
 	req->recv = rad_acct_stop_recv;
 	req->timeout.expire = rad_acct_start_timeout;
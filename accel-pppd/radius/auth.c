@@ -219,10 +219,12 @@ static void rad_auth_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_auth_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
+	if (req->hnd.fd != -1) {
+		if (!req->hnd.tpd)
+			triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
 
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+		triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	}
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -238,12 +240,12 @@ static struct rad_req_t *rad_auth_req_alloc(struct radius_pd_t *rpd, const char
 		return NULL;
 
 	if (conf_sid_in_auth) {
-		if (rad_packet_add_str(req->pack, NULL, "Acct-Session-Id", rpd->ses->sessionid))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.acct_session_id, rpd->ses->sessionid))
 			goto out;
 	}
 
 	if (rpd->attr_state) {
-		if (rad_packet_add_octets(req->pack, NULL, "State", rpd->attr_state, rpd->attr_state_len))
+		if (rad_packet_add_attr_octets(req->pack, rad_attr.state, rpd->attr_state, rpd->attr_state_len))
 			goto out;
 	}
 
@@ -280,7 +282,7 @@ int rad_auth_pap(struct radius_pd_t *rpd, const char *username, va_list args)
 	if (!epasswd)
 		return PWDB_DENIED;
 
-	r = rad_packet_add_octets(req->pack, NULL, "User-Password", epasswd, epasswd_len);
+	r = rad_packet_add_attr_octets(req->pack, rad_attr.user_password, epasswd, epasswd_len);
 	if (epasswd_len)
 		_free(epasswd);
 
@@ -311,10 +313,10 @@ int rad_auth_chap_md5(struct radius_pd_t *rpd, const char *username, va_list arg
 	if (challenge_len == 16)
 		memcpy(req->RA, challenge, 16);
 
-	if (rad_packet_add_octets(req->pack, NULL, "CHAP-Challenge", challenge, challenge_len))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.chap_challenge, challenge, challenge_len))
 		return PWDB_DENIED;
 
-	if (rad_packet_add_octets(req->pack, NULL, "CHAP-Password", chap_password, 17))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.chap_password, chap_password, 17))
 		return PWDB_DENIED;
 
 	if (rad_req_send(req))
@@ -408,10 +410,10 @@ int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list ar
 	memcpy(response + 2, lm_response, 24);
 	memcpy(response + 2 + 24, nt_response, 24);
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP-Challenge", challenge, challenge_len))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap_challenge, challenge, challenge_len))
 		return PWDB_DENIED;
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP-Response", response, sizeof(response)))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap_response, response, sizeof(response)))
 		return PWDB_DENIED;
 
 	if (rad_req_send(req))
@@ -479,10 +481,10 @@ int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list ar
 	memcpy(mschap_response + 2 + 16, reserved, 8);
 	memcpy(mschap_response + 2 + 16 + 8, response, 24);
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP-Challenge", challenge, 16))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap_challenge, challenge, 16))
 		return PWDB_DENIED;
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP2-Response", mschap_response, sizeof(mschap_response)))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap2_response, mschap_response, sizeof(mschap_response)))
 		return PWDB_DENIED;
 
 	if (rad_req_send(req))
@@ -10,8 +10,113 @@
 
 #include "memdebug.h"
 
+#define ATTR_HASH_SIZE 1024
+#define VALUE_HASH_SIZE 1024
+#define VENDOR_HASH_SIZE 64
+
 static struct rad_dict_t *dict;
 
+/* indexes built by dict_load, keyed by (vendor, name), (attr, name), (attr, value) and vendor name/id */
+static struct list_head attr_hash[ATTR_HASH_SIZE];
+static struct list_head val_hash[VALUE_HASH_SIZE];
+static struct list_head val_hash_int[VALUE_HASH_SIZE];
+static struct list_head vendor_hash[VENDOR_HASH_SIZE];
+static struct list_head vendor_hash_id[VENDOR_HASH_SIZE];
+static struct rad_dict_attr_t *attr_id[256];
+
+static unsigned int hash_str(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *str; str++)
+		h = (h ^ (uint8_t)*str) * 16777619u;
+
+	return h;
+}
+
+static inline unsigned int hash_ptr(const void *ptr)
+{
+	unsigned long v = (unsigned long)ptr;
+
+	return (unsigned int)(v >> 4) ^ (unsigned int)(v >> 16);
+}
+
+static void dict_hash_init(void)
+{
+	int i;
+
+	for (i = 0; i < ATTR_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&attr_hash[i]);
+
+	for (i = 0; i < VALUE_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&val_hash[i]);
+		INIT_LIST_HEAD(&val_hash_int[i]);
+	}
+
+	for (i = 0; i < VENDOR_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&vendor_hash[i]);
+		INIT_LIST_HEAD(&vendor_hash_id[i]);
+	}
+
+	memset(attr_id, 0, sizeof(attr_id));
+}
+
+static struct rad_dict_attr_t *dict_find_attr(struct rad_dict_vendor_t *vendor, const char *name)
+{
+	struct rad_dict_attr_t *attr;
+	struct list_head *head = &attr_hash[(hash_str(name) ^ hash_ptr(vendor)) & (ATTR_HASH_SIZE - 1)];
+
+	list_for_each_entry(attr, head, hentry)
+		if (attr->vendor == vendor && !strcmp(attr->name, name))
+			return attr;
+
+	return NULL;
+}
+
+static int dict_add_attr(struct rad_dict_vendor_t *vendor, struct rad_dict_attr_t *attr)
+{
+	struct rad_dict_attr_t **ids;
+
+	attr->vendor = vendor;
+	list_add_tail(&attr->hentry, &attr_hash[(hash_str(attr->name) ^ hash_ptr(vendor)) & (ATTR_HASH_SIZE - 1)]);
+
+	if (attr->id < 0 || attr->id > 255)
+		return 0;
+
+	if (vendor) {
+		if (!vendor->attr_id) {
+			vendor->attr_id = _malloc(256 * sizeof(*vendor->attr_id));
+			if (!vendor->attr_id)
+				return -1;
+			memset(vendor->attr_id, 0, 256 * sizeof(*vendor->attr_id));
+		}
+		ids = vendor->attr_id;
+	} else
+		ids = attr_id;
+
+	if (!ids[attr->id])
+		ids[attr->id] = attr;
+
+	return 0;
+}
+
+static void dict_add_val(struct rad_dict_attr_t *attr, struct rad_dict_value_t *val)
+{
+	val->attr = attr;
+	list_add_tail(&val->hentry, &val_hash[(hash_str(val->name) ^ hash_ptr(attr)) & (VALUE_HASH_SIZE - 1)]);
+
+	if (attr->type == ATTR_TYPE_INTEGER)
+		list_add_tail(&val->hentry_val, &val_hash_int[(val->val.integer ^ hash_ptr(attr)) & (VALUE_HASH_SIZE - 1)]);
+	else
+		INIT_LIST_HEAD(&val->hentry_val);
+}
+
+static void dict_add_vendor(struct rad_dict_vendor_t *vendor)
+{
+	list_add_tail(&vendor->hentry, &vendor_hash[hash_str(vendor->name) & (VENDOR_HASH_SIZE - 1)]);
+	list_add_tail(&vendor->hentry_id, &vendor_hash_id[vendor->id & (VENDOR_HASH_SIZE - 1)]);
+}
+
 static char *skip_word(char *ptr)
 {
 	for(; *ptr; ptr++)
@@ -53,17 +158,6 @@ static int split(char *buf, char **ptr)
 	return i;
 }
 
-struct rad_dict_attr_t *find_attr(struct list_head *items, const char *name)
-{
-	struct rad_dict_attr_t *attr;
-
-	list_for_each_entry(attr, items, entry)
-		if (!strcmp(attr->name, name))
-			return attr;
-
-	return NULL;
-}
-
 #define BUF_SIZE 1024
 
 static char *path, *fname1, *buf;
@@ -74,7 +168,7 @@ static int dict_load(const char *fname)
 	int r, n = 0;
 	struct rad_dict_attr_t *attr;
 	struct rad_dict_value_t *val;
-	struct rad_dict_vendor_t *vendor;
+	struct rad_dict_vendor_t *vendor, *cur_vendor = NULL;
 	struct list_head *items;
 
 	f = fopen(fname, "r");
@@ -98,9 +192,11 @@ static int dict_load(const char *fname)
 					goto out_err;
 				}
 				items = &vendor->items;
-			} else if (!strcmp(buf, "END-VENDOR"))
+				cur_vendor = vendor;
+			} else if (!strcmp(buf, "END-VENDOR")) {
 				items = &dict->items;
-			else if (!strcmp(buf, "$INCLUDE")) {
+				cur_vendor = NULL;
+			} else if (!strcmp(buf, "$INCLUDE")) {
 				for (r = strlen(path) - 1; r; r--)
 					if (path[r] == '/') {
 						path[r + 1] = 0;
@@ -127,8 +223,10 @@ static int dict_load(const char *fname)
 					log_emerg("radius: out of memory\n");
 					goto out_err;
 				}
+				vendor->attr_id = NULL;
 				INIT_LIST_HEAD(&vendor->items);
 				list_add_tail(&vendor->entry, &dict->vendors);
+				dict_add_vendor(vendor);
 			} else
 				goto out_err_syntax;
 		} else if (r == 3) {
@@ -165,8 +263,12 @@ static int dict_load(const char *fname)
 					log_emerg("radius:%s:%i: unknown attribute type\n", fname, n);
 					goto out_err;
 				}
+				if (dict_add_attr(cur_vendor, attr)) {
+					log_emerg("radius: out of memory\n");
+					goto out_err;
+				}
 			} else if (!strcmp(buf, "VALUE")) {
-				attr = find_attr(items, ptr[0]);
+				attr = dict_find_attr(cur_vendor, ptr[0]);
 				if (!attr) {
 					log_emerg("radius:%s:%i: unknown attribute\n", fname, n);
 					goto out_err;
@@ -195,6 +297,7 @@ static int dict_load(const char *fname)
 						log_warn("radius:%s:%i: VALUE of type 'ipaddr' is not implemented yet\n", fname, n);
 						break;
 				}
+				dict_add_val(attr, val);
 			} else
 				goto out_err_syntax;
 		} else
@@ -225,6 +328,7 @@ int rad_dict_load(const char *fname)
 		}
 		INIT_LIST_HEAD(&dict->items);
 		INIT_LIST_HEAD(&dict->vendors);
+		dict_hash_init();
 	}
 
 	path = _malloc(PATH_MAX);
@@ -261,9 +365,17 @@ out_free_dict:
 
 void rad_dict_free(struct rad_dict_t *dict)
 {
+	struct rad_dict_vendor_t *vendor;
 	struct rad_dict_attr_t *attr;
 	struct rad_dict_value_t *val;
 
+	list_for_each_entry(vendor, &dict->vendors, entry) {
+		if (vendor->attr_id) {
+			_free(vendor->attr_id);
+			vendor->attr_id = NULL;
+		}
+	}
+
 	while (!list_empty(&dict->items)) {
 		attr = list_entry(dict->items.next, typeof(*attr), entry);
 		while (!list_empty(&attr->values)) {
@@ -279,28 +391,27 @@ void rad_dict_free(struct rad_dict_t *dict)
 		_free(attr);
 	}
 	free(dict);
-}
-
-static struct rad_dict_attr_t *dict_find_attr(struct list_head *items, const char *name)
-{
-	struct rad_dict_attr_t *attr;
-
-	list_for_each_entry(attr, items, entry)
-		if (!strcmp(attr->name, name))
-			return attr;
 
-	return NULL;
+	dict_hash_init();
 }
 
 __export struct rad_dict_attr_t *rad_dict_find_attr(const char *name)
 {
-	return dict_find_attr(&dict->items, name);
+	return dict_find_attr(NULL, name);
 }
 
 __export struct rad_dict_attr_t *rad_dict_find_attr_id(struct rad_dict_vendor_t *vendor, int id)
 {
 	struct rad_dict_attr_t *attr;
-	struct list_head *items = vendor ? &vendor->items : &dict->items;
+	struct list_head *items;
+
+	if (id >= 0 && id <= 255) {
+		if (!vendor)
+			return attr_id[id];
+		return vendor->attr_id ? vendor->attr_id[id] : NULL;
+	}
+
+	items = vendor ? &vendor->items : &dict->items;
 
 	list_for_each_entry(attr, items, entry)
 		if (attr->id == id)
@@ -312,9 +423,10 @@ __export struct rad_dict_attr_t *rad_dict_find_attr_id(struct rad_dict_vendor_t
 __export struct rad_dict_value_t *rad_dict_find_val_name(struct rad_dict_attr_t *attr, const char *name)
 {
 	struct rad_dict_value_t *val;
+	struct list_head *head = &val_hash[(hash_str(name) ^ hash_ptr(attr)) & (VALUE_HASH_SIZE - 1)];
 
-	list_for_each_entry(val, &attr->values, entry)
-		if (!strcmp(val->name, name))
+	list_for_each_entry(val, head, hentry)
+		if (val->attr == attr && !strcmp(val->name, name))
 			return val;
 
 	return NULL;
@@ -323,12 +435,15 @@ __export struct rad_dict_value_t *rad_dict_find_val_name(struct rad_dict_attr_t
 __export struct rad_dict_value_t *rad_dict_find_val(struct rad_dict_attr_t *attr, rad_value_t v)
 {
 	struct rad_dict_value_t *val;
+	struct list_head *head;
 
 	if (attr->type != ATTR_TYPE_INTEGER)
 		return NULL;
 
-	list_for_each_entry(val, &attr->values, entry)
-		if (val->val.integer == v.integer)
+	head = &val_hash_int[(v.integer ^ hash_ptr(attr)) & (VALUE_HASH_SIZE - 1)];
+
+	list_for_each_entry(val, head, hentry_val)
+		if (val->attr == attr && val->val.integer == v.integer)
 			return val;
 
 	return NULL;
@@ -337,8 +452,9 @@ __export struct rad_dict_value_t *rad_dict_find_val(struct rad_dict_attr_t *attr
 __export struct rad_dict_vendor_t *rad_dict_find_vendor_name(const char *name)
 {
 	struct rad_dict_vendor_t *vendor;
+	struct list_head *head = &vendor_hash[hash_str(name) & (VENDOR_HASH_SIZE - 1)];
 
-	list_for_each_entry(vendor, &dict->vendors, entry) {
+	list_for_each_entry(vendor, head, hentry) {
 		if (!strcmp(vendor->name, name))
 			return vendor;
 	}
@@ -349,8 +465,9 @@ __export struct rad_dict_vendor_t *rad_dict_find_vendor_name(const char *name)
 __export struct rad_dict_vendor_t *rad_dict_find_vendor_id(int id)
 {
 	struct rad_dict_vendor_t *vendor;
+	struct list_head *head = &vendor_hash_id[id & (VENDOR_HASH_SIZE - 1)];
 
-	list_for_each_entry(vendor, &dict->vendors, entry) {
+	list_for_each_entry(vendor, head, hentry_id) {
 		if (vendor->id == id)
 			return vendor;
 	}
@@ -360,6 +477,5 @@ __export struct rad_dict_vendor_t *rad_dict_find_vendor_id(int id)
 
 __export struct rad_dict_attr_t *rad_dict_find_vendor_attr(struct rad_dict_vendor_t *vendor, const char *name)
 {
-	return dict_find_attr(&vendor->items, name);
+	return dict_find_attr(vendor, name);
 }
-
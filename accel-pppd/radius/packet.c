@@ -371,48 +371,73 @@ void rad_packet_print(struct rad_packet_t *pack, struct rad_server_t *s, void (*
 	print("]\n");
 }
 
-int __export rad_packet_add_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
+static struct rad_dict_attr_t *find_dict_attr(const char *vendor_name, const char *name)
 {
-	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
 	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + 4 >= REQ_LENGTH_MAX)
-		return -1;
+	if (!vendor_name)
+		return rad_dict_find_attr(name);
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+	vendor = rad_dict_find_vendor_name(vendor_name);
+	if (!vendor)
+		return NULL;
+
+	return rad_dict_find_vendor_attr(vendor, name);
+}
+
+static struct rad_attr_t *attr_alloc(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int len)
+{
+	struct rad_attr_t *ra;
 
 	if (!attr)
-		return -1;
+		return NULL;
+
+	if (pack->len + (attr->vendor ? 8 : 2) + len >= REQ_LENGTH_MAX)
+		return NULL;
 
 	ra = mempool_alloc(attr_pool);
-	if (!ra)
-		return -1;
+	if (!ra) {
+		log_emerg("radius: out of memory\n");
+		return NULL;
+	}
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
-	ra->len = 4;
-	ra->val.integer = val;
+	ra->len = len;
+
+	return ra;
+}
+
+static void attr_add(struct rad_packet_t *pack, struct rad_attr_t *ra)
+{
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 4;
+	pack->len += (ra->vendor ? 8 : 2) + ra->len;
+}
+
+int __export rad_packet_add_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val)
+{
+	struct rad_attr_t *ra = attr_alloc(pack, attr, 4);
+
+	if (!ra)
+		return -1;
+
+	ra->val.integer = val;
+	attr_add(pack, ra);
 
 	return 0;
 }
 
-int __export rad_packet_change_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
+int __export rad_packet_add_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
+{
+	return rad_packet_add_attr_int(pack, find_dict_attr(vendor_name, name), val);
+}
+
+int __export rad_packet_change_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val)
 {
 	struct rad_attr_t *ra;
 
-	ra = rad_packet_find_attr(pack, vendor_name, name);
+	ra = rad_packet_lookup_attr(pack, attr);
 	if (!ra)
 		return -1;
 
@@ -421,55 +446,46 @@ int __export rad_packet_change_int(struct rad_packet_t *pack, const char *vendor
 	return 0;
 }
 
-int __export rad_packet_add_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
+int __export rad_packet_change_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + len >= REQ_LENGTH_MAX)
+	ra = rad_packet_find_attr(pack, vendor_name, name);
+	if (!ra)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+	ra->val.integer = val;
 
-	if (!attr)
-		return -1;
+	return 0;
+}
 
-	ra = mempool_alloc(attr_pool);
-	if (!ra) {
-		log_emerg("radius: out of memory\n");
-		return -1;
-	}
+int __export rad_packet_add_attr_octets(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const uint8_t *val, int len)
+{
+	struct rad_attr_t *ra = attr_alloc(pack, attr, len);
 
-	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
-	ra->attr = attr;
-	ra->len = len;
+	if (!ra)
+		return -1;
 
 	if (len) {
 		ra->val.octets = _malloc(len);
 		if (!ra->val.octets) {
 			log_emerg("radius: out of memory\n");
-			_free(ra);
+			mempool_free(ra);
 			return -1;
 		}
 		memcpy(ra->val.octets, val, len);
 	}
 
-	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + len;
+	attr_add(pack, ra);
 
 	return 0;
 }
 
+int __export rad_packet_add_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
+{
+	return rad_packet_add_attr_octets(pack, find_dict_attr(vendor_name, name), val, len);
+}
+
 int __export rad_packet_change_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
 {
 	struct rad_attr_t *ra;
@@ -498,54 +514,33 @@ int __export rad_packet_change_octets(struct rad_packet_t *pack, const char *ven
 	return 0;
 }
 
-
-int __export rad_packet_add_str(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+int __export rad_packet_add_attr_str(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val)
 {
-	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
 	int len = strlen(val);
+	struct rad_attr_t *ra = attr_alloc(pack, attr, len);
 
-	if (pack->len + (vendor_name ? 8 : 2) + len >= REQ_LENGTH_MAX)
-		return -1;
-
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
-
-	if (!attr)
-		return -1;
-
-	ra = mempool_alloc(attr_pool);
-	if (!ra) {
-		log_emerg("radius: out of memory\n");
+	if (!ra)
 		return -1;
-	}
 
-	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
-	ra->attr = attr;
-	ra->len = len;
 	ra->val.string = _malloc(len + 1);
 	if (!ra->val.string) {
 		log_emerg("radius: out of memory\n");
-		_free(ra);
+		mempool_free(ra);
 		return -1;
 	}
 	memcpy(ra->val.string, val, len);
 	ra->val.string[len] = 0;
-	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + len;
+
+	attr_add(pack, ra);
 
 	return 0;
 }
 
+int __export rad_packet_add_str(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+{
+	return rad_packet_add_attr_str(pack, find_dict_attr(vendor_name, name), val);
+}
+
 int __export rad_packet_change_str(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val, int len)
 {
 	struct rad_attr_t *ra;
@@ -574,25 +569,10 @@ int __export rad_packet_change_str(struct rad_packet_t *pack, const char *vendor
 	return 0;
 }
 
-int __export rad_packet_add_val(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+int __export rad_packet_add_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val)
 {
-	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
 	struct rad_dict_value_t *v;
-	struct rad_dict_vendor_t *vendor;
-
-	if (pack->len + (vendor_name ? 8 : 2) + 4 >= REQ_LENGTH_MAX)
-		return -1;
-
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+	struct rad_attr_t *ra;
 
 	if (!attr)
 		return -1;
@@ -601,27 +581,25 @@ int __export rad_packet_add_val(struct rad_packet_t *pack, const char *vendor_na
 	if (!v)
 		return -1;
 
-	ra = mempool_alloc(attr_pool);
+	ra = attr_alloc(pack, attr, 4);
 	if (!ra)
 		return -1;
 
-	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
-	ra->attr = attr;
-	ra->len = 4;
 	ra->val = v->val;
-	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 4;
+	attr_add(pack, ra);
 
 	return 0;
 }
 
-int __export rad_packet_change_val(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+int __export rad_packet_add_val(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+{
+	return rad_packet_add_attr_val(pack, find_dict_attr(vendor_name, name), val);
+}
+
+static int change_val(struct rad_attr_t *ra, const char *val)
 {
-	struct rad_attr_t *ra;
 	struct rad_dict_value_t *v;
 
-	ra = rad_packet_find_attr(pack, vendor_name, name);
 	if (!ra)
 		return -1;
 
@@ -634,107 +612,94 @@ int __export rad_packet_change_val(struct rad_packet_t *pack, const char *vendor
 	return 0;
 }
 
-int __export rad_packet_add_ipaddr(struct rad_packet_t *pack, const char *vendor_name, const char *name, in_addr_t ipaddr)
+int __export rad_packet_change_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val)
 {
-	return rad_packet_add_int(pack, vendor_name, name, ipaddr);
+	return change_val(rad_packet_lookup_attr(pack, attr), val);
 }
 
-int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor_name, const char *name, uint64_t ifid)
+int __export rad_packet_change_val(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
 {
-	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
+	return change_val(rad_packet_find_attr(pack, vendor_name, name), val);
+}
 
-	if (pack->len + (vendor_name ? 8 : 2) + 8 >= REQ_LENGTH_MAX)
-		return -1;
+int __export rad_packet_add_attr_ipaddr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, in_addr_t ipaddr)
+{
+	return rad_packet_add_attr_int(pack, attr, ipaddr);
+}
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+int __export rad_packet_add_ipaddr(struct rad_packet_t *pack, const char *vendor_name, const char *name, in_addr_t ipaddr)
+{
+	return rad_packet_add_int(pack, vendor_name, name, ipaddr);
+}
 
-	if (!attr)
-		return -1;
+int rad_packet_add_attr_ifid(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, uint64_t ifid)
+{
+	struct rad_attr_t *ra = attr_alloc(pack, attr, 8);
 
-	ra = mempool_alloc(attr_pool);
 	if (!ra)
 		return -1;
 
-	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
-	ra->attr = attr;
-	ra->len = 8;
 	ra->val.ifid = ifid;
-	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 8;
+	attr_add(pack, ra);
 
 	return 0;
 }
 
-int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor_name, const char *name, struct in6_addr *prefix, int len)
+int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor_name, const char *name, uint64_t ifid)
 {
-	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
-
-	if (pack->len + (vendor_name ? 8 : 2) + 18 >= REQ_LENGTH_MAX)
-		return -1;
-
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+	return rad_packet_add_attr_ifid(pack, find_dict_attr(vendor_name, name), ifid);
+}
 
-	if (!attr)
-		return -1;
+int rad_packet_add_attr_ipv6prefix(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct in6_addr *prefix, int len)
+{
+	struct rad_attr_t *ra = attr_alloc(pack, attr, 18);
 
-	ra = mempool_alloc(attr_pool);
 	if (!ra)
 		return -1;
 
-	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
-	ra->attr = attr;
-	ra->len = 18;
 	ra->val.ipv6prefix.len = len;
 	ra->val.ipv6prefix.prefix = *prefix;
-	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 18;
+	attr_add(pack, ra);
 
 	return 0;
 }
 
+int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor_name, const char *name, struct in6_addr *prefix, int len)
+{
+	return rad_packet_add_attr_ipv6prefix(pack, find_dict_attr(vendor_name, name), prefix, len);
+}
 
-struct rad_attr_t __export *rad_packet_find_attr(struct rad_packet_t *pack, const char *vendor_name, const char *name)
+struct rad_attr_t __export *rad_packet_lookup_attr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_vendor_t *vendor;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return NULL;
-	} else
-		vendor = NULL;
+	if (!attr)
+		return NULL;
 
 	list_for_each_entry(ra, &pack->attrs, entry) {
-		if (vendor && vendor != ra->vendor)
-			continue;
+		if (ra->attr == attr)
+			return ra;
+	}
+
+	return NULL;
+}
 
-		if (strcmp(ra->attr->name, name))
-			continue;
+struct rad_attr_t __export *rad_packet_find_attr(struct rad_packet_t *pack, const char *vendor_name, const char *name)
+{
+	struct rad_attr_t *ra;
+	struct rad_dict_attr_t *attr;
+
+	attr = find_dict_attr(vendor_name, name);
+	if (vendor_name)
+		return rad_packet_lookup_attr(pack, attr);
+
+	list_for_each_entry(ra, &pack->attrs, entry) {
+		if (ra->attr == attr)
+			return ra;
 
-		return ra;
+		/* without vendor name vendor specific attributes are matched by name */
+		if (ra->vendor && !strcmp(ra->attr->name, name))
+			return ra;
 	}
 
 	return NULL;
@@ -49,7 +49,32 @@ static int conf_default_realm_len;
 
 const char *conf_attr_tunnel_type;
 
+struct rad_attrs_t rad_attr;
+
+#define SES_HASH_BITS 11
+#define SES_HASH_SIZE (1 << SES_HASH_BITS)
+
+enum {
+	SES_HASH_SID,
+	SES_HASH_USERNAME,
+	SES_HASH_PORT_ID,
+	SES_HASH_IPADDR,
+	SES_HASH_CSID,
+	SES_HASH_PORT,
+};
+
+struct ses_key {
+	const char *sessionid;
+	const char *username;
+	const char *port_id;
+	int port;
+	in_addr_t ipaddr;
+	const char *csid;
+};
+
+/* sessions which are not started yet, started ones are in ses_hash */
 static LIST_HEAD(sessions);
+static struct list_head ses_hash[RAD_SES_HASH_CNT][SES_HASH_SIZE];
 static pthread_rwlock_t sessions_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 static void *pd_key;
@@ -386,6 +411,58 @@ void rad_update_session_timeout(struct radius_pd_t *rpd, int timeout)
 		triton_timer_add(rpd->ses->ctrl->ctx, &rpd->session_timeout, 0);
 }
 
+static unsigned int ses_hash_str(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	if (s) {
+		while (*s) {
+			h ^= (uint8_t)*s++;
+			h *= 16777619u;
+		}
+	}
+
+	return h & (SES_HASH_SIZE - 1);
+}
+
+static unsigned int ses_hash_int(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - SES_HASH_BITS);
+}
+
+static void ses_index(struct radius_pd_t *rpd)
+{
+	struct ap_session *ses = rpd->ses;
+
+	list_del(&rpd->entry);
+
+	/* sessions without address or calling-station-id go to key 0/"" bucket
+	 * since rad_find_session doesn't filter them by those keys */
+	list_add_tail(&rpd->hash_entry[SES_HASH_SID], &ses_hash[SES_HASH_SID][ses_hash_str(ses->sessionid)]);
+	list_add_tail(&rpd->hash_entry[SES_HASH_USERNAME], &ses_hash[SES_HASH_USERNAME][ses_hash_str(ses->username)]);
+	list_add_tail(&rpd->hash_entry[SES_HASH_PORT_ID], &ses_hash[SES_HASH_PORT_ID][ses_hash_str(ses->ifname)]);
+	list_add_tail(&rpd->hash_entry[SES_HASH_IPADDR], &ses_hash[SES_HASH_IPADDR][ses_hash_int(ses->ipv4 ? ses->ipv4->peer_addr : 0)]);
+	list_add_tail(&rpd->hash_entry[SES_HASH_CSID], &ses_hash[SES_HASH_CSID][ses_hash_str(ses->ctrl->calling_station_id)]);
+	list_add_tail(&rpd->hash_entry[SES_HASH_PORT], &ses_hash[SES_HASH_PORT][ses_hash_int(ses->unit_idx)]);
+
+	rpd->indexed = 1;
+}
+
+static void ses_unindex(struct radius_pd_t *rpd)
+{
+	int i;
+
+	if (!rpd->indexed) {
+		list_del(&rpd->entry);
+		return;
+	}
+
+	for (i = 0; i < RAD_SES_HASH_CNT; i++)
+		list_del(&rpd->hash_entry[i]);
+
+	rpd->indexed = 0;
+}
+
 static void ses_starting(struct ap_session *ses)
 {
 	struct radius_pd_t *rpd = mempool_alloc(rpd_pool);
@@ -438,6 +515,11 @@ static void ses_started(struct ap_session *ses)
 	struct radius_pd_t *rpd = find_pd(ses);
 	struct framed_route *fr;
 
+	/* lookup keys don't change anymore */
+	pthread_rwlock_wrlock(&sessions_lock);
+	ses_index(rpd);
+	pthread_rwlock_unlock(&sessions_lock);
+
 	if (rpd->session_timeout.expire_tv.tv_sec) {
 		rpd->session_timeout.expire = session_timeout;
 		triton_timer_add(ses->ctrl->ctx, &rpd->session_timeout, 0);
@@ -482,7 +564,7 @@ static void ses_finished(struct ap_session *ses)
 
 	pthread_rwlock_wrlock(&sessions_lock);
 	pthread_mutex_lock(&rpd->lock);
-	list_del(&rpd->entry);
+	ses_unindex(rpd);
 	pthread_mutex_unlock(&rpd->lock);
 	pthread_rwlock_unlock(&sessions_lock);
 
@@ -576,34 +658,102 @@ void release_pd(struct radius_pd_t *rpd)
 		mempool_free(rpd);
 }
 
-struct radius_pd_t *rad_find_session(const char *sessionid, const char *username, const char *port_id, int port, in_addr_t ipaddr, const char *csid)
+static int ses_match(struct radius_pd_t *rpd, const struct ses_key *k)
 {
+	if (!rpd->ses->username)
+		return 0;
+	if (k->sessionid && strcmp(k->sessionid, rpd->ses->sessionid))
+		return 0;
+	if (k->username && strcmp(k->username, rpd->ses->username))
+		return 0;
+	if (k->port >= 0 && k->port != rpd->ses->unit_idx)
+		return 0;
+	if (k->port_id && strcmp(k->port_id, rpd->ses->ifname))
+		return 0;
+	if (k->ipaddr && rpd->ses->ipv4 && k->ipaddr != rpd->ses->ipv4->peer_addr)
+		return 0;
+	if (k->csid && rpd->ses->ctrl->calling_station_id && strcmp(k->csid, rpd->ses->ctrl->calling_station_id))
+		return 0;
+
+	return 1;
+}
+
+static struct radius_pd_t *ses_hash_find(int idx, unsigned int h, const struct ses_key *k)
+{
+	struct list_head *pos;
 	struct radius_pd_t *rpd;
 
-	pthread_rwlock_rdlock(&sessions_lock);
+	list_for_each(pos, &ses_hash[idx][h]) {
+		rpd = container_of(pos - idx, typeof(*rpd), hash_entry[0]);
+		if (ses_match(rpd, k))
+			return rpd;
+	}
+
+	return NULL;
+}
+
+static struct radius_pd_t *__find_session(const struct ses_key *k)
+{
+	struct radius_pd_t *rpd;
+	unsigned int h;
+
 	list_for_each_entry(rpd, &sessions, entry) {
-		if (!rpd->ses->username)
-			continue;
-		if (sessionid && strcmp(sessionid, rpd->ses->sessionid))
-			continue;
-		if (username && strcmp(username, rpd->ses->username))
-			continue;
-		if (port >= 0 && port != rpd->ses->unit_idx)
-			continue;
-		if (port_id && strcmp(port_id, rpd->ses->ifname))
-			continue;
-		if (ipaddr && rpd->ses->ipv4 && ipaddr != rpd->ses->ipv4->peer_addr)
-			continue;
-		if (csid && rpd->ses->ctrl->calling_station_id && strcmp(csid, rpd->ses->ctrl->calling_station_id))
-			continue;
-		pthread_mutex_lock(&rpd->lock);
-		pthread_rwlock_unlock(&sessions_lock);
+		if (ses_match(rpd, k))
+			return rpd;
+	}
+
+	if (k->sessionid)
+		return ses_hash_find(SES_HASH_SID, ses_hash_str(k->sessionid), k);
+
+	if (k->username)
+		return ses_hash_find(SES_HASH_USERNAME, ses_hash_str(k->username), k);
+
+	if (k->port_id)
+		return ses_hash_find(SES_HASH_PORT_ID, ses_hash_str(k->port_id), k);
+
+	if (k->ipaddr) {
+		h = ses_hash_int(k->ipaddr);
+		rpd = ses_hash_find(SES_HASH_IPADDR, h, k);
+		if (!rpd && h != ses_hash_int(0))
+			rpd = ses_hash_find(SES_HASH_IPADDR, ses_hash_int(0), k);
 		return rpd;
 	}
-	pthread_rwlock_unlock(&sessions_lock);
+
+	if (k->csid) {
+		h = ses_hash_str(k->csid);
+		rpd = ses_hash_find(SES_HASH_CSID, h, k);
+		if (!rpd && h != ses_hash_str(NULL))
+			rpd = ses_hash_find(SES_HASH_CSID, ses_hash_str(NULL), k);
+		return rpd;
+	}
+
+	if (k->port >= 0)
+		return ses_hash_find(SES_HASH_PORT, ses_hash_int(k->port), k);
+
 	return NULL;
 }
 
+struct radius_pd_t *rad_find_session(const char *sessionid, const char *username, const char *port_id, int port, in_addr_t ipaddr, const char *csid)
+{
+	struct radius_pd_t *rpd;
+	struct ses_key k = {
+		.sessionid = sessionid,
+		.username = username,
+		.port_id = port_id,
+		.port = port,
+		.ipaddr = ipaddr,
+		.csid = csid,
+	};
+
+	pthread_rwlock_rdlock(&sessions_lock);
+	rpd = __find_session(&k);
+	if (rpd)
+		pthread_mutex_lock(&rpd->lock);
+	pthread_rwlock_unlock(&sessions_lock);
+
+	return rpd;
+}
+
 struct radius_pd_t *rad_find_session_pack(struct rad_packet_t *pack)
 {
 	struct rad_attr_t *attr;
@@ -651,13 +801,15 @@ struct radius_pd_t *rad_find_session_pack(struct rad_packet_t *pack)
 int rad_check_nas_pack(struct rad_packet_t *pack)
 {
 	struct rad_attr_t *attr;
+	struct rad_dict_attr_t *attr_ident = rad_dict_find_attr("NAS-Identifier");
+	struct rad_dict_attr_t *attr_ipaddr = rad_dict_find_attr("NAS-IP-Address");
 	const char *ident = NULL;
 	in_addr_t ipaddr = 0;
 
 	list_for_each_entry(attr, &pack->attrs, entry) {
-		if (!strcmp(attr->attr->name, "NAS-Identifier"))
+		if (attr->attr == attr_ident)
 			ident = attr->val.string;
-		else if (!strcmp(attr->attr->name, "NAS-IP-Address"))
+		else if (attr->attr == attr_ipaddr)
 			ipaddr = attr->val.ipaddr;
 	}
 
@@ -796,6 +948,12 @@ static int load_config(void)
 		conf_acct_delay_time = atoi(opt);
 
 	conf_attr_tunnel_type = conf_get_opt("radius", "attr-tunnel-type");
+	rad_attr.tunnel_type = NULL;
+	if (conf_attr_tunnel_type) {
+		rad_attr.tunnel_type = rad_dict_find_attr(conf_attr_tunnel_type);
+		if (!rad_attr.tunnel_type)
+			log_error("radius: attr-tunnel-type: attribute '%s' not found in dictionary\n", conf_attr_tunnel_type);
+	}
 
 	conf_default_realm = conf_get_opt("radius", "default-realm");
 	if (conf_default_realm)
@@ -804,18 +962,62 @@ static int load_config(void)
 	return 0;
 }
 
+static void resolve_attrs(void)
+{
+	struct rad_dict_vendor_t *ms = rad_dict_find_vendor_name("Microsoft");
+
+	rad_attr.user_name = rad_dict_find_attr("User-Name");
+	rad_attr.user_password = rad_dict_find_attr("User-Password");
+	rad_attr.chap_challenge = rad_dict_find_attr("CHAP-Challenge");
+	rad_attr.chap_password = rad_dict_find_attr("CHAP-Password");
+	if (ms) {
+		rad_attr.ms_chap_challenge = rad_dict_find_vendor_attr(ms, "MS-CHAP-Challenge");
+		rad_attr.ms_chap_response = rad_dict_find_vendor_attr(ms, "MS-CHAP-Response");
+		rad_attr.ms_chap2_response = rad_dict_find_vendor_attr(ms, "MS-CHAP2-Response");
+	}
+	rad_attr.nas_identifier = rad_dict_find_attr("NAS-Identifier");
+	rad_attr.nas_ip_address = rad_dict_find_attr("NAS-IP-Address");
+	rad_attr.nas_port = rad_dict_find_attr("NAS-Port");
+	rad_attr.nas_port_id = rad_dict_find_attr("NAS-Port-Id");
+	rad_attr.nas_port_type = rad_dict_find_attr("NAS-Port-Type");
+	rad_attr.service_type = rad_dict_find_attr("Service-Type");
+	rad_attr.framed_protocol = rad_dict_find_attr("Framed-Protocol");
+	rad_attr.calling_station_id = rad_dict_find_attr("Calling-Station-Id");
+	rad_attr.called_station_id = rad_dict_find_attr("Called-Station-Id");
+	rad_attr.class = rad_dict_find_attr("Class");
+	rad_attr.state = rad_dict_find_attr("State");
+	rad_attr.acct_status_type = rad_dict_find_attr("Acct-Status-Type");
+	rad_attr.acct_authentic = rad_dict_find_attr("Acct-Authentic");
+	rad_attr.acct_session_id = rad_dict_find_attr("Acct-Session-Id");
+	rad_attr.acct_session_time = rad_dict_find_attr("Acct-Session-Time");
+	rad_attr.acct_input_octets = rad_dict_find_attr("Acct-Input-Octets");
+	rad_attr.acct_output_octets = rad_dict_find_attr("Acct-Output-Octets");
+	rad_attr.acct_input_packets = rad_dict_find_attr("Acct-Input-Packets");
+	rad_attr.acct_output_packets = rad_dict_find_attr("Acct-Output-Packets");
+	rad_attr.acct_input_gigawords = rad_dict_find_attr("Acct-Input-Gigawords");
+	rad_attr.acct_output_gigawords = rad_dict_find_attr("Acct-Output-Gigawords");
+	rad_attr.acct_delay_time = rad_dict_find_attr("Acct-Delay-Time");
+	rad_attr.acct_terminate_cause = rad_dict_find_attr("Acct-Terminate-Cause");
+	rad_attr.framed_ip_address = rad_dict_find_attr("Framed-IP-Address");
+	rad_attr.framed_interface_id = rad_dict_find_attr("Framed-Interface-Id");
+	rad_attr.framed_ipv6_prefix = rad_dict_find_attr("Framed-IPv6-Prefix");
+	rad_attr.delegated_ipv6_prefix = rad_dict_find_attr("Delegated-IPv6-Prefix");
+}
+
 static void radius_init(void)
 {
 	const char *dict = NULL;
 	struct conf_sect_t *s = conf_get_section("radius");
 	struct conf_option_t *opt1;
+	int i, j;
 
 	rpd_pool = mempool_create(sizeof(struct radius_pd_t));
-	auth_ctx_pool = mempool_create(sizeof(struct radius_auth_ctx));
-
-	if (load_config())
-		_exit(EXIT_FAILURE);
 
+	for (i = 0; i < RAD_SES_HASH_CNT; i++) {
+		for (j = 0; j < SES_HASH_SIZE; j++)
+			INIT_LIST_HEAD(&ses_hash[i][j]);
+	}
+	auth_ctx_pool = mempool_create(sizeof(struct radius_auth_ctx));
 
 	list_for_each_entry(opt1, &s->items, entry) {
 		if (strcmp(opt1->name, "dictionary") || !opt1->val)
@@ -828,6 +1030,11 @@ static void radius_init(void)
 	if (!dict && rad_dict_load(DICTIONARY))
 		_exit(0);
 
+	resolve_attrs();
+
+	if (load_config())
+		_exit(EXIT_FAILURE);
+
 	pwdb_register(&pwdb);
 	ipdb_register(&ipdb);
 
@@ -54,14 +54,20 @@ struct rad_dict_t
 struct rad_dict_vendor_t
 {
 	struct list_head entry;
+	struct list_head hentry;
+	struct list_head hentry_id;
 	int id;
 	const char *name;
 	struct list_head items;
+	struct rad_dict_attr_t **attr_id;
 };
 
 struct rad_dict_value_t
 {
 	struct list_head entry;
+	struct list_head hentry;
+	struct list_head hentry_val;
+	struct rad_dict_attr_t *attr;
 	rad_value_t val;
 	const char *name;
 };
@@ -69,6 +75,8 @@ struct rad_dict_value_t
 struct rad_dict_attr_t
 {
 	struct list_head entry;
+	struct list_head hentry;
+	struct rad_dict_vendor_t *vendor;
 	const char *name;
 	int id;
 	int type;
@@ -128,5 +136,17 @@ int rad_packet_add_ipaddr(struct rad_packet_t *pack, const char *vendor, const c
 int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor, const char *name, uint64_t ifid);
 int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor, const char *name, struct in6_addr *prefix, int len);
 
+/* same as above but take attribute resolved by rad_dict_find_attr/rad_dict_find_vendor_attr */
+struct rad_attr_t *rad_packet_lookup_attr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr);
+int rad_packet_add_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val);
+int rad_packet_add_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val);
+int rad_packet_add_attr_str(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val);
+int rad_packet_add_attr_octets(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const uint8_t *val, int len);
+int rad_packet_add_attr_ipaddr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, in_addr_t ipaddr);
+int rad_packet_add_attr_ifid(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, uint64_t ifid);
+int rad_packet_add_attr_ipv6prefix(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct in6_addr *prefix, int len);
+int rad_packet_change_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val);
+int rad_packet_change_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val);
+
 #endif
 
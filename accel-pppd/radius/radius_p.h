@@ -12,6 +12,7 @@
 #include "pwdb.h"
 
 struct rad_server_t;
+struct rad_sock_reply_t;
 
 struct radius_auth_ctx {
 	struct rad_req_t *req;
@@ -32,8 +33,11 @@ struct framed_route {
 	struct framed_route *next;
 };
 
+#define RAD_SES_HASH_CNT 6
+
 struct radius_pd_t {
 	struct list_head entry;
+	struct list_head hash_entry[RAD_SES_HASH_CNT];
 	struct ap_private pd;
 	struct ap_session *ses;
 	pthread_mutex_t lock;
@@ -42,6 +46,7 @@ struct radius_pd_t {
 	int acct_started:1;
 	int ipv6_dp_assigned:1;
 	int ipv6_dp_sent:1;
+	int indexed:1;
 
 	struct rad_req_t *acct_req;
 	struct triton_timer_t acct_interim_timer;
@@ -87,6 +92,11 @@ struct rad_req_t {
 	int try:6;
 	int active:1;
 	int async:1;
+	int pooled:1;
+
+	struct rad_sock_t *sock;
+	struct rad_sock_reply_t *sock_reply;
+	int sock_id;
 
 	time_t ts;
 
@@ -98,6 +108,17 @@ struct rad_req_t {
 	void (*log)(const char *fmt, ...);
 };
 
+#define RAD_SERV_MAX_SOCK 32
+
+struct rad_sock_t {
+	struct triton_md_handler_t hnd;
+	struct rad_server_t *serv;
+	int cnt;
+	int next_id;
+	struct rad_req_t *req[256];
+	uint8_t RA[256][16]; /* authenticators of requests sent from each slot */
+};
+
 struct rad_server_t {
 	struct list_head entry;
 	struct triton_context_t ctx;
@@ -112,6 +133,10 @@ struct rad_server_t {
 	int queue_cnt;
 	int fail_timeout;
 	int max_fail;
+	int sock_cnt;
+	int sock_next;
+
+	struct rad_sock_t *sock[2][RAD_SERV_MAX_SOCK];
 
 	struct list_head req_queue;
 	int client_cnt[2];
@@ -173,6 +198,47 @@ extern int conf_acct_interim_interval;
 extern int conf_accounting;
 extern const char *conf_attr_tunnel_type;
 
+/* dictionary attributes resolved once at startup */
+struct rad_attrs_t {
+	struct rad_dict_attr_t *user_name;
+	struct rad_dict_attr_t *user_password;
+	struct rad_dict_attr_t *chap_challenge;
+	struct rad_dict_attr_t *chap_password;
+	struct rad_dict_attr_t *ms_chap_challenge;
+	struct rad_dict_attr_t *ms_chap_response;
+	struct rad_dict_attr_t *ms_chap2_response;
+	struct rad_dict_attr_t *nas_identifier;
+	struct rad_dict_attr_t *nas_ip_address;
+	struct rad_dict_attr_t *nas_port;
+	struct rad_dict_attr_t *nas_port_id;
+	struct rad_dict_attr_t *nas_port_type;
+	struct rad_dict_attr_t *service_type;
+	struct rad_dict_attr_t *framed_protocol;
+	struct rad_dict_attr_t *calling_station_id;
+	struct rad_dict_attr_t *called_station_id;
+	struct rad_dict_attr_t *class;
+	struct rad_dict_attr_t *state;
+	struct rad_dict_attr_t *tunnel_type;
+	struct rad_dict_attr_t *acct_status_type;
+	struct rad_dict_attr_t *acct_authentic;
+	struct rad_dict_attr_t *acct_session_id;
+	struct rad_dict_attr_t *acct_session_time;
+	struct rad_dict_attr_t *acct_input_octets;
+	struct rad_dict_attr_t *acct_output_octets;
+	struct rad_dict_attr_t *acct_input_packets;
+	struct rad_dict_attr_t *acct_output_packets;
+	struct rad_dict_attr_t *acct_input_gigawords;
+	struct rad_dict_attr_t *acct_output_gigawords;
+	struct rad_dict_attr_t *acct_delay_time;
+	struct rad_dict_attr_t *acct_terminate_cause;
+	struct rad_dict_attr_t *framed_ip_address;
+	struct rad_dict_attr_t *framed_interface_id;
+	struct rad_dict_attr_t *framed_ipv6_prefix;
+	struct rad_dict_attr_t *delegated_ipv6_prefix;
+};
+
+extern struct rad_attrs_t rad_attr;
+
 int rad_check_nas_pack(struct rad_packet_t *pack);
 struct radius_pd_t *rad_find_session(const char *sessionid, const char *username, const char *port_id, int port, in_addr_t ipaddr, const char *csid);
 struct radius_pd_t *rad_find_session_pack(struct rad_packet_t *pack);
@@ -187,7 +253,9 @@ int rad_req_acct_fill(struct rad_req_t *);
 void rad_req_free(struct rad_req_t *);
 int rad_req_send(struct rad_req_t *req);
 int __rad_req_send(struct rad_req_t *req, int async);
+int rad_req_set_RA(struct rad_req_t *req, const char *secret);
 int rad_req_read(struct triton_md_handler_t *h);
+void rad_req_recv(struct rad_req_t *req, struct rad_packet_t *pack);
 
 struct radius_pd_t *find_pd(struct ap_session *ses);
 int rad_proc_attrs(struct rad_req_t *req);
@@ -224,6 +292,9 @@ int rad_server_realloc(struct rad_req_t *);
 void rad_server_fail(struct rad_server_t *);
 void rad_server_timeout(struct rad_server_t *);
 void rad_server_reply(struct rad_server_t *);
+int rad_server_sock_get(struct rad_req_t *);
+void rad_server_sock_put(struct rad_req_t *);
+int rad_server_sock_sent(struct rad_req_t *);
 
 void rad_update_session_timeout(struct radius_pd_t *rpd, int timeout);
 
@@ -9,6 +9,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "crypto.h"
+
 #include "log.h"
 #include "radius_p.h"
 #include "mempool.h"
@@ -71,51 +73,51 @@ static struct rad_req_t *__rad_req_alloc(struct radius_pd_t *rpd, int code, cons
 	if (!req->pack)
 		goto out_err;
 
-	if (rad_packet_add_str(req->pack, NULL, "User-Name", username))
+	if (rad_packet_add_attr_str(req->pack, rad_attr.user_name, username))
 		goto out_err;
 
 	if (conf_nas_identifier)
-		if (rad_packet_add_str(req->pack, NULL, "NAS-Identifier", conf_nas_identifier))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.nas_identifier, conf_nas_identifier))
 			goto out_err;
 
 	if (conf_nas_ip_address)
-		if (rad_packet_add_ipaddr(req->pack, NULL, "NAS-IP-Address", conf_nas_ip_address))
+		if (rad_packet_add_attr_ipaddr(req->pack, rad_attr.nas_ip_address, conf_nas_ip_address))
 			goto out_err;
 
-	if (rpd->ses->unit_idx != -1 && rad_packet_add_int(req->pack, NULL, "NAS-Port", rpd->ses->unit_idx))
+	if (rpd->ses->unit_idx != -1 && rad_packet_add_attr_int(req->pack, rad_attr.nas_port, rpd->ses->unit_idx))
 		goto out_err;
 
-	if (*rpd->ses->ifname && rad_packet_add_str(req->pack, NULL, "NAS-Port-Id", rpd->ses->ifname))
+	if (*rpd->ses->ifname && rad_packet_add_attr_str(req->pack, rad_attr.nas_port_id, rpd->ses->ifname))
 		goto out_err;
 
 	if (req->rpd->ses->ctrl->type == CTRL_TYPE_IPOE) {
-		if (rad_packet_add_val(req->pack, NULL, "NAS-Port-Type", "Ethernet"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.nas_port_type, "Ethernet"))
 			goto out_err;
 	} else {
-		if (rad_packet_add_val(req->pack, NULL, "NAS-Port-Type", "Virtual"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.nas_port_type, "Virtual"))
 			goto out_err;
 
-		if (rad_packet_add_val(req->pack, NULL, "Service-Type", "Framed-User"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.service_type, "Framed-User"))
 			goto out_err;
 
-		if (rad_packet_add_val(req->pack, NULL, "Framed-Protocol", "PPP"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.framed_protocol, "PPP"))
 			goto out_err;
 	}
 
 	if (rpd->ses->ctrl->calling_station_id)
-		if (rad_packet_add_str(req->pack, NULL, "Calling-Station-Id", rpd->ses->ctrl->calling_station_id))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.calling_station_id, rpd->ses->ctrl->calling_station_id))
 			goto out_err;
 
 	if (rpd->ses->ctrl->called_station_id)
-		if (rad_packet_add_str(req->pack, NULL, "Called-Station-Id", rpd->ses->ctrl->called_station_id))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.called_station_id, rpd->ses->ctrl->called_station_id))
 			goto out_err;
 
 	if (rpd->attr_class)
-		if (rad_packet_add_octets(req->pack, NULL, "Class", rpd->attr_class, rpd->attr_class_len))
+		if (rad_packet_add_attr_octets(req->pack, rad_attr.class, rpd->attr_class, rpd->attr_class_len))
 			goto out_err;
 
 	if (conf_attr_tunnel_type)
-		if (rad_packet_add_str(req->pack, NULL, conf_attr_tunnel_type, rpd->ses->ctrl->name))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.tunnel_type, rpd->ses->ctrl->name))
 			goto out_err;
 
 	list_for_each_entry(plugin, &req->rpd->plugin_list, entry) {
@@ -144,7 +146,12 @@ out_err:
 
 struct rad_req_t *rad_req_alloc(struct radius_pd_t *rpd, int code, const char *username)
 {
-	return __rad_req_alloc(rpd, code, username, 0, 0);
+	struct rad_req_t *req = __rad_req_alloc(rpd, code, username, 0, 0);
+
+	if (req)
+		req->pooled = 1;
+
+	return req;
 }
 
 struct rad_req_t *rad_req_alloc2(struct radius_pd_t *rpd, int code, const char *username, in_addr_t addr, int port)
@@ -188,39 +195,39 @@ int rad_req_acct_fill(struct rad_req_t *req)
 
 	memset(req->RA, 0, sizeof(req->RA));
 
-	if (rad_packet_add_val(req->pack, NULL, "Acct-Status-Type", "Start"))
+	if (rad_packet_add_attr_val(req->pack, rad_attr.acct_status_type, "Start"))
 		return -1;
-	if (rad_packet_add_val(req->pack, NULL, "Acct-Authentic", "RADIUS"))
+	if (rad_packet_add_attr_val(req->pack, rad_attr.acct_authentic, "RADIUS"))
 		return -1;
-	if (rad_packet_add_str(req->pack, NULL, "Acct-Session-Id", req->rpd->ses->sessionid))
+	if (rad_packet_add_attr_str(req->pack, rad_attr.acct_session_id, req->rpd->ses->sessionid))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Session-Time", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_session_time, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Input-Octets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_input_octets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Output-Octets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_output_octets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Input-Packets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_input_packets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Output-Packets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_output_packets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Input-Gigawords", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_input_gigawords, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Output-Gigawords", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_output_gigawords, 0))
 		return -1;
 	if (conf_acct_delay_time) {
-		if (rad_packet_add_int(req->pack, NULL, "Acct-Delay-Time", 0))
+		if (rad_packet_add_attr_int(req->pack, rad_attr.acct_delay_time, 0))
 			return -1;
 	}
 	if (req->rpd->ses->ipv4) {
-		if (rad_packet_add_ipaddr(req->pack, NULL, "Framed-IP-Address", req->rpd->ses->ipv4->peer_addr))
+		if (rad_packet_add_attr_ipaddr(req->pack, rad_attr.framed_ip_address, req->rpd->ses->ipv4->peer_addr))
 			return -1;
 	}
 	if (req->rpd->ses->ipv6) {
-		if (rad_packet_add_ifid(req->pack, NULL, "Framed-Interface-Id", req->rpd->ses->ipv6->peer_intf_id))
+		if (rad_packet_add_attr_ifid(req->pack, rad_attr.framed_interface_id, req->rpd->ses->ipv6->peer_intf_id))
 			return -1;
 		list_for_each_entry(a, &req->rpd->ses->ipv6->addr_list, entry) {
-			if (rad_packet_add_ipv6prefix(req->pack, NULL, "Framed-IPv6-Prefix", &a->addr, a->prefix_len))
+			if (rad_packet_add_attr_ipv6prefix(req->pack, rad_attr.framed_ipv6_prefix, &a->addr, a->prefix_len))
 				return -1;
 		}
 	}
@@ -233,6 +240,8 @@ void rad_req_free(struct rad_req_t *req)
 	assert(!req->active);
 	assert(!req->entry.next);
 
+	rad_server_sock_put(req);
+
 	if (req->serv)
 		rad_server_put(req->serv, req->type);
 
@@ -301,8 +310,29 @@ out_err:
 	return -1;
 }
 
+int rad_req_set_RA(struct rad_req_t *req, const char *secret)
+{
+	MD5_CTX ctx;
+
+	if (rad_packet_build(req->pack, req->RA))
+		return -1;
+
+	if (req->pack->code == CODE_ACCESS_REQUEST)
+		return 0;
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, req->pack->buf, req->pack->len);
+	MD5_Update(&ctx, secret, strlen(secret));
+	MD5_Final(req->pack->buf + 4, &ctx);
+
+	return 0;
+}
+
 int __rad_req_send(struct rad_req_t *req, int async)
 {
+	int id = req->pack->id;
+	int fd;
+
 	if (async == -1) {
 		if (req->active)
 			req->try = conf_max_try;
@@ -311,14 +341,20 @@ int __rad_req_send(struct rad_req_t *req, int async)
 		return 0;
 	}
 
-	if (req->hnd.fd == -1 && make_socket(req))
+	if (req->hnd.fd == -1 && (!req->pooled || rad_server_sock_get(req)) && make_socket(req))
 		return -1;
 
 	if (req->before_send && req->before_send(req))
 		goto out_err;
 
-	if (!req->pack->buf && rad_packet_build(req->pack, req->RA))
-		goto out_err;
+	if (!req->pack->buf) {
+		if (rad_packet_build(req->pack, req->RA))
+			goto out_err;
+	} else if (req->pack->id != id && !req->before_send) {
+		/* shared socket assigned another identifier, authenticator has to be recalculated */
+		if (rad_req_set_RA(req, req->serv->secret))
+			goto out_err;
+	}
 
 	if (req->log) {
 		req->log("send ");
@@ -328,17 +364,26 @@ int __rad_req_send(struct rad_req_t *req, int async)
 	if (req->sent)
 		req->sent(req, 0);
 
-	rad_packet_send(req->pack, req->hnd.fd, NULL);
+	if (req->hnd.fd == -1) {
+		/* shared socket, no slot means the reply has already been received */
+		fd = rad_server_sock_sent(req);
+		if (fd == -1)
+			return 0;
+	} else
+		fd = req->hnd.fd;
+
+	rad_packet_send(req->pack, fd, NULL);
 
 	return 0;
 
 out_err:
 	if (req->hnd.tpd)
 		triton_md_unregister_handler(&req->hnd, 1);
-	else {
+	else if (req->hnd.fd != -1) {
 		close(req->hnd.fd);
 		req->hnd.fd = -1;
-	}
+	} else
+		rad_server_sock_put(req);
 
 	if (async && req->sent)
 		req->sent(req, -1);
@@ -406,6 +451,13 @@ int rad_req_read(struct triton_md_handler_t *h)
 		rad_packet_free(pack);
 	}
 
+	rad_req_recv(req, pack);
+
+	return 1;
+}
+
+void rad_req_recv(struct rad_req_t *req, struct rad_packet_t *pack)
+{
 	req->reply = pack;
 
 	if (req->active)
@@ -420,8 +472,6 @@ int rad_req_read(struct triton_md_handler_t *h)
 
 	if (req->recv)
 		req->recv(req);
-
-	return 1;
 }
 
 static void req_init(void)
@@ -13,6 +13,7 @@
 
 #include "log.h"
 #include "triton.h"
+#include "mempool.h"
 #include "events.h"
 #include "cli.h"
 #include "utils.h"
@@ -27,10 +28,19 @@ static int conf_acct_on;
 static int conf_fail_timeout;
 static int conf_max_fail;
 static int conf_req_limit;
+static int conf_socket_pool;
 
 static int num;
 static LIST_HEAD(serv_list);
 
+struct rad_sock_reply_t {
+	struct rad_req_t *req;
+	struct rad_packet_t *pack;
+};
+
+static pthread_mutex_t sock_lock = PTHREAD_MUTEX_INITIALIZER;
+static mempool_t sock_reply_pool;
+
 static void __free_server(struct rad_server_t *);
 static void serv_ctx_close(struct triton_context_t *);
 
@@ -170,6 +180,8 @@ int rad_server_req_cancel(struct rad_req_t *req, int full)
 	if (req->hnd.tpd)
 		triton_md_unregister_handler(&req->hnd, 0);
 
+	rad_server_sock_put(req);
+
 	return r;
 }
 
@@ -266,6 +278,8 @@ int rad_server_realloc(struct rad_req_t *req)
 	if (!s)
 		return -1;
 
+	rad_server_sock_put(req);
+
 	if (req->serv)
 		rad_server_put(req->serv, req->type);
 
@@ -330,19 +344,300 @@ void rad_server_reply(struct rad_server_t *s)
 	s->timeout_cnt = 0;
 }
 
-static int req_set_RA(struct rad_req_t *req, const char *secret)
+/* must be called with sock_lock held */
+static int sock_check_RA(struct rad_sock_t *sk, struct rad_packet_t *reply)
 {
 	MD5_CTX ctx;
+	uint8_t RA[16];
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, reply->buf, 4);
+	MD5_Update(&ctx, sk->RA[reply->id], 16);
+	MD5_Update(&ctx, reply->buf + 20, reply->len - 20);
+	MD5_Update(&ctx, sk->serv->secret, strlen(sk->serv->secret));
+	MD5_Final(RA, &ctx);
+
+	return memcmp(RA, reply->buf + 4, 16);
+}
+
+static void sock_deliver(struct rad_sock_reply_t *r)
+{
+	struct rad_req_t *req;
+
+	pthread_mutex_lock(&sock_lock);
+	req = r->req;
+	if (req)
+		req->sock_reply = NULL;
+	pthread_mutex_unlock(&sock_lock);
+
+	if (!req) {
+		rad_packet_free(r->pack);
+		mempool_free(r);
+		return;
+	}
+
+	if (!req->rpd)
+		log_switch(triton_context_self(), NULL);
+
+	rad_req_recv(req, r->pack);
+
+	mempool_free(r);
+}
+
+static int sock_read(struct triton_md_handler_t *h)
+{
+	struct rad_sock_t *sk = container_of(h, typeof(*sk), hnd);
+	struct rad_sock_reply_t *r;
+	struct rad_packet_t *pack;
+	struct rad_req_t *req;
+
+	log_switch(triton_context_self(), NULL);
+
+	while (1) {
+		if (rad_packet_recv(h->fd, &pack, NULL))
+			return 0;
+
+		if (!pack)
+			continue;
+
+		pthread_mutex_lock(&sock_lock);
+		req = sk->req[pack->id];
+		if (!req || req->sock_reply) {
+			pthread_mutex_unlock(&sock_lock);
+			rad_packet_free(pack);
+			continue;
+		}
+
+		/* stale or forged replies must not release the slot */
+		if (sock_check_RA(sk, pack)) {
+			pthread_mutex_unlock(&sock_lock);
+			log_warn("radius(%i): reply with invalid authenticator (id=%x)\n", sk->serv->id, pack->id);
+			rad_packet_free(pack);
+			continue;
+		}
+
+		r = mempool_alloc(sock_reply_pool);
+		if (!r) {
+			pthread_mutex_unlock(&sock_lock);
+			log_emerg("radius: out of memory\n");
+			rad_packet_free(pack);
+			continue;
+		}
+
+		sk->req[pack->id] = NULL;
+		sk->cnt--;
+		req->sock = NULL;
+
+		r->req = req;
+		r->pack = pack;
+		req->sock_reply = r;
+
+		triton_context_call(req->rpd ? req->rpd->ses->ctrl->ctx : NULL, (triton_event_func)sock_deliver, r);
+		pthread_mutex_unlock(&sock_lock);
+
+		rad_server_reply(sk->serv);
+	}
+}
+
+static struct rad_sock_t *sock_create(struct rad_server_t *s, int type)
+{
+	struct rad_sock_t *sk;
+	struct sockaddr_in addr;
+	int sock;
+
+	sock = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		log_error("radius:socket: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+
+	if (conf_bind) {
+		addr.sin_addr.s_addr = conf_bind;
+		if (bind(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+			log_error("radius:bind: %s\n", strerror(errno));
+			goto out_err;
+		}
+	}
+
+	addr.sin_addr.s_addr = s->addr;
+	addr.sin_port = htons(type == RAD_SERV_AUTH ? s->auth_port : s->acct_port);
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+		log_error("radius:connect: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
+		log_error("radius: failed to set nonblocking mode: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	sk = _malloc(sizeof(*sk));
+	if (!sk) {
+		log_emerg("radius: out of memory\n");
+		goto out_err;
+	}
+
+	memset(sk, 0, sizeof(*sk));
+	sk->serv = s;
+	sk->hnd.fd = sock;
+	sk->hnd.read = sock_read;
+
+	triton_md_register_handler(&s->ctx, &sk->hnd);
+	/* rad_packet_recv stops on malformed packet as well */
+	triton_md_set_trig(&sk->hnd, MD_TRIG_LEVEL);
+	triton_md_enable_handler(&sk->hnd, MD_MODE_READ);
+
+	return sk;
+
+out_err:
+	close(sock);
+	return NULL;
+}
+
+static void sock_free(struct rad_sock_t *sk)
+{
+	triton_md_unregister_handler(&sk->hnd, 1);
+	_free(sk);
+}
+
+static void sock_free_all(struct rad_server_t *s)
+{
+	struct rad_sock_t *sk;
+	int i, type;
+
+	for (type = 0; type < 2; type++) {
+		for (i = 0; i < RAD_SERV_MAX_SOCK; i++) {
+			sk = s->sock[type][i];
+			if (!sk)
+				continue;
+			sock_free(sk);
+			s->sock[type][i] = NULL;
+		}
+	}
+}
+
+static void __sock_put(struct rad_req_t *req)
+{
+	if (req->sock) {
+		req->sock->req[req->sock_id] = NULL;
+		req->sock->cnt--;
+		req->sock = NULL;
+	}
+
+	if (req->sock_reply) {
+		/* the reply is freed here unless sock_deliver has already been dequeued */
+		if (triton_cancel_call_arg(req->rpd ? req->rpd->ses->ctrl->ctx : NULL, (triton_event_func)sock_deliver, req->sock_reply)) {
+			rad_packet_free(req->sock_reply->pack);
+			mempool_free(req->sock_reply);
+		} else
+			req->sock_reply->req = NULL;
+		req->sock_reply = NULL;
+	}
+}
 
-	if (rad_packet_build(req->pack, req->RA))
+/*
+ * Binds request to a slot (socket, identifier) of server's shared sockets,
+ * changing request's identifier if needed.
+ * Returns non-zero if request should use private socket.
+ */
+int rad_server_sock_get(struct rad_req_t *req)
+{
+	struct rad_server_t *s = req->serv;
+	struct rad_sock_t *sk, *new_sk;
+	int i, k, id, n = s->sock_cnt;
+	int port = req->type == RAD_SERV_AUTH ? s->auth_port : s->acct_port;
+
+	if (!n || req->server_addr != s->addr || req->server_port != port)
 		return -1;
 
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, req->pack->buf, req->pack->len);
-	MD5_Update(&ctx, secret, strlen(secret));
-	MD5_Final(req->pack->buf + 4, &ctx);
+	pthread_mutex_lock(&sock_lock);
 
-	return 0;
+	if (req->sock) {
+		if (req->sock->serv == s && req->sock_id == req->pack->id) {
+			pthread_mutex_unlock(&sock_lock);
+			return 0;
+		}
+		__sock_put(req);
+	}
+
+	for (i = 0; i < n; i++) {
+		k = s->sock_next % n;
+		s->sock_next = (k + 1) % n;
+		sk = s->sock[req->type][k];
+		if (!sk) {
+			/* the server is held by the request, so it can't go away meanwhile */
+			pthread_mutex_unlock(&sock_lock);
+			new_sk = sock_create(s, req->type);
+			pthread_mutex_lock(&sock_lock);
+			if (!new_sk)
+				break;
+
+			sk = s->sock[req->type][k];
+			if (sk)
+				sock_free(new_sk);
+			else {
+				sk = new_sk;
+				s->sock[req->type][k] = sk;
+			}
+		}
+
+		if (sk->cnt == 256)
+			continue;
+
+		for (id = sk->next_id; sk->req[id]; id = (id + 1) & 0xff);
+
+		sk->next_id = (id + 1) & 0xff;
+		sk->req[id] = req;
+		sk->cnt++;
+		/* nothing matches until the request is actually sent */
+		memset(sk->RA[id], 0, 16);
+
+		req->sock = sk;
+		req->sock_id = id;
+		req->pack->id = id;
+
+		pthread_mutex_unlock(&sock_lock);
+
+		return 0;
+	}
+
+	pthread_mutex_unlock(&sock_lock);
+
+	return -1;
+}
+
+/*
+ * Remembers the authenticator the reply to this slot has to be checked against.
+ * Returns descriptor of the shared socket to send request through, -1 if slot is released.
+ */
+int rad_server_sock_sent(struct rad_req_t *req)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&sock_lock);
+	if (req->sock) {
+		memcpy(req->sock->RA[req->sock_id], req->pack->buf + 4, 16);
+		fd = req->sock->hnd.fd;
+	}
+	pthread_mutex_unlock(&sock_lock);
+
+	return fd;
+}
+
+void rad_server_sock_put(struct rad_req_t *req)
+{
+	if (!req->pooled)
+		return;
+
+	pthread_mutex_lock(&sock_lock);
+	__sock_put(req);
+	pthread_mutex_unlock(&sock_lock);
 }
 
 static void acct_on_sent(struct rad_req_t *req, int res)
@@ -422,7 +717,7 @@ static void send_acct_on(struct rad_server_t *s)
 		if (rad_packet_add_ipaddr(req->pack, NULL, "NAS-IP-Address", conf_nas_ip_address))
 			goto out_err;
 
-	if (req_set_RA(req, s->secret))
+	if (rad_req_set_RA(req, s->secret))
 		goto out_err;
 
 	__rad_req_send(req, 0);
@@ -450,8 +745,10 @@ static void serv_ctx_close(struct triton_context_t *ctx)
 			s->starting = 0;
 			s->need_close = 0;
 			send_acct_on(s);
-		} else
+		} else {
+			sock_free_all(s);
 			triton_context_unregister(ctx);
+		}
 	}
 }
 
@@ -517,6 +814,7 @@ static void __add_server(struct rad_server_t *s)
 			s1->fail_timeout = s->fail_timeout;
 			s1->req_limit = s->req_limit;
 			s1->max_fail = s->max_fail;
+			s1->sock_cnt = s->sock_cnt;
 			s1->need_free = 0;
 			_free(s);
 			return;
@@ -553,8 +851,30 @@ static void __add_server(struct rad_server_t *s)
 	triton_context_wakeup(&s->ctx);
 }
 
+static int sock_exist(struct rad_server_t *s)
+{
+	int i, type;
+
+	for (type = 0; type < 2; type++) {
+		for (i = 0; i < RAD_SERV_MAX_SOCK; i++) {
+			if (s->sock[type][i])
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 static void __free_server(struct rad_server_t *s)
 {
+	/* shared sockets have to be closed by server's context */
+	if (sock_exist(s) && triton_context_self() != &s->ctx) {
+		triton_context_call(&s->ctx, (triton_event_func)__free_server, s);
+		return;
+	}
+
+	sock_free_all(s);
+
 	log_debug("radius: free(%i)\n", s->id);
 
 	stat_accm_free(s->stat_auth_lost_1m);
@@ -644,6 +964,7 @@ static void add_server_old(void)
 	s->fail_timeout = conf_fail_timeout;
 	s->req_limit = conf_req_limit;
 	s->max_fail = conf_max_fail;
+	s->sock_cnt = conf_socket_pool;
 
 	if (auth_addr == acct_addr && !strcmp(auth_secret, acct_secret)) {
 		s->acct_port = acct_port;
@@ -662,6 +983,7 @@ static void add_server_old(void)
 		s->fail_timeout = conf_fail_timeout;
 		s->req_limit = conf_req_limit;
 		s->max_fail = conf_max_fail;
+		s->sock_cnt = conf_socket_pool;
 		__add_server(s);
 	}
 }
@@ -712,6 +1034,7 @@ static int parse_server1(const char *_opt, struct rad_server_t *s)
 	s->fail_timeout = conf_fail_timeout;
 	s->req_limit = conf_req_limit;
 	s->max_fail = conf_max_fail;
+	s->sock_cnt = conf_socket_pool;
 
 	return 0;
 
@@ -783,6 +1106,18 @@ static int parse_server2(const char *_opt, struct rad_server_t *s)
 	} else
 		s->max_fail = conf_max_fail;
 
+	ptr3 = strstr(ptr2, ",socket-pool=");
+	if (ptr3) {
+		s->sock_cnt = strtol(ptr3 + 13, &endptr, 10);
+		if (*endptr != ',' && *endptr != 0)
+			goto out;
+		if (s->sock_cnt < 0)
+			s->sock_cnt = 0;
+		else if (s->sock_cnt > RAD_SERV_MAX_SOCK)
+			s->sock_cnt = RAD_SERV_MAX_SOCK;
+	} else
+		s->sock_cnt = conf_socket_pool;
+
 	ptr3 = strstr(ptr2, ",weight=");
 	if (ptr3) {
 		s->weight = atoi(ptr3 + 8);
@@ -866,6 +1201,16 @@ static void load_config(void)
 	else
 		conf_req_limit = 0;
 
+	opt1 = conf_get_opt("radius", "socket-pool");
+	if (opt1) {
+		conf_socket_pool = atoi(opt1);
+		if (conf_socket_pool < 0)
+			conf_socket_pool = 0;
+		else if (conf_socket_pool > RAD_SERV_MAX_SOCK)
+			conf_socket_pool = RAD_SERV_MAX_SOCK;
+	} else
+		conf_socket_pool = 0;
+
 	opt1 = conf_get_opt("radius", "max-fail");
 	if (opt1)
 		conf_max_fail = atoi(opt1);
@@ -918,6 +1263,8 @@ static void load_config(void)
 
 static void init(void)
 {
+	sock_reply_pool = mempool_create(sizeof(struct rad_sock_reply_t));
+
 	load_config();
 
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
@@ -29,6 +29,17 @@
 #define SID_SOURCE_SEQ 0
 #define SID_SOURCE_URANDOM 1
 
+#define SES_HASH_BITS 11
+#define SES_HASH_SIZE (1 << SES_HASH_BITS)
+
+enum {
+	SES_HASH_USERNAME,
+	SES_HASH_SID,
+	SES_HASH_IFNAME,
+	SES_HASH_IPV4,
+	SES_HASH_IPV6,
+};
+
 static int conf_sid_ucase;
 static int conf_single_session = -1;
 static int conf_sid_source;
@@ -38,6 +49,7 @@ int __export conf_max_sessions;
 
 pthread_rwlock_t __export ses_lock = PTHREAD_RWLOCK_INITIALIZER;
 __export LIST_HEAD(ses_list);
+static struct list_head ses_hash[AP_SES_HASH_CNT][SES_HASH_SIZE];
 
 int __export sock_fd;
 int __export sock6_fd;
@@ -57,10 +69,180 @@ static void (*shutdown_cb)(void);
 static void generate_sessionid(struct ap_session *ses);
 static void save_seq(void);
 
+static unsigned int hash_str(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= 16777619u;
+	}
+
+	return h & (SES_HASH_SIZE - 1);
+}
+
+static unsigned int hash_u32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - SES_HASH_BITS);
+}
+
+/* IPv6 sessions are hashed by /64 of the first address */
+static unsigned int hash_ipv6(const struct in6_addr *addr)
+{
+	const uint32_t *a = (const uint32_t *)addr->s6_addr;
+
+	return hash_u32(a[0] ^ (a[1] * 31));
+}
+
+static void ses_hash_add(struct ap_session *ses, int idx, unsigned int h)
+{
+	list_add_tail(&ses->hash_entry[idx], &ses_hash[idx][h]);
+}
+
+static void ses_unhash(struct ap_session *ses)
+{
+	int i;
+
+	for (i = 0; i < AP_SES_HASH_CNT; i++)
+		list_del_init(&ses->hash_entry[i]);
+}
+
+static struct ap_session *ses_hash_entry(struct list_head *pos, int idx)
+{
+	return container_of(pos - idx, struct ap_session, hash_entry[0]);
+}
+
+/* must be called with ses_lock held for writing */
+static void __ap_session_rehash(struct ap_session *ses)
+{
+	struct ipv6db_addr_t *a;
+
+	ses_unhash(ses);
+
+	if (ses->username)
+		ses_hash_add(ses, SES_HASH_USERNAME, hash_str(ses->username));
+
+	if (ses->sessionid[0])
+		ses_hash_add(ses, SES_HASH_SID, hash_str(ses->sessionid));
+
+	if (ses->ifname[0])
+		ses_hash_add(ses, SES_HASH_IFNAME, hash_str(ses->ifname));
+
+	if (ses->ipv4)
+		ses_hash_add(ses, SES_HASH_IPV4, hash_u32(ses->ipv4->peer_addr));
+
+	if (ses->ipv6 && !list_empty(&ses->ipv6->addr_list)) {
+		a = list_entry(ses->ipv6->addr_list.next, typeof(*a), entry);
+		ses_hash_add(ses, SES_HASH_IPV6, hash_ipv6(&a->addr));
+	}
+}
+
+void __export ap_session_rehash(struct ap_session *ses)
+{
+	pthread_rwlock_wrlock(&ses_lock);
+	if (ses->entry.next)
+		__ap_session_rehash(ses);
+	pthread_rwlock_unlock(&ses_lock);
+}
+
+struct ap_session __export *ap_session_find_username(const char *username, struct ap_session *prev)
+{
+	struct list_head *head = &ses_hash[SES_HASH_USERNAME][hash_str(username)];
+	struct list_head *pos = prev ? prev->hash_entry[SES_HASH_USERNAME].next : head->next;
+	struct ap_session *ses;
+
+	for (; pos != head; pos = pos->next) {
+		ses = ses_hash_entry(pos, SES_HASH_USERNAME);
+		if (ses->username && !strcmp(ses->username, username))
+			return ses;
+	}
+
+	return NULL;
+}
+
+struct ap_session __export *ap_session_find_sessionid(const char *sessionid)
+{
+	struct list_head *pos;
+	struct ap_session *ses;
+
+	list_for_each(pos, &ses_hash[SES_HASH_SID][hash_str(sessionid)]) {
+		ses = ses_hash_entry(pos, SES_HASH_SID);
+		if (!strcmp(ses->sessionid, sessionid))
+			return ses;
+	}
+
+	return NULL;
+}
+
+struct ap_session __export *ap_session_find_ifname(const char *ifname)
+{
+	struct list_head *pos;
+	struct ap_session *ses;
+
+	list_for_each(pos, &ses_hash[SES_HASH_IFNAME][hash_str(ifname)]) {
+		ses = ses_hash_entry(pos, SES_HASH_IFNAME);
+		if (!strcmp(ses->ifname, ifname))
+			return ses;
+	}
+
+	return NULL;
+}
+
+struct ap_session __export *ap_session_find_ipv4(in_addr_t addr)
+{
+	struct list_head *pos;
+	struct ap_session *ses;
+
+	list_for_each(pos, &ses_hash[SES_HASH_IPV4][hash_u32(addr)]) {
+		ses = ses_hash_entry(pos, SES_HASH_IPV4);
+		if (ses->ipv4 && ses->ipv4->peer_addr == addr)
+			return ses;
+	}
+
+	return NULL;
+}
+
+static int ipv6_match(const struct in6_addr *addr, const struct ipv6db_addr_t *a)
+{
+	int n = a->prefix_len / 8;
+	int r = a->prefix_len % 8;
+
+	if (memcmp(addr->s6_addr, a->addr.s6_addr, n))
+		return 0;
+
+	if (r && ((addr->s6_addr[n] ^ a->addr.s6_addr[n]) & (0xff << (8 - r))))
+		return 0;
+
+	return 1;
+}
+
+struct ap_session __export *ap_session_find_ipv6(const struct in6_addr *addr)
+{
+	struct list_head *pos;
+	struct ap_session *ses;
+	struct ipv6db_addr_t *a;
+
+	list_for_each(pos, &ses_hash[SES_HASH_IPV6][hash_ipv6(addr)]) {
+		ses = ses_hash_entry(pos, SES_HASH_IPV6);
+		if (!ses->ipv6)
+			continue;
+		list_for_each_entry(a, &ses->ipv6->addr_list, entry) {
+			if (ipv6_match(addr, a))
+				return ses;
+		}
+	}
+
+	return NULL;
+}
+
 void __export ap_session_init(struct ap_session *ses)
 {
+	int i;
+
 	memset(ses, 0, sizeof(*ses));
 	INIT_LIST_HEAD(&ses->pd_list);
+	for (i = 0; i < AP_SES_HASH_CNT; i++)
+		INIT_LIST_HEAD(&ses->hash_entry[i]);
 	ses->ifindex = -1;
 	ses->unit_idx = -1;
 }
@@ -81,6 +263,8 @@ void __export ap_session_set_ifindex(struct ap_session *ses)
 		ses->acct_input_gigawords = 0;
 		ses->acct_output_gigawords = 0;
 	}
+
+	ap_session_rehash(ses);
 }
 
 int __export ap_session_starting(struct ap_session *ses)
@@ -116,6 +300,7 @@ int __export ap_session_starting(struct ap_session *ses)
 
 	pthread_rwlock_wrlock(&ses_lock);
 	list_add_tail(&ses->entry, &ses_list);
+	__ap_session_rehash(ses);
 	pthread_rwlock_unlock(&ses_lock);
 
 	triton_event_fire(EV_SES_STARTING, ses);
@@ -189,6 +374,7 @@ void __export ap_session_finished(struct ap_session *ses)
 
 	pthread_rwlock_wrlock(&ses_lock);
 	list_del(&ses->entry);
+	ses_unhash(ses);
 	pthread_rwlock_unlock(&ses_lock);
 
 	switch (ses->state) {
@@ -409,8 +595,8 @@ int __export ap_session_set_username(struct ap_session *s, char *username)
 
 	pthread_rwlock_wrlock(&ses_lock);
 	if (conf_single_session >= 0) {
-		list_for_each_entry(ses, &ses_list, entry) {
-			if (ses->username && ses->terminate_cause != TERM_AUTH_ERROR && !strcmp(ses->username, username)) {
+		for (ses = ap_session_find_username(username, NULL); ses; ses = ap_session_find_username(username, ses)) {
+			if (ses->terminate_cause != TERM_AUTH_ERROR) {
 				if (conf_single_session == 0) {
 					pthread_rwlock_unlock(&ses_lock);
 					log_ppp_info1("%s: second session denied\n", username);
@@ -419,12 +605,15 @@ int __export ap_session_set_username(struct ap_session *s, char *username)
 				} else {
 					ap_session_ifdown(ses);
 					triton_context_call(ses->ctrl->ctx, (triton_event_func)__terminate_sec, ses);
-					continue;
 				}
 			}
 		}
 	}
 	s->username = username;
+	if (s->entry.next) {
+		list_del_init(&s->hash_entry[SES_HASH_USERNAME]);
+		ses_hash_add(s, SES_HASH_USERNAME, hash_str(username));
+	}
 	pthread_rwlock_unlock(&ses_lock);
 
 	if (wait)
@@ -435,19 +624,13 @@ int __export ap_session_set_username(struct ap_session *s, char *username)
 
 int __export ap_check_username(const char *username)
 {
-	struct ap_session *ses;
-	int r = 0;
+	int r;
 
 	if (conf_single_session)
 		return 0;
 
 	pthread_rwlock_rdlock(&ses_lock);
-	list_for_each_entry(ses, &ses_list, entry) {
-		if (ses->username && !strcmp(ses->username, username)) {
-			r = 1;
-			break;
-		}
-	}
+	r = ap_session_find_username(username, NULL) != NULL;
 	pthread_rwlock_unlock(&ses_lock);
 
 	return r;
@@ -523,6 +706,12 @@ static void load_config(void)
 static void init(void)
 {
 	FILE *f;
+	int i, j;
+
+	for (i = 0; i < AP_SES_HASH_CNT; i++) {
+		for (j = 0; j < SES_HASH_SIZE; j++)
+			INIT_LIST_HEAD(&ses_hash[i][j]);
+	}
 
 #if __WORDSIZE == 32
 	spinlock_init(&seq_lock);
@@ -13,55 +13,94 @@
 
 extern int max_events;
 
-static int epoll_fd;
-static struct epoll_event *epoll_events;
+struct md_shard_t
+{
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+	pthread_t thr;
+	pthread_mutex_t freed_list_lock;
+	struct list_head freed_list;
+	struct list_head freed_list2;
+};
+
+static struct md_shard_t *md_shards;
+static int md_shard_count = 1;
 
-static pthread_t md_thr;
 static void *md_thread(void *arg);
 
 static mempool_t *md_pool;
 
-static pthread_mutex_t freed_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(freed_list);
-static LIST_HEAD(freed_list2);
-
 int md_init(void)
 {
-	epoll_fd = epoll_create(1);
-	if (epoll_fd < 0) {
-		perror("md:epoll_create");
-		return -1;
-	}
+	struct md_shard_t *shard;
+	char *opt;
+	int i;
 
-	fcntl(epoll_fd, F_SETFD, O_CLOEXEC);
+	opt = conf_get_opt("core", "md-thread-count");
+	if (opt && atoi(opt) > 0)
+		md_shard_count = atoi(opt);
 
-	epoll_events = _malloc(max_events * sizeof(struct epoll_event));
-	if (!epoll_events) {
+	md_shards = _malloc(md_shard_count * sizeof(*md_shards));
+	if (!md_shards) {
 		fprintf(stderr,"md:cann't allocate memory\n");
 		return -1;
 	}
 
+	memset(md_shards, 0, md_shard_count * sizeof(*md_shards));
+
+	for (i = 0; i < md_shard_count; i++) {
+		shard = &md_shards[i];
+
+		shard->epoll_fd = epoll_create(1);
+		if (shard->epoll_fd < 0) {
+			perror("md:epoll_create");
+			return -1;
+		}
+
+		fcntl(shard->epoll_fd, F_SETFD, O_CLOEXEC);
+
+		shard->epoll_events = _malloc(max_events * sizeof(struct epoll_event));
+		if (!shard->epoll_events) {
+			fprintf(stderr,"md:cann't allocate memory\n");
+			return -1;
+		}
+
+		pthread_mutex_init(&shard->freed_list_lock, NULL);
+		INIT_LIST_HEAD(&shard->freed_list);
+		INIT_LIST_HEAD(&shard->freed_list2);
+	}
+
 	md_pool = mempool_create(sizeof(struct _triton_md_handler_t));
 
 	return 0;
 }
 void md_run(void)
 {
-	if (pthread_create(&md_thr, NULL, md_thread, NULL)) {
-		triton_log_error("md:pthread_create: %s", strerror(errno));
-		_exit(-1);
+	int i;
+
+	for (i = 0; i < md_shard_count; i++) {
+		if (pthread_create(&md_shards[i].thr, NULL, md_thread, &md_shards[i])) {
+			triton_log_error("md:pthread_create: %s", strerror(errno));
+			_exit(-1);
+		}
 	}
 }
 
 void md_terminate(void)
 {
-	pthread_cancel(md_thr);
-	pthread_join(md_thr, NULL);
+	int i;
+
+	for (i = 0; i < md_shard_count; i++) {
+		pthread_cancel(md_shards[i].thr);
+		pthread_join(md_shards[i].thr, NULL);
+	}
 }
 
 static void *md_thread(void *arg)
 {
-	int i,n,r;
+	struct md_shard_t *shard = arg;
+	int i,n;
+	struct _triton_thread_t *thread;
 	struct _triton_md_handler_t *h;
 	sigset_t set;
 
@@ -71,7 +110,7 @@ static void *md_thread(void *arg)
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
 	while(1) {
-		n = epoll_wait(epoll_fd, epoll_events, max_events, -1);
+		n = epoll_wait(shard->epoll_fd, shard->epoll_events, max_events, -1);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
@@ -80,41 +119,52 @@ static void *md_thread(void *arg)
 		}
 
 		for(i = 0; i < n; i++) {
-			h = (struct _triton_md_handler_t *)epoll_events[i].data.ptr;
+			h = (struct _triton_md_handler_t *)shard->epoll_events[i].data.ptr;
 			if (!h->ud)
 				continue;
 			spin_lock(&h->ctx->lock);
 			if (h->ud) {
-				h->trig_epoll_events |= epoll_events[i].events;
-				if (!h->pending) {
+				h->trig_epoll_events |= shard->epoll_events[i].events;
+				if (__sync_bool_compare_and_swap(&h->pending, PENDING_NONE, PENDING_QUEUED)) {
 					list_add_tail(&h->entry2, &h->ctx->pending_handlers);
-					h->pending = 1;
 					__sync_add_and_fetch(&triton_stat.md_handler_pending, 1);
-					r = triton_queue_ctx(h->ctx);
+					thread = triton_queue_ctx(h->ctx);
 				} else
-					r = 0;
+					thread = NULL;
 			} else
-				r = 0;
+				thread = NULL;
 			spin_unlock(&h->ctx->lock);
-			if (r)
-				triton_thread_wakeup(h->ctx->thread);
+			if (thread)
+				triton_thread_wakeup(thread);
 		}
 
-		while (!list_empty(&freed_list2)) {
-			h = list_entry(freed_list2.next, typeof(*h), entry);
+		while (!list_empty(&shard->freed_list2)) {
+			h = list_entry(shard->freed_list2.next, typeof(*h), entry);
 			list_del(&h->entry);
 			triton_context_release(h->ctx);
 			mempool_free(h);
 		}
 
-		pthread_mutex_lock(&freed_list_lock);
-		list_splice_init(&freed_list, &freed_list2);
-		pthread_mutex_unlock(&freed_list_lock);
+		pthread_mutex_lock(&shard->freed_list_lock);
+		list_splice_init(&shard->freed_list, &shard->freed_list2);
+		pthread_mutex_unlock(&shard->freed_list_lock);
 	}
 
 	return NULL;
 }
 
+/*
+ * Handler is bound to md thread by fd when it is added to epoll first time
+ * and stays there until unregistered.
+ */
+static struct md_shard_t *md_shard(struct _triton_md_handler_t *h)
+{
+	if (!h->shard)
+		h->shard = &md_shards[(unsigned int)h->ud->fd % md_shard_count];
+
+	return h->shard;
+}
+
 void __export triton_md_register_handler(struct triton_context_t *ctx, struct triton_md_handler_t *ud)
 {
 	struct _triton_md_handler_t *h = mempool_alloc(md_pool);
@@ -137,6 +187,7 @@ void __export triton_md_register_handler(struct triton_context_t *ctx, struct tr
 void __export triton_md_unregister_handler(struct triton_md_handler_t *ud, int c)
 {
 	struct _triton_md_handler_t *h = (struct _triton_md_handler_t *)ud->tpd;
+	int dead;
 
 	triton_md_disable_handler(ud, MD_MODE_READ | MD_MODE_WRITE);
 
@@ -148,15 +199,17 @@ void __export triton_md_unregister_handler(struct triton_md_handler_t *ud, int c
 	spin_lock(&h->ctx->lock);
 	h->ud = NULL;
 	list_del(&h->entry);
-	if (h->pending) {
+	if (h->pending == PENDING_QUEUED) {
 		list_del(&h->entry2);
+		h->pending = PENDING_NONE;
 		__sync_sub_and_fetch(&triton_stat.md_handler_pending, 1);
 	}
+	/* ctx_thread still holds it in its batch and frees it when reached */
+	dead = __sync_bool_compare_and_swap(&h->pending, PENDING_EXEC, PENDING_DEAD);
 	spin_unlock(&h->ctx->lock);
 
-	pthread_mutex_lock(&freed_list_lock);
-	list_add_tail(&h->entry, &freed_list);
-	pthread_mutex_unlock(&freed_list_lock);
+	if (!dead)
+		md_free(h);
 
 	ud->tpd = NULL;
 
@@ -184,13 +237,13 @@ int __export triton_md_enable_handler(struct triton_md_handler_t *ud, int mode)
 
 	if (events) {
 		if (h->armed)
-			r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+			r = epoll_ctl(h->shard->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 		else {
 			h->mod = 1;
 			r = 0;
 		}
 	} else
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->ud->fd, &h->epoll_event);
+		r = epoll_ctl(md_shard(h)->epoll_fd, EPOLL_CTL_ADD, h->ud->fd, &h->epoll_event);
 
 	if (r) {
 		triton_log_error("md:epoll_ctl: %s",strerror(errno));
@@ -222,14 +275,14 @@ int __export triton_md_disable_handler(struct triton_md_handler_t *ud,int mode)
 
 	if (h->epoll_event.events) {
 		if (h->armed)
-			r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+			r = epoll_ctl(h->shard->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 		else {
 			h->mod = 1;
 			r = 0;
 		}
 	} else {
 		h->mod = 0;
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->ud->fd, NULL);
+		r = epoll_ctl(h->shard->epoll_fd, EPOLL_CTL_DEL, h->ud->fd, NULL);
 	}
 
 	if (r) {
@@ -246,10 +299,19 @@ void __export triton_md_set_trig(struct triton_md_handler_t *ud, int mode)
 	h->trig_level = mode;
 }
 
+void md_free(struct _triton_md_handler_t *h)
+{
+	struct md_shard_t *shard = h->shard ? h->shard : &md_shards[0];
+
+	pthread_mutex_lock(&shard->freed_list_lock);
+	list_add_tail(&h->entry, &shard->freed_list);
+	pthread_mutex_unlock(&shard->freed_list_lock);
+}
+
 void md_rearm(struct _triton_md_handler_t *h)
 {
 	if (h->mod) {
-		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+		epoll_ctl(h->shard->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 		h->mod = 0;
 	}
 
@@ -17,15 +17,22 @@
 
 //#define MEMPOOL_DISABLE
 
+#if !defined(MEMDEBUG) && !defined(VALGRIND) && !defined(MEMPOOL_DISABLE)
+#define MEMPOOL_CACHE
+#endif
+
 #define MAGIC1 0x2233445566778899llu
 #define PAGE_ORDER 5
 
+#define MAG_SIZE 32
+
 static int conf_mempool_min = 128;
 
 struct _mempool_t
 {
 	struct list_head entry;
 	int size;
+	int id;
 	struct list_head items;
 #ifdef MEMDEBUG
 	struct list_head ditems;
@@ -52,11 +59,37 @@ struct _item_t
 	char ptr[0];
 };
 
+/*
+ * Per-thread magazine of free items of one pool.
+ * Items kept in magazines are not accounted in triton_stat.mempool_available,
+ * they are moved from/to shared pool list by batches.
+ */
+struct _mempool_mag_t
+{
+	struct _mempool_t *pool;
+	int cnt;
+	struct _item_t *items[MAG_SIZE];
+};
+
+struct _mempool_cache_t
+{
+	unsigned int gen;
+	int size;
+	struct _mempool_mag_t **mags;
+};
+
 static LIST_HEAD(pools);
 static spinlock_t pools_lock;
 static spinlock_t mmap_lock;
 static void *mmap_ptr;
 static void *mmap_endptr;
+static int pool_ids;
+
+#ifdef MEMPOOL_CACHE
+static __thread struct _mempool_cache_t *cache;
+static pthread_key_t cache_key;
+static unsigned int cache_gen;
+#endif
 
 static int mmap_grow(void);
 static void mempool_clean(void);
@@ -73,6 +106,7 @@ mempool_t __export *mempool_create(int size)
 #endif
 	spinlock_init(&p->lock);
 	p->size = size;
+	p->id = __sync_fetch_and_add(&pool_ids, 1);
 
 	spin_lock(&pools_lock);
 	list_add_tail(&p->entry, &pools);
@@ -91,33 +125,179 @@ mempool_t __export *mempool_create2(int size)
 }
 
 #ifndef MEMDEBUG
-void __export *mempool_alloc(mempool_t *pool)
+#ifdef MEMPOOL_CACHE
+static void mag_flush(struct _mempool_mag_t *mag, int n)
 {
-	struct _mempool_t *p = (struct _mempool_t *)pool;
+	struct _mempool_t *p = mag->pool;
+	struct _item_t *it;
+	uint32_t size = sizeof(*it) + p->size + 8;
+	int cached = 0, i;
+	LIST_HEAD(free_list);
+
+	spin_lock(&p->lock);
+	for (i = 0; i < n; i++) {
+		it = mag->items[--mag->cnt];
+		if (p->objects < conf_mempool_min) {
+			++p->objects;
+			++cached;
+			list_add_tail(&it->entry, &p->items);
+		} else
+			list_add_tail(&it->entry, &free_list);
+	}
+	spin_unlock(&p->lock);
+
+	if (cached)
+		__sync_add_and_fetch(&triton_stat.mempool_available, cached * size);
+
+	while (!list_empty(&free_list)) {
+		it = list_entry(free_list.next, typeof(*it), entry);
+		list_del(&it->entry);
+		_free(it);
+		__sync_sub_and_fetch(&triton_stat.mempool_allocated, size);
+	}
+}
+
+static void mag_refill(struct _mempool_mag_t *mag)
+{
+	struct _mempool_t *p = mag->pool;
 	struct _item_t *it;
 	uint32_t size = sizeof(*it) + p->size + 8;
+	int n = 0;
+
+	if (list_empty(&p->items))
+		return;
 
 	spin_lock(&p->lock);
-	if (!list_empty(&p->items)) {
+	while (n < MAG_SIZE / 2 && !list_empty(&p->items)) {
 		it = list_entry(p->items.next, typeof(*it), entry);
 		list_del(&it->entry);
-		spin_unlock(&p->lock);
+		mag->items[mag->cnt++] = it;
+		++n;
+	}
+	p->objects -= n;
+	spin_unlock(&p->lock);
 
-		--p->objects;
-		__sync_sub_and_fetch(&triton_stat.mempool_available, size);
+	if (n)
+		__sync_sub_and_fetch(&triton_stat.mempool_available, n * size);
+}
 
-		return it->ptr;
-#ifdef VALGRIND
+static void cache_flush(struct _mempool_cache_t *c)
+{
+	int i;
+
+	for (i = 0; i < c->size; i++) {
+		if (c->mags[i] && c->mags[i]->cnt)
+			mag_flush(c->mags[i], c->mags[i]->cnt);
+	}
+}
+
+static void cache_destroy(void *arg)
+{
+	struct _mempool_cache_t *c = arg;
+	int i;
+
+	cache_flush(c);
+
+	for (i = 0; i < c->size; i++) {
+		if (c->mags[i])
+			_free(c->mags[i]);
+	}
+
+	_free(c->mags);
+	_free(c);
+
+	cache = NULL;
+}
+
+static struct _mempool_mag_t *mag_get_slow(struct _mempool_t *p)
+{
+	struct _mempool_mag_t **mags;
+	int size;
+
+	if (!cache) {
+		cache = _malloc(sizeof(*cache));
+		if (!cache)
+			return NULL;
+		memset(cache, 0, sizeof(*cache));
+		cache->gen = cache_gen;
+		pthread_setspecific(cache_key, cache);
+	}
+
+	if (cache->gen != cache_gen) {
+		cache_flush(cache);
+		cache->gen = cache_gen;
+	}
+
+	if (p->id >= cache->size) {
+		size = p->id + 16;
+		mags = _realloc(cache->mags, size * sizeof(*mags));
+		if (!mags)
+			return NULL;
+		memset(mags + cache->size, 0, (size - cache->size) * sizeof(*mags));
+		cache->mags = mags;
+		cache->size = size;
+	}
+
+	if (!cache->mags[p->id]) {
+		cache->mags[p->id] = _malloc(sizeof(struct _mempool_mag_t));
+		if (!cache->mags[p->id])
+			return NULL;
+		cache->mags[p->id]->pool = p;
+		cache->mags[p->id]->cnt = 0;
+	}
+
+	return cache->mags[p->id];
+}
+
+static inline struct _mempool_mag_t *mag_get(struct _mempool_t *p)
+{
+	if (cache && cache->gen == cache_gen && p->id < cache->size && cache->mags[p->id])
+		return cache->mags[p->id];
+
+	return mag_get_slow(p);
+}
+#endif
+
+void __export *mempool_alloc(mempool_t *pool)
+{
+	struct _mempool_t *p = (struct _mempool_t *)pool;
+	struct _item_t *it;
+	uint32_t size = sizeof(*it) + p->size + 8;
+#ifdef MEMPOOL_CACHE
+	struct _mempool_mag_t *mag = mag_get(p);
+
+	if (mag) {
+		if (!mag->cnt)
+			mag_refill(mag);
+
+		if (mag->cnt) {
+			it = mag->items[--mag->cnt];
+			return it->ptr;
 		}
+	} else
 #endif
+	{
+		spin_lock(&p->lock);
+		if (!list_empty(&p->items)) {
+			it = list_entry(p->items.next, typeof(*it), entry);
+			list_del(&it->entry);
+			--p->objects;
+			spin_unlock(&p->lock);
+
+			__sync_sub_and_fetch(&triton_stat.mempool_available, size);
+
+			return it->ptr;
+		}
+		spin_unlock(&p->lock);
 	}
-	spin_unlock(&p->lock);
 
 	if (p->mmap) {
 		spin_lock(&mmap_lock);
 		if (mmap_ptr + size >= mmap_endptr) {
-			if (mmap_grow())
+			if (mmap_grow()) {
+				spin_unlock(&mmap_lock);
 				return NULL;
+			}
 		}
 		it = (struct _item_t *)mmap_ptr;
 		mmap_ptr += size;
@@ -143,6 +323,9 @@ void __export mempool_free(void *ptr)
 	struct _mempool_t *p = it->owner;
 	uint32_t size = sizeof(*it) + it->owner->size + 8;
 	int need_free = 0;
+#ifdef MEMPOOL_CACHE
+	struct _mempool_mag_t *mag;
+#endif
 
 #ifdef MEMDEBUG
 	if (it->magic1 != MAGIC1) {
@@ -163,6 +346,16 @@ void __export mempool_free(void *ptr)
 	it->magic1 = 0;
 #endif
 
+#ifdef MEMPOOL_CACHE
+	mag = mag_get(p);
+	if (mag) {
+		if (mag->cnt == MAG_SIZE)
+			mag_flush(mag, MAG_SIZE / 2);
+		mag->items[mag->cnt++] = it;
+		return;
+	}
+#endif
+
 	spin_lock(&p->lock);
 #ifdef MEMDEBUG
 	list_del(&it->entry);
@@ -225,6 +418,11 @@ static void mempool_clean(void)
 
 	triton_log_error("mempool: clean");
 
+#ifdef MEMPOOL_CACHE
+	/* make threads return cached items on next alloc/free */
+	__sync_add_and_fetch(&cache_gen, 1);
+#endif
+
 	spin_lock(&pools_lock);
 	list_for_each_entry(p, &pools, entry) {
 		if (p->mmap)
@@ -293,6 +491,10 @@ static void __init init(void)
 	spinlock_init(&pools_lock);
 	spinlock_init(&mmap_lock);
 
+#ifdef MEMPOOL_CACHE
+	pthread_key_create(&cache_key, cache_destroy);
+#endif
+
 	struct sigaction sa = {
 		.sa_handler = sigclean,
 		.sa_mask = set,
@@ -18,6 +18,22 @@
 
 #include "memdebug.h"
 
+/*
+ * Relative timers are kept in a hierarchical timing wheel driven by single
+ * timerfd, one tick is one millisecond.
+ * Absolute (CLOCK_REALTIME) timers still use dedicated timerfd each.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+#define TV_MAX_DELTA 0xffffffffllu
+
+#define WHEEL_IDLE UINT64_MAX
+
 extern int max_events;
 static int epoll_fd;
 static struct epoll_event *epoll_events;
@@ -31,8 +47,252 @@ static pthread_mutex_t freed_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static LIST_HEAD(freed_list);
 static LIST_HEAD(freed_list2);
 
+static spinlock_t wheel_lock;
+static int wheel_fd;
+static struct epoll_event wheel_event;
+static struct timespec wheel_epoch;
+static uint64_t wheel_clk;
+static uint64_t wheel_armed = WHEEL_IDLE;
+static unsigned int wheel_count;
+static struct list_head tv1[TVR_SIZE];
+static struct list_head tvn[TVN_LEVELS][TVN_SIZE];
+static uint64_t tv1_map[TVR_SIZE / 64];
+static uint64_t tvn_map[TVN_LEVELS];
+
+static uint64_t wheel_now(uint64_t delay_ns)
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	ns = (ts.tv_sec - wheel_epoch.tv_sec) * 1000000000llu + ts.tv_nsec - wheel_epoch.tv_nsec + delay_ns;
+
+	/* round up so that timer never expires earlier than requested */
+	return delay_ns ? (ns + 999999) / 1000000 : ns / 1000000;
+}
+
+static void wheel_arm(uint64_t expires)
+{
+	struct itimerspec ts;
+
+	if (expires == wheel_armed)
+		return;
+
+	wheel_armed = expires;
+
+	memset(&ts, 0, sizeof(ts));
+
+	if (expires != WHEEL_IDLE) {
+		ts.it_value.tv_sec = wheel_epoch.tv_sec + expires / 1000;
+		ts.it_value.tv_nsec = wheel_epoch.tv_nsec + (expires % 1000) * 1000000;
+		if (ts.it_value.tv_nsec >= 1000000000) {
+			ts.it_value.tv_sec++;
+			ts.it_value.tv_nsec -= 1000000000;
+		}
+	}
+
+	if (timerfd_settime(wheel_fd, TFD_TIMER_ABSTIME, &ts, NULL))
+		triton_log_error("timer:timerfd_settime: %s", strerror(errno));
+}
+
+static void wheel_insert(struct _triton_timer_t *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires < wheel_clk)
+		expires = wheel_clk;
+
+	delta = expires - wheel_clk;
+
+	if (delta < TVR_SIZE) {
+		t->level = 0;
+		t->idx = expires & TVR_MASK;
+		list_add_tail(&t->wentry, &tv1[t->idx]);
+		tv1_map[t->idx / 64] |= 1llu << (t->idx % 64);
+		return;
+	}
+
+	if (delta > TV_MAX_DELTA)
+		expires = wheel_clk + TV_MAX_DELTA;
+
+	for (level = 1; level < TVN_LEVELS; level++) {
+		if (delta < 1llu << (TVR_BITS + level * TVN_BITS))
+			break;
+	}
+
+	t->level = level;
+	t->idx = (expires >> (TVR_BITS + (level - 1) * TVN_BITS)) & TVN_MASK;
+	list_add_tail(&t->wentry, &tvn[level - 1][t->idx]);
+	tvn_map[level - 1] |= 1llu << t->idx;
+}
+
+static void wheel_remove(struct _triton_timer_t *t)
+{
+	list_del(&t->wentry);
+
+	if (t->level == 0) {
+		if (list_empty(&tv1[t->idx]))
+			tv1_map[t->idx / 64] &= ~(1llu << (t->idx % 64));
+	} else {
+		if (list_empty(&tvn[t->level - 1][t->idx]))
+			tvn_map[t->level - 1] &= ~(1llu << t->idx);
+	}
+
+	t->level = -1;
+}
+
+static int tv1_next(int idx)
+{
+	int i = idx / 64;
+	uint64_t m = tv1_map[i] & (~0llu << (idx % 64));
+
+	while (1) {
+		if (m)
+			return i * 64 + __builtin_ctzll(m);
+		if (++i == TVR_SIZE / 64)
+			return -1;
+		m = tv1_map[i];
+	}
+}
+
+/*
+ * Returns the nearest tick at which something has to be done:
+ * either level 0 slot expires or non-empty upper level slot cascades.
+ */
+static uint64_t wheel_next(void)
+{
+	uint64_t r = WHEEL_IDLE, t, m;
+	int level, shift, pos, d, idx;
+
+	if (!wheel_count)
+		return WHEEL_IDLE;
+
+	idx = tv1_next(wheel_clk & TVR_MASK);
+	if (idx >= 0)
+		r = (wheel_clk & ~(uint64_t)TVR_MASK) + idx;
+	else {
+		idx = tv1_next(0);
+		if (idx >= 0)
+			r = (wheel_clk & ~(uint64_t)TVR_MASK) + TVR_SIZE + idx;
+	}
+
+	for (level = 0; level < TVN_LEVELS; level++) {
+		m = tvn_map[level];
+		if (!m)
+			continue;
+
+		shift = TVR_BITS + level * TVN_BITS;
+		pos = (wheel_clk >> shift) & TVN_MASK;
+
+		m = (m >> pos) | (pos ? m << (TVN_SIZE - pos) : 0);
+		d = __builtin_ctzll(m);
+		if (d == 0 && (wheel_clk & ((1llu << shift) - 1)))
+			d = (m & ~1llu) ? __builtin_ctzll(m & ~1llu) : TVN_SIZE;
+
+		t = ((wheel_clk >> shift) + d) << shift;
+		if (t < r)
+			r = t;
+	}
+
+	return r;
+}
+
+static int wheel_cascade(int level, int idx)
+{
+	struct _triton_timer_t *t;
+	LIST_HEAD(list);
+
+	list_splice_init(&tvn[level][idx], &list);
+	tvn_map[level] &= ~(1llu << idx);
+
+	while (!list_empty(&list)) {
+		t = list_entry(list.next, typeof(*t), wentry);
+		list_del(&t->wentry);
+		wheel_insert(t);
+	}
+
+	return idx;
+}
+
+static void wheel_expire(struct _triton_timer_t *t, uint64_t now)
+{
+	struct _triton_thread_t *thread;
+
+	if (t->period) {
+		t->expires += t->period;
+		if (t->expires <= now)
+			t->expires = now + t->period;
+		wheel_insert(t);
+	} else
+		--wheel_count;
+
+	spin_lock(&t->ctx->lock);
+	if (t->ud && __sync_bool_compare_and_swap(&t->pending, PENDING_NONE, PENDING_QUEUED)) {
+		list_add_tail(&t->entry2, &t->ctx->pending_timers);
+		__sync_add_and_fetch(&triton_stat.timer_pending, 1);
+		thread = triton_queue_ctx(t->ctx);
+	} else
+		thread = NULL;
+	spin_unlock(&t->ctx->lock);
+
+	if (thread)
+		triton_thread_wakeup(thread);
+}
+
+static void wheel_run(void)
+{
+	struct _triton_timer_t *t;
+	uint64_t now = wheel_now(0);
+	uint64_t next;
+	int idx, level;
+	LIST_HEAD(list);
+
+	spin_lock(&wheel_lock);
+
+	wheel_armed = WHEEL_IDLE;
+
+	while (wheel_clk <= now) {
+		next = wheel_next();
+		if (next > now) {
+			wheel_clk = now + 1;
+			break;
+		}
+		if (next > wheel_clk)
+			wheel_clk = next;
+
+		idx = wheel_clk & TVR_MASK;
+		if (!idx) {
+			for (level = 0; level < TVN_LEVELS; level++) {
+				if (wheel_cascade(level, (wheel_clk >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK))
+					break;
+			}
+		}
+
+		list_splice_init(&tv1[idx], &list);
+		tv1_map[idx / 64] &= ~(1llu << (idx % 64));
+
+		while (!list_empty(&list)) {
+			t = list_entry(list.next, typeof(*t), wentry);
+			list_del(&t->wentry);
+			t->level = -1;
+			wheel_expire(t, now);
+		}
+
+		wheel_clk++;
+	}
+
+	wheel_arm(wheel_next());
+
+	spin_unlock(&wheel_lock);
+}
+
 int timer_init(void)
 {
+	int i, j;
+
 	epoll_fd = epoll_create(1);
 	if (epoll_fd < 0) {
 		perror("timer:epoll_create");
@@ -49,6 +309,35 @@ int timer_init(void)
 
 	timer_pool = mempool_create(sizeof(struct _triton_timer_t));
 
+	spinlock_init(&wheel_lock);
+
+	for (i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&tv1[i]);
+
+	for (i = 0; i < TVN_LEVELS; i++) {
+		for (j = 0; j < TVN_SIZE; j++)
+			INIT_LIST_HEAD(&tvn[i][j]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wheel_epoch);
+
+	wheel_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (wheel_fd < 0) {
+		perror("timer:timerfd_create");
+		return -1;
+	}
+
+	fcntl(wheel_fd, F_SETFL, O_NONBLOCK);
+	fcntl(wheel_fd, F_SETFD, FD_CLOEXEC);
+
+	wheel_event.data.ptr = NULL;
+	wheel_event.events = EPOLLIN | EPOLLET;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel_fd, &wheel_event)) {
+		perror("timer:epoll_ctl");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -68,9 +357,11 @@ void timer_terminate(void)
 
 void *timer_thread(void *arg)
 {
-	int i,n,r;
+	int i,n;
+	struct _triton_thread_t *thread;
 	struct _triton_timer_t *t;
 	sigset_t set;
+	uint64_t tt;
 
 	sigfillset(&set);
 	sigdelset(&set, SIGKILL);
@@ -88,22 +379,26 @@ void *timer_thread(void *arg)
 
 		for(i = 0; i < n; i++) {
 			t = (struct _triton_timer_t *)epoll_events[i].data.ptr;
+			if (!t) {
+				read(wheel_fd, &tt, sizeof(tt));
+				wheel_run();
+				continue;
+			}
 			if (!t->ud)
 				continue;
 			spin_lock(&t->ctx->lock);
 			if (t->ud) {
-				if (!t->pending) {
+				if (__sync_bool_compare_and_swap(&t->pending, PENDING_NONE, PENDING_QUEUED)) {
 					list_add_tail(&t->entry2, &t->ctx->pending_timers);
-					t->pending = 1;
 					__sync_add_and_fetch(&triton_stat.timer_pending, 1);
-					r = triton_queue_ctx(t->ctx);
+					thread = triton_queue_ctx(t->ctx);
 				} else
-					r = 0;
+					thread = NULL;
 			} else
-				r = 0;
+				thread = NULL;
 			spin_unlock(&t->ctx->lock);
-			if (r)
-				triton_thread_wakeup(t->ctx->thread);
+			if (thread)
+				triton_thread_wakeup(thread);
 		}
 
 		while (!list_empty(&freed_list2)) {
@@ -128,61 +423,69 @@ int __export triton_timer_add(struct triton_context_t *ctx, struct triton_timer_
 
 	memset(t, 0, sizeof(*t));
 	t->ud = ud;
+	t->level = -1;
+	t->fd = -1;
 	t->epoll_event.data.ptr = t;
 	t->epoll_event.events = EPOLLIN | EPOLLET;
 	if (ctx)
 		t->ctx = (struct _triton_context_t *)ctx->tpd;
 	else
 		t->ctx = (struct _triton_context_t *)default_ctx.tpd;
-	t->fd = timerfd_create(abs_time ? CLOCK_REALTIME : CLOCK_MONOTONIC, 0);
-	if (t->fd < 0) {
-		triton_log_error("timer:timerfd_create: %s", strerror(errno));
-		mempool_free(t);
-		return -1;
-	}
 
-	if (fcntl(t->fd, F_SETFL, O_NONBLOCK)) {
-    triton_log_error("timer: failed to set nonblocking mode: %s", strerror(errno));
-    goto out_err;
+	if (abs_time) {
+		t->fd = timerfd_create(CLOCK_REALTIME, 0);
+		if (t->fd < 0) {
+			triton_log_error("timer:timerfd_create: %s", strerror(errno));
+			mempool_free(t);
+			return -1;
+		}
+
+		if (fcntl(t->fd, F_SETFL, O_NONBLOCK)) {
+			triton_log_error("timer: failed to set nonblocking mode: %s", strerror(errno));
+			goto out_err;
+		}
 	}
 
 	__sync_add_and_fetch(&t->ctx->refs, 1);
 	ud->tpd = t;
 
 	if (triton_timer_mod(ud, abs_time))
-		goto out_err;
+		goto out_err_ref;
 
 	spin_lock(&t->ctx->lock);
 	list_add_tail(&t->entry, &t->ctx->timers);
 	spin_unlock(&t->ctx->lock);
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->fd, &t->epoll_event)) {
+	if (t->fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->fd, &t->epoll_event)) {
 		triton_log_error("timer:epoll_ctl: %s", strerror(errno));
 		spin_lock(&t->ctx->lock);
 		t->ud = NULL;
 		list_del(&t->entry);
 		spin_unlock(&t->ctx->lock);
-		goto out_err;
+		goto out_err_ref;
 	}
 
-	triton_stat.timer_count++;
+	__sync_add_and_fetch(&triton_stat.timer_count, 1);
 
 	return 0;
 
+out_err_ref:
+	triton_context_release(t->ctx);
 out_err:
 	ud->tpd = NULL;
-	close(t->fd);
+	if (t->fd >= 0)
+		close(t->fd);
 	mempool_free(t);
 	return -1;
 }
-int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
+
+static int timerfd_mod(struct _triton_timer_t *t, struct triton_timer_t *ud, int abs_time)
 {
-	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
 	struct itimerspec ts =	{
 		.it_value.tv_sec = ud->expire_tv.tv_sec,
 		.it_value.tv_nsec = ud->expire_tv.tv_usec * 1000,
 		.it_interval.tv_sec = ud->period / 1000,
-		.it_interval.tv_nsec = (ud->period % 1000) * 1000,
+		.it_interval.tv_nsec = (ud->period % 1000) * 1000000,
 	};
 
 	if (ud->expire_tv.tv_sec == 0 && ud->expire_tv.tv_usec == 0)
@@ -195,28 +498,88 @@ int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
 
 	return 0;
 }
+
+int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
+{
+	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
+	uint64_t delay;
+
+	if (t->fd >= 0)
+		return timerfd_mod(t, ud, abs_time);
+
+	if (ud->expire_tv.tv_sec == 0 && ud->expire_tv.tv_usec == 0)
+		delay = (uint64_t)ud->period * 1000000;
+	else
+		delay = (uint64_t)ud->expire_tv.tv_sec * 1000000000 + (uint64_t)ud->expire_tv.tv_usec * 1000;
+
+	spin_lock(&wheel_lock);
+
+	if (t->level != -1) {
+		wheel_remove(t);
+		--wheel_count;
+	}
+
+	if (delay) {
+		if (!wheel_count)
+			wheel_clk = wheel_now(0);
+
+		t->expires = wheel_now(delay);
+		t->period = ud->period;
+		wheel_insert(t);
+		++wheel_count;
+
+		if (t->expires < wheel_armed)
+			wheel_arm(t->expires);
+	}
+
+	spin_unlock(&wheel_lock);
+
+	return 0;
+}
+
+void timer_free(struct _triton_timer_t *t)
+{
+	pthread_mutex_lock(&freed_list_lock);
+	list_add_tail(&t->entry, &freed_list);
+	pthread_mutex_unlock(&freed_list_lock);
+}
+
 void __export triton_timer_del(struct triton_timer_t *ud)
 {
 	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->fd, &t->epoll_event);
-	close(t->fd);
+	int dead;
+
+	if (t->fd >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->fd, &t->epoll_event);
+		close(t->fd);
+	} else {
+		spin_lock(&wheel_lock);
+		if (t->level != -1) {
+			wheel_remove(t);
+			--wheel_count;
+		}
+		spin_unlock(&wheel_lock);
+	}
+
 	spin_lock(&t->ctx->lock);
 	t->ud = NULL;
 	list_del(&t->entry);
-	if (t->pending) {
+	if (t->pending == PENDING_QUEUED) {
 		list_del(&t->entry2);
+		t->pending = PENDING_NONE;
 		__sync_sub_and_fetch(&triton_stat.timer_pending, 1);
 	}
+	/* ctx_thread still holds it in its batch and frees it when reached */
+	dead = __sync_bool_compare_and_swap(&t->pending, PENDING_EXEC, PENDING_DEAD);
 	spin_unlock(&t->ctx->lock);
 
-	sched_yield();
+	if (t->fd >= 0)
+		sched_yield();
 
-	pthread_mutex_lock(&freed_list_lock);
-	list_add_tail(&t->entry, &freed_list);
-	pthread_mutex_unlock(&freed_list_lock);
+	if (!dead)
+		timer_free(t);
 
 	ud->tpd = NULL;
 
-	triton_stat.timer_count--;
+	__sync_sub_and_fetch(&triton_stat.timer_count, 1);
 }
-
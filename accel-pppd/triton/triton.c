@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <limits.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "triton_p.h"
 #include "memdebug.h"
@@ -18,10 +20,19 @@ int max_events = 64;
 
 static spinlock_t threads_lock;
 static LIST_HEAD(threads);
-static LIST_HEAD(sleep_threads);
 
+static spinlock_t idle_lock;
+static LIST_HEAD(idle_threads);
+static int idle_count;
+
+/* contexts queued before worker threads are started */
 static LIST_HEAD(ctx_queue);
 
+static struct _triton_runq_t *runq;
+static int runq_count;
+static unsigned int runq_next;
+static int prio_queued;
+
 static spinlock_t ctx_list_lock;
 static LIST_HEAD(ctx_list);
 
@@ -50,13 +61,21 @@ static struct triton_timer_t ru_timer = {
 struct triton_context_t default_ctx;
 
 static struct triton_context_t __thread *this_ctx;
+static struct _triton_thread_t __thread *this_thread;
 
 #define log_debug2(fmt, ...)
 
 void triton_thread_wakeup(struct _triton_thread_t *thread)
 {
 	log_debug2("wake up thread %p\n", thread);
-	pthread_kill(thread->thread, SIGUSR1);
+	if (!__sync_fetch_and_or(&thread->futex, 1))
+		syscall(SYS_futex, &thread->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void thread_wait(struct _triton_thread_t *thread)
+{
+	while (!__sync_fetch_and_and(&thread->futex, 0))
+		syscall(SYS_futex, &thread->futex, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
 }
 
 static void __config_reload(void (*notify)(int))
@@ -76,11 +95,173 @@ static void __config_reload(void (*notify)(int))
 	log_debug2("config_reload: exit\n");
 }
 
+static int can_dispatch(struct _triton_context_t *ctx)
+{
+	if (need_config_reload || triton_stat.thread_active > thread_count)
+		return 0;
+
+	if (ctx->priority == 0 && triton_stat.thread_count > thread_count_max)
+		return 0;
+
+	return 1;
+}
+
+static struct _triton_thread_t *pop_idle_thread(struct _triton_context_t *ctx)
+{
+	struct _triton_thread_t *thread = NULL;
+
+	spin_lock(&idle_lock);
+	if (!list_empty(&idle_threads)) {
+		thread = list_entry(idle_threads.next, typeof(*thread), entry2);
+		list_del(&thread->entry2);
+		thread->idle = 0;
+		--idle_count;
+		if (ctx) {
+			thread->ctx = ctx;
+			ctx->thread = thread;
+		}
+	}
+	spin_unlock(&idle_lock);
+
+	return thread;
+}
+
+static int runq_empty(void)
+{
+	int i;
+
+	for (i = 0; i < runq_count; i++) {
+		if (!list_empty(&runq[i].ctx_queue))
+			return 0;
+	}
+
+	return 1;
+}
+
+static struct _triton_context_t *runq_pop(struct _triton_runq_t *rq, int prio)
+{
+	struct _triton_context_t *ctx = NULL;
+
+	if (list_empty(&rq->ctx_queue))
+		return NULL;
+
+	spin_lock(&rq->lock);
+	if (!list_empty(&rq->ctx_queue)) {
+		ctx = list_entry(rq->ctx_queue.next, typeof(*ctx), entry2);
+		if (prio && !ctx->priority)
+			ctx = NULL;
+		else {
+			list_del_init(&ctx->entry2);
+			if (ctx->priority)
+				__sync_sub_and_fetch(&prio_queued, 1);
+		}
+	}
+	spin_unlock(&rq->lock);
+
+	return ctx;
+}
+
+/*
+ * Takes next context from own run queue or steals from other threads.
+ * Priority contexts are looked up in all queues first.
+ */
+static struct _triton_context_t *runq_dequeue(struct _triton_thread_t *thread)
+{
+	struct _triton_context_t *ctx = NULL;
+	int i, n = thread->rq ? thread->rq - runq : 0;
+	int prio = prio_queued ? 1 : 0;
+
+	for (; prio >= 0 && !ctx; prio--) {
+		for (i = 0; i < runq_count; i++) {
+			ctx = runq_pop(&runq[(n + i) % runq_count], prio);
+			if (ctx) {
+				if (i || !thread->rq)
+					__sync_add_and_fetch(&triton_stat.context_stolen, 1);
+				break;
+			}
+		}
+	}
+
+	if (!ctx)
+		return NULL;
+
+	log_debug2("thread: %p: dequeued ctx %p\n", thread, ctx);
+
+	spin_lock(&ctx->lock);
+	ctx->thread = thread;
+	ctx->queued = 0;
+	spin_unlock(&ctx->lock);
+	__sync_sub_and_fetch(&triton_stat.context_pending, 1);
+
+	return ctx;
+}
+
+/*
+ * Puts thread to sleep until it is woken up.
+ * Returns non-zero if thread must exit.
+ */
+static int thread_idle(struct _triton_thread_t *thread)
+{
+	int reload = 0;
+
+	spin_lock(&threads_lock);
+	if (!thread->rq && triton_stat.thread_count > thread_count + triton_stat.context_sleeping) {
+		__sync_sub_and_fetch(&triton_stat.thread_active, 1);
+		__sync_sub_and_fetch(&triton_stat.thread_count, 1);
+		list_del(&thread->entry);
+		spin_unlock(&threads_lock);
+		pthread_detach(pthread_self());
+		log_debug2("thread: %p: exit\n", thread);
+		_free(thread);
+		return 1;
+	}
+	spin_unlock(&threads_lock);
+
+	log_debug2("thread: %p: sleeping\n", thread);
+
+	spin_lock(&idle_lock);
+	if (!terminate) {
+		list_add(&thread->entry2, &idle_threads);
+		thread->idle = 1;
+		__sync_add_and_fetch(&idle_count, 1);
+	}
+
+	if (__sync_sub_and_fetch(&triton_stat.thread_active, 1) == 0 && need_config_reload)
+		reload = 1;
+	spin_unlock(&idle_lock);
+
+	if (reload)
+		__config_reload(config_reload_notify);
+
+	if (terminate) {
+		spin_lock(&threads_lock);
+		list_del(&thread->entry);
+		spin_unlock(&threads_lock);
+		return 1;
+	}
+
+	/* recheck queues, context may be queued before we became idle */
+	if (need_config_reload || triton_stat.thread_active >= thread_count || runq_empty())
+		thread_wait(thread);
+
+	spin_lock(&idle_lock);
+	if (thread->idle) {
+		list_del(&thread->entry2);
+		thread->idle = 0;
+		--idle_count;
+	}
+	spin_unlock(&idle_lock);
+
+	__sync_add_and_fetch(&triton_stat.thread_active, 1);
+
+	return 0;
+}
+
 static void ctx_thread(struct _triton_context_t *ctx);
 static void* triton_thread(struct _triton_thread_t *thread)
 {
 	sigset_t set;
-	int sig, need_free;
+	int need_free;
 
 	sigfillset(&set);
 	sigdelset(&set, SIGKILL);
@@ -88,65 +269,19 @@ static void* triton_thread(struct _triton_thread_t *thread)
 	sigdelset(&set, SIGSEGV);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR1);
-	sigaddset(&set, SIGQUIT);
+	this_thread = thread;
 
 	pthread_mutex_lock(&thread->sleep_lock);
 	pthread_mutex_unlock(&thread->sleep_lock);
 
 	while (1) {
-		spin_lock(&threads_lock);
-		if (!list_empty(&ctx_queue) && !need_config_reload && triton_stat.thread_active <= thread_count) {
-			thread->ctx = list_entry(ctx_queue.next, typeof(*thread->ctx), entry2);
-			log_debug2("thread: %p: dequeued ctx %p\n", thread, thread->ctx);
-			list_del(&thread->ctx->entry2);
-			spin_unlock(&threads_lock);
-			spin_lock(&thread->ctx->lock);
-			thread->ctx->thread = thread;
-			thread->ctx->queued = 0;
-			spin_unlock(&thread->ctx->lock);
-			__sync_sub_and_fetch(&triton_stat.context_pending, 1);
-		} else {
-			if (triton_stat.thread_count > thread_count + triton_stat.context_sleeping) {
-				__sync_sub_and_fetch(&triton_stat.thread_active, 1);
-				__sync_sub_and_fetch(&triton_stat.thread_count, 1);
-				list_del(&thread->entry);
-				spin_unlock(&threads_lock);
-				pthread_detach(pthread_self());
-				log_debug2("thread: %p: exit\n", thread);
-				_free(thread);
-				return NULL;
-			}
-			log_debug2("thread: %p: sleeping\n", thread);
-			if (!terminate)
-				list_add(&thread->entry2, &sleep_threads);
+		if (!thread->ctx && !need_config_reload && triton_stat.thread_active <= thread_count)
+			thread->ctx = runq_dequeue(thread);
 
-			if (__sync_sub_and_fetch(&triton_stat.thread_active, 1) == 0 && need_config_reload) {
-				spin_unlock(&threads_lock);
-				__config_reload(config_reload_notify);
-			} else
-				spin_unlock(&threads_lock);
-
-			if (terminate) {
-				spin_lock(&threads_lock);
-				list_del(&thread->entry);
-				spin_unlock(&threads_lock);
+		if (!thread->ctx) {
+			if (thread_idle(thread))
 				return NULL;
-			}
-
-			//printf("thread %p: enter sigwait\n", thread);
-			sigwait(&set, &sig);
-			//printf("thread %p: exit sigwait\n", thread);
-
-			spin_lock(&threads_lock);
-			__sync_add_and_fetch(&triton_stat.thread_active, 1);
-			if (!thread->ctx) {
-				list_del(&thread->entry2);
-				spin_unlock(&threads_lock);
-				continue;
-			}
-			spin_unlock(&threads_lock);
+			continue;
 		}
 
 		log_debug2("thread %p: ctx=%p %p\n", thread, thread->ctx, thread->ctx ? thread->ctx->thread : NULL);
@@ -159,14 +294,14 @@ cont:
 		ctx_thread(thread->ctx);
 		log_debug2("thread %p: switch from %p %p\n", thread, thread->ctx, thread->ctx->thread);
 
-		spin_lock(&threads_lock);
+		spin_lock(&thread->ctx->lock);
 		if (thread->ctx->pending && !thread->ctx->need_free) {
-			spin_unlock(&threads_lock);
+			spin_unlock(&thread->ctx->lock);
 			goto cont;
 		}
 		thread->ctx->thread = NULL;
 		need_free = thread->ctx->need_free;
-		spin_unlock(&threads_lock);
+		spin_unlock(&thread->ctx->lock);
 
 		if (need_free) {
 			log_debug2("- context %p removed\n", thread->ctx);
@@ -182,34 +317,71 @@ static void ctx_thread(struct _triton_context_t *ctx)
 	struct _triton_md_handler_t *h;
 	struct _triton_timer_t *t;
 	struct _triton_ctx_call_t *call;
+	LIST_HEAD(exec_timers);
+	LIST_HEAD(exec_handlers);
 	uint64_t tt;
 	int events;
+	int timer_cnt, handler_cnt;
 
 	log_debug2("ctx %p %p: enter\n", ctx, ctx->thread);
 
 	while (1) {
 		spin_lock(&ctx->lock);
-		if (!list_empty(&ctx->pending_timers)) {
-			t = list_entry(ctx->pending_timers.next, typeof(*t), entry2);
-			list_del(&t->entry2);
-			t->pending = 0;
+		if (list_empty(&ctx->pending_timers) && list_empty(&ctx->pending_handlers) && list_empty(&ctx->pending_calls)) {
+			ctx->pending = 0;
 			spin_unlock(&ctx->lock);
-			__sync_sub_and_fetch(&triton_stat.timer_pending, 1);
-			read(t->fd, &tt, sizeof(tt));
+			break;
+		}
+
+		/*
+		 * take everything queued so far in one go, items unregistered
+		 * from another thread while in the batch are marked dead and
+		 * freed here instead of being unlinked
+		 */
+		timer_cnt = 0;
+		list_for_each_entry(t, &ctx->pending_timers, entry2) {
+			t->pending = PENDING_EXEC;
+			timer_cnt++;
+		}
+		list_splice_init(&ctx->pending_timers, &exec_timers);
+
+		handler_cnt = 0;
+		list_for_each_entry(h, &ctx->pending_handlers, entry2) {
+			h->pending = PENDING_EXEC;
+			handler_cnt++;
+		}
+		list_splice_init(&ctx->pending_handlers, &exec_handlers);
+
+		list_splice_init(&ctx->pending_calls, &ctx->exec_calls);
+		spin_unlock(&ctx->lock);
+
+		if (timer_cnt)
+			__sync_sub_and_fetch(&triton_stat.timer_pending, timer_cnt);
+		if (handler_cnt)
+			__sync_sub_and_fetch(&triton_stat.md_handler_pending, handler_cnt);
+
+		while (!list_empty(&exec_timers)) {
+			t = list_entry(exec_timers.next, typeof(*t), entry2);
+			list_del(&t->entry2);
+			if (!__sync_bool_compare_and_swap(&t->pending, PENDING_EXEC, PENDING_NONE)) {
+				timer_free(t);
+				continue;
+			}
+			if (t->fd >= 0)
+				read(t->fd, &tt, sizeof(tt));
 			if (t->ud)
 				t->ud->expire(t->ud);
-			continue;
 		}
 
-		if (!list_empty(&ctx->pending_handlers)) {
-			h = list_entry(ctx->pending_handlers.next, typeof(*h), entry2);
+		while (!list_empty(&exec_handlers)) {
+			h = list_entry(exec_handlers.next, typeof(*h), entry2);
 			list_del(&h->entry2);
-			h->pending = 0;
-			events = h->trig_epoll_events;
-			spin_unlock(&ctx->lock);
-
-			__sync_sub_and_fetch(&triton_stat.md_handler_pending, 1);
+			if (!__sync_bool_compare_and_swap(&h->pending, PENDING_EXEC, PENDING_NONE)) {
+				md_free(h);
+				continue;
+			}
 
+			events = h->trig_epoll_events;
 			h->armed = 0;
 
 			if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && (h->epoll_event.events & EPOLLIN)) {
@@ -227,22 +399,14 @@ static void ctx_thread(struct _triton_context_t *ctx)
 			}
 
 			md_rearm(h);
-
-			continue;
 		}
 
-		if (!list_empty(&ctx->pending_calls)) {
-			call = list_entry(ctx->pending_calls.next, typeof(*call), entry);
+		while (!list_empty(&ctx->exec_calls)) {
+			call = list_entry(ctx->exec_calls.next, typeof(*call), entry);
 			list_del(&call->entry);
-			spin_unlock(&ctx->lock);
 			call->func(call->arg);
 			mempool_free(call);
-			continue;
 		}
-
-		ctx->pending = 0;
-		spin_unlock(&ctx->lock);
-		break;
 	}
 
 	spin_lock(&ctx->lock);
@@ -284,35 +448,66 @@ struct _triton_thread_t *create_thread()
 	return thread;
 }
 
-int triton_queue_ctx(struct _triton_context_t *ctx)
+static void runq_push(struct _triton_context_t *ctx, int local)
 {
-	spin_lock(&threads_lock);
-	ctx->pending = 1;
-	if (ctx->thread || ctx->queued || ctx->init || ctx->need_free) {
-		spin_unlock(&threads_lock);
-		return 0;
-	}
+	struct _triton_runq_t *rq;
+
+	ctx->queued = 1;
+	__sync_add_and_fetch(&triton_stat.context_pending, 1);
+	log_debug2("ctx %p: queued\n", ctx);
 
-	if (list_empty(&sleep_threads) || need_config_reload || triton_stat.thread_active > thread_count ||
-		(ctx->priority == 0 && triton_stat.thread_count > thread_count_max)) {
-		if (ctx->priority)
+	if (!runq) {
+		spin_lock(&threads_lock);
+		ctx->rq = NULL;
+		if (ctx->priority) {
 			list_add(&ctx->entry2, &ctx_queue);
-		else
+			__sync_add_and_fetch(&prio_queued, 1);
+		} else
 			list_add_tail(&ctx->entry2, &ctx_queue);
 		spin_unlock(&threads_lock);
-		ctx->queued = 1;
-		log_debug2("ctx %p: queued\n", ctx);
-		__sync_add_and_fetch(&triton_stat.context_pending, 1);
-		return 0;
+		return;
 	}
 
-	ctx->thread = list_entry(sleep_threads.next, typeof(*ctx->thread), entry2);
-	ctx->thread->ctx = ctx;
-	log_debug2("ctx %p: assigned to thread %p\n", ctx, ctx->thread);
-	list_del(&ctx->thread->entry2);
-	spin_unlock(&threads_lock);
+	if (local && this_thread && this_thread->rq)
+		rq = this_thread->rq;
+	else
+		rq = &runq[__sync_fetch_and_add(&runq_next, 1) % runq_count];
 
-	return 1;
+	spin_lock(&rq->lock);
+	ctx->rq = rq;
+	if (ctx->priority) {
+		list_add(&ctx->entry2, &rq->ctx_queue);
+		__sync_add_and_fetch(&prio_queued, 1);
+	} else
+		list_add_tail(&ctx->entry2, &rq->ctx_queue);
+	spin_unlock(&rq->lock);
+}
+
+struct _triton_thread_t *triton_queue_ctx(struct _triton_context_t *ctx)
+{
+	struct _triton_thread_t *thread;
+
+	ctx->pending = 1;
+	if (ctx->thread || ctx->queued || ctx->init || ctx->need_free)
+		return NULL;
+
+	if (idle_count && can_dispatch(ctx)) {
+		thread = pop_idle_thread(ctx);
+		if (thread) {
+			log_debug2("ctx %p: assigned to thread %p\n", ctx, thread);
+			return thread;
+		}
+	}
+
+	runq_push(ctx, 1);
+
+	/* pairs with idle thread's recheck of run queues */
+	__sync_synchronize();
+
+	if (idle_count && can_dispatch(ctx))
+		return pop_idle_thread(NULL);
+
+	return NULL;
 }
 
 void triton_context_release(struct _triton_context_t *ctx)
@@ -335,11 +530,13 @@ int __export triton_context_register(struct triton_context_t *ud, void *bf_arg)
 	ctx->init = 1;
 	ctx->refs = 1;
 	spinlock_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->entry2);
 	INIT_LIST_HEAD(&ctx->handlers);
 	INIT_LIST_HEAD(&ctx->timers);
 	INIT_LIST_HEAD(&ctx->pending_handlers);
 	INIT_LIST_HEAD(&ctx->pending_timers);
 	INIT_LIST_HEAD(&ctx->pending_calls);
+	INIT_LIST_HEAD(&ctx->exec_calls);
 
 	ud->tpd = ctx;
 
@@ -367,6 +564,12 @@ void __export triton_context_unregister(struct triton_context_t *ud)
 		mempool_free(call);
 	}
 
+	while (!list_empty(&ctx->exec_calls)) {
+		call = list_entry(ctx->exec_calls.next, typeof(*call), entry);
+		list_del(&call->entry);
+		mempool_free(call);
+	}
+
 	if (!list_empty(&ctx->handlers)) {
 		triton_log_error("BUG:ctx:triton_unregister_ctx: handlers is not empty");
 		{
@@ -415,8 +618,36 @@ void __export triton_context_unregister(struct triton_context_t *ud)
 void __export triton_context_set_priority(struct triton_context_t *ud, int prio)
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
+	struct _triton_runq_t *rq;
+	spinlock_t *lock;
+
+	prio = prio > 0;
 
-	ctx->priority = prio > 0;
+	/* ctx->lock keeps runq_push out, the queue lock keeps runq_pop out */
+	spin_lock(&ctx->lock);
+	while (1) {
+		rq = ctx->rq;
+		lock = rq ? &rq->lock : &threads_lock;
+		spin_lock(lock);
+		if (ctx->rq == rq)
+			break;
+		spin_unlock(lock);
+	}
+
+	if (ctx->priority != prio && !list_empty(&ctx->entry2)) {
+		list_del(&ctx->entry2);
+		if (prio) {
+			list_add(&ctx->entry2, rq ? &rq->ctx_queue : &ctx_queue);
+			__sync_add_and_fetch(&prio_queued, 1);
+		} else {
+			list_add_tail(&ctx->entry2, rq ? &rq->ctx_queue : &ctx_queue);
+			__sync_sub_and_fetch(&prio_queued, 1);
+		}
+	}
+	ctx->priority = prio;
+
+	spin_unlock(lock);
+	spin_unlock(&ctx->lock);
 }
 
 void __export triton_context_schedule()
@@ -465,7 +696,7 @@ void triton_context_print(void)
 void __export triton_context_wakeup(struct triton_context_t *ud)
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
-	int r = 0;
+	struct _triton_thread_t *thread = NULL;
 
 	log_debug2("ctx %p: wakeup\n", ctx);
 
@@ -474,10 +705,10 @@ void __export triton_context_wakeup(struct triton_context_t *ud)
 		spin_lock(&ctx->lock);
 		ctx->init = 0;
 		if (ctx->pending)
-			r = triton_queue_ctx(ctx);
+			thread = triton_queue_ctx(ctx);
 		spin_unlock(&ctx->lock);
-		if (r)
-			triton_thread_wakeup(ctx->thread);
+		if (thread)
+			triton_thread_wakeup(thread);
 		return;
 	}
 
@@ -491,7 +722,7 @@ int __export triton_context_call(struct triton_context_t *ud, void (*func)(void
 {
 	struct _triton_context_t *ctx;
 	struct _triton_ctx_call_t *call = mempool_alloc(call_pool);
-	int r;
+	struct _triton_thread_t *thread;
 
 	if (!call)
 		return -1;
@@ -506,35 +737,108 @@ int __export triton_context_call(struct triton_context_t *ud, void (*func)(void
 
 	spin_lock(&ctx->lock);
 	list_add_tail(&call->entry, &ctx->pending_calls);
-	r = triton_queue_ctx(ctx);
+	thread = triton_queue_ctx(ctx);
 	spin_unlock(&ctx->lock);
 
-	if (r)
-		triton_thread_wakeup(ctx->thread);
+	if (thread)
+		triton_thread_wakeup(thread);
 
 	return 0;
 }
 
-void __export triton_cancel_call(struct triton_context_t *ud, void (*func)(void *))
+/*
+ * Queues many calls at once (possibly to different contexts).
+ * Contexts are spread over run queues and idle threads are woken up
+ * once per queued context at most, after everything is queued.
+ */
+int __export triton_context_call_batch(struct triton_ctx_call_t *calls, int n)
+{
+	struct _triton_context_t *ctx;
+	struct _triton_ctx_call_t *call;
+	struct _triton_thread_t *thread;
+	int i, queued = 0, r = 0;
+
+	for (i = 0; i < n; i++) {
+		call = mempool_alloc(call_pool);
+		if (!call) {
+			r = -1;
+			continue;
+		}
+
+		if (calls[i].ctx)
+			ctx = (struct _triton_context_t *)calls[i].ctx->tpd;
+		else
+			ctx = (struct _triton_context_t *)default_ctx.tpd;
+
+		call->func = calls[i].func;
+		call->arg = calls[i].arg;
+
+		spin_lock(&ctx->lock);
+		list_add_tail(&call->entry, &ctx->pending_calls);
+		ctx->pending = 1;
+		if (!ctx->thread && !ctx->queued && !ctx->init && !ctx->need_free) {
+			runq_push(ctx, 0);
+			queued++;
+		}
+		spin_unlock(&ctx->lock);
+	}
+
+	__sync_synchronize();
+
+	while (queued-- && idle_count && !need_config_reload && triton_stat.thread_active <= thread_count) {
+		thread = pop_idle_thread(NULL);
+		if (!thread)
+			break;
+		triton_thread_wakeup(thread);
+	}
+
+	return r;
+}
+
+static int __cancel_call(struct triton_context_t *ud, void (*func)(void *), void *arg, int match_arg)
 {
 	struct _triton_context_t *ctx = ud ? (struct _triton_context_t *)ud->tpd : (struct _triton_context_t *)default_ctx.tpd;
 	struct list_head *pos, *n;
 	struct _triton_ctx_call_t *call;
 	LIST_HEAD(rem_calls);
+	int cnt = 0;
 
 	spin_lock(&ctx->lock);
 	list_for_each_safe(pos, n, &ctx->pending_calls) {
 		call = list_entry(pos, typeof(*call), entry);
-		if (call->func == func)
+		if (call->func == func && (!match_arg || call->arg == arg))
 			list_move(&call->entry, &rem_calls);
 	}
 	spin_unlock(&ctx->lock);
 
+	/* calls being executed by ctx_thread may be cancelled by the context itself only */
+	if (this_ctx && this_ctx->tpd == ctx) {
+		list_for_each_safe(pos, n, &ctx->exec_calls) {
+			call = list_entry(pos, typeof(*call), entry);
+			if (call->func == func && (!match_arg || call->arg == arg))
+				list_move(&call->entry, &rem_calls);
+		}
+	}
+
 	while (!list_empty(&rem_calls)) {
 		call = list_first_entry(&rem_calls, typeof(*call), entry);
 		list_del(&call->entry);
 		mempool_free(call);
+		cnt++;
 	}
+
+	return cnt;
+}
+
+void __export triton_cancel_call(struct triton_context_t *ud, void (*func)(void *))
+{
+	__cancel_call(ud, func, NULL, 0);
+}
+
+/* returns number of cancelled calls */
+int __export triton_cancel_call_arg(struct triton_context_t *ud, void (*func)(void *), void *arg)
+{
+	return __cancel_call(ud, func, arg, 1);
 }
 
 void __export triton_collect_cpu_usage(void)
@@ -599,6 +903,7 @@ void __export triton_register_init(int order, void (*func)(void))
 int __export triton_init(const char *conf_file)
 {
 	spinlock_init(&threads_lock);
+	spinlock_init(&idle_lock);
 	spinlock_init(&ctx_list_lock);
 
 	ctx_pool = mempool_create(sizeof(struct _triton_context_t));
@@ -643,19 +948,21 @@ int __export triton_load_modules(const char *mod_sect)
 
 void __export triton_conf_reload(void (*notify)(int))
 {
-	spin_lock(&threads_lock);
+	spin_lock(&idle_lock);
 	need_config_reload = 1;
 	config_reload_notify = notify;
 	if (triton_stat.thread_active == 0) {
-		spin_unlock(&threads_lock);
+		spin_unlock(&idle_lock);
 		__config_reload(notify);
 	} else
-		spin_unlock(&threads_lock);
+		spin_unlock(&idle_lock);
 }
 
 void __export triton_run()
 {
 	struct _triton_thread_t *t;
+	struct _triton_runq_t *rq;
+	struct _triton_context_t *ctx;
 	int i;
 	char *opt;
 	struct timespec ts;
@@ -676,11 +983,25 @@ void __export triton_run()
 	if (opt && atoi(opt) > 0)
 		thread_count_max = atoi(opt);
 
+	rq = _malloc(thread_count * sizeof(*rq));
+	for (i = 0; i < thread_count; i++) {
+		spinlock_init(&rq[i].lock);
+		INIT_LIST_HEAD(&rq[i].ctx_queue);
+	}
+	spin_lock(&threads_lock);
+	list_for_each_entry(ctx, &ctx_queue, entry2)
+		ctx->rq = &rq[0];
+	list_splice_init(&ctx_queue, &rq[0].ctx_queue);
+	runq_count = thread_count;
+	runq = rq;
+	spin_unlock(&threads_lock);
+
 	for(i = 0; i < thread_count; i++) {
 		t = create_thread();
 		if (!t)
 			_exit(-1);
 
+		t->rq = &runq[i];
 		list_add_tail(&t->entry, &threads);
 		pthread_mutex_unlock(&t->sleep_lock);
 	}
@@ -697,7 +1018,7 @@ void __export triton_run()
 void __export triton_terminate()
 {
 	struct _triton_context_t *ctx;
-	int r;
+	struct _triton_thread_t *thread;
 
 	need_terminate = 1;
 
@@ -705,9 +1026,9 @@ void __export triton_terminate()
 	list_for_each_entry(ctx, &ctx_list, entry) {
 		spin_lock(&ctx->lock);
 		ctx->need_close = 1;
-		r = triton_queue_ctx(ctx);
-		if (r)
-			triton_thread_wakeup(ctx->thread);
+		thread = triton_queue_ctx(ctx);
+		if (thread)
+			triton_thread_wakeup(thread);
 		spin_unlock(&ctx->lock);
 	}
 	spin_unlock(&ctx_list_lock);
@@ -31,6 +31,13 @@ struct triton_timer_t
 	void (*expire)(struct triton_timer_t *);
 };
 
+struct triton_ctx_call_t
+{
+	struct triton_context_t *ctx;
+	void (*func)(void *);
+	void *arg;
+};
+
 struct triton_sigchld_handler_t
 {
 	void *tpd;
@@ -62,6 +69,7 @@ struct triton_stat_t
 	unsigned int context_count;
 	unsigned int context_sleeping;
 	unsigned int context_pending;
+	unsigned int context_stolen;
 	unsigned int md_handler_count;
 	unsigned int md_handler_pending;
 	unsigned int timer_count;
@@ -77,7 +85,9 @@ void triton_context_set_priority(struct triton_context_t *, int);
 void triton_context_schedule(void);
 void triton_context_wakeup(struct triton_context_t *);
 int triton_context_call(struct triton_context_t *, void (*func)(void *), void *arg);
+int triton_context_call_batch(struct triton_ctx_call_t *calls, int n);
 void triton_cancel_call(struct triton_context_t *, void (*func)(void *));
+int triton_cancel_call_arg(struct triton_context_t *, void (*func)(void *), void *arg);
 struct triton_context_t *triton_context_self(void);
 
 #define MD_MODE_READ 1
@@ -9,6 +9,12 @@
 #include "spinlock.h"
 #include "mempool.h"
 
+struct _triton_runq_t
+{
+	spinlock_t lock;
+	struct list_head ctx_queue;
+};
+
 struct _triton_thread_t
 {
 	struct list_head entry;
@@ -16,6 +22,9 @@ struct _triton_thread_t
 	pthread_t thread;
 	int terminate;
 	struct _triton_context_t *ctx;
+	struct _triton_runq_t *rq;
+	int futex;
+	int idle;
 	pthread_mutex_t sleep_lock;
 	pthread_cond_t sleep_cond;
 };
@@ -27,12 +36,14 @@ struct _triton_context_t
 
 	spinlock_t lock;
 	struct _triton_thread_t *thread;
+	struct _triton_runq_t *rq; /* run queue while queued, NULL means ctx_queue */
 
 	struct list_head handlers;
 	struct list_head timers;
 	struct list_head pending_handlers;
 	struct list_head pending_timers;
 	struct list_head pending_calls;
+	struct list_head exec_calls;
 
 	int init;
 	int queued;
@@ -47,11 +58,22 @@ struct _triton_context_t
 	void *bf_arg;
 };
 
+/*
+ * pending state of md handlers and timers, only QUEUED items are linked
+ * into ctx->pending_* and only ctx_thread moves an item out of EXEC
+ * without holding ctx->lock
+ */
+#define PENDING_NONE   0
+#define PENDING_QUEUED 1 /* in ctx->pending_handlers/pending_timers */
+#define PENDING_EXEC   2 /* in the batch ctx_thread is running */
+#define PENDING_DEAD   3 /* unregistered while in the batch, ctx_thread frees it */
+
 struct _triton_md_handler_t
 {
 	struct list_head entry;
 	struct list_head entry2;
 	struct _triton_context_t *ctx;
+	struct md_shard_t *shard;
 	struct epoll_event epoll_event;
 	uint32_t trig_epoll_events;
 	int pending;
@@ -65,10 +87,15 @@ struct _triton_timer_t
 {
 	struct list_head entry;
 	struct list_head entry2;
+	struct list_head wentry;
 	struct epoll_event epoll_event;
 	struct _triton_context_t *ctx;
+	uint64_t expires;
+	int period;
+	int level;
+	int idx;
 	int fd;
-	int pending:1;
+	int pending;
 	struct triton_timer_t *ud;
 };
 
@@ -101,10 +128,12 @@ int event_init();
 void md_run();
 void md_terminate();
 void md_rearm(struct _triton_md_handler_t *h);
+void md_free(struct _triton_md_handler_t *h);
 void timer_run();
 void timer_terminate();
+void timer_free(struct _triton_timer_t *t);
 extern struct triton_context_t default_ctx;
-int triton_queue_ctx(struct _triton_context_t*);
+struct _triton_thread_t *triton_queue_ctx(struct _triton_context_t*);
 void triton_thread_wakeup(struct _triton_thread_t*);
 int conf_load(const char *fname);
 int conf_reload(const char *fname);
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 #include "triton.h"
@@ -88,3 +89,57 @@ int __export u_randbuf(void *buf, size_t buf_len, int *err)
 
 	return 0;
 }
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND \
+	do { \
+		v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+		v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+	} while (0)
+
+static uint64_t sip_load64(const uint8_t *p, int n)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = n - 1; i >= 0; i--)
+		r = (r << 8) | p[i];
+
+	return r;
+}
+
+/* SipHash-2-4 of buf keyed with 16 bytes of key */
+uint64_t __export u_siphash(const void *key, const void *buf, size_t len)
+{
+	const uint8_t *k = key, *p = buf, *end = p + (len & ~7);
+	uint64_t k0 = sip_load64(k, 8), k1 = sip_load64(k + 8, 8);
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+	uint64_t v3 = k1 ^ 0x7465646279746573ull;
+	uint64_t m;
+
+	for (; p != end; p += 8) {
+		m = sip_load64(p, 8);
+		v3 ^= m;
+		SIP_ROUND;
+		SIP_ROUND;
+		v0 ^= m;
+	}
+
+	m = ((uint64_t)len << 56) | sip_load64(p, len & 7);
+	v3 ^= m;
+	SIP_ROUND;
+	SIP_ROUND;
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
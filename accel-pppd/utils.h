@@ -1,6 +1,7 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <stdint.h>
 #include <netinet/in.h>
 
 void u_inet_ntoa(in_addr_t, char *str);
@@ -8,5 +9,6 @@ int u_readlong(long int *dst, const char *src, long int min, long int max);
 int u_parse_ip4addr(const char *src, struct in_addr *addr,
 		    const char **err_msg);
 int u_randbuf(void *buf, size_t buf_len, int *err);
+uint64_t u_siphash(const void *key, const void *buf, size_t len);
 
 #endif